@@ -1,9 +1,284 @@
 #include <ba/BundleAdjuster.h>
 #include <ba/SparseBlockMatrixOps.h>
 #include <ba/InterpolationBuffer.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
 
 using namespace ba;
 
+typedef Eigen::SparseBlockMatrix<Eigen::Matrix<double,6,6> > BlockMat66;
+
+/////////////////////////////////////////////////////////////////////////////
+/// Loads a random symmetric positive definite matrix of n x n 6x6 blocks.
+/// Only the upper triangle is stored, with the off diagonal blocks for which
+/// is_stored(row, col) returns true, and the full matrix is returned in dense.
+template<typename IsStored>
+void LoadRandomSpdBlockMatrix(const unsigned int n, IsStored is_stored,
+                              BlockMat66& a, Eigen::MatrixXd& dense)
+{
+    a.resize(n,n);
+    a.setZero();
+    dense = Eigen::MatrixXd::Zero(n*6,n*6);
+    for(unsigned int jj = 0 ; jj < n ; ++jj){
+        for(unsigned int ii = 0 ; ii < jj ; ++ii){
+            if(is_stored(ii,jj)){
+                dense.block<6,6>(ii*6,jj*6) = Eigen::Matrix<double,6,6>::Random();
+                dense.block<6,6>(jj*6,ii*6) = dense.block<6,6>(ii*6,jj*6).transpose();
+                a.coeffRef(ii,jj) = dense.block<6,6>(ii*6,jj*6);
+            }
+        }
+    }
+    // diagonally dominant diagonal blocks make the matrix positive definite
+    for(unsigned int jj = 0 ; jj < n ; ++jj){
+        const Eigen::Matrix<double,6,6> r = Eigen::Matrix<double,6,6>::Random();
+        dense.block<6,6>(jj*6,jj*6) = r*r.transpose() +
+            Eigen::Matrix<double,6,6>::Identity()*(n*6);
+        a.coeffRef(jj,jj) = dense.block<6,6>(jj*6,jj*6);
+    }
+    a.makeCompressed();
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// Reads a Matrix Market file written by WriteMatrixMarket or
+/// WriteDenseMatrixMarket into a dense matrix.
+bool ReadDenseFromMatrixMarket(const std::string& file_name, Eigen::MatrixXd& mat)
+{
+    std::ifstream in(file_name);
+    std::string banner;
+    std::getline(in, banner);
+    const bool is_array = banner.find(" array ") != std::string::npos;
+    const bool is_symmetric = banner.find(" symmetric") != std::string::npos;
+    std::string line;
+    while(std::getline(in, line) && !line.empty() && line[0] == '%'){}
+    std::istringstream size(line);
+    int rows = 0, cols = 0, num_entries = 0;
+    size >> rows >> cols >> num_entries;
+    mat = Eigen::MatrixXd::Zero(rows,cols);
+    if(is_array){
+        for(int ii = 0 ; ii < rows*cols ; ++ii){
+            in >> mat(ii % rows, ii / rows);
+        }
+    }else{
+        for(int ii = 0 ; ii < num_entries ; ++ii){
+            int row, col;
+            double value;
+            in >> row >> col >> value;
+            mat(row-1,col-1) = value;
+            if(is_symmetric){
+                mat(col-1,row-1) = value;
+            }
+        }
+    }
+    return !in.fail();
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// Reads a file written by WriteBinary (for 6x6 double blocks) into a dense
+/// matrix.
+bool ReadDenseFromBinary(const std::string& file_name, Eigen::MatrixXd& mat)
+{
+    std::ifstream in(file_name, std::ios_base::binary);
+    char magic[8];
+    int32_t header[6];
+    in.read(magic, 8);
+    in.read(reinterpret_cast<char*>(header), sizeof(header));
+    if(std::string(magic) != "BASBM01" || header[0] != 6 || header[1] != 6 ||
+       header[5] != sizeof(double)){
+        return false;
+    }
+    std::vector<int32_t> outer(header[3]+1), inner(header[4]);
+    in.read(reinterpret_cast<char*>(outer.data()), outer.size()*sizeof(int32_t));
+    in.read(reinterpret_cast<char*>(inner.data()), inner.size()*sizeof(int32_t));
+    mat = Eigen::MatrixXd::Zero(header[2]*6,header[3]*6);
+    for(int jj = 0 ; jj < header[3] ; ++jj){
+        for(int pp = outer[jj] ; pp < outer[jj+1] ; ++pp){
+            Eigen::Matrix<double,6,6> block;
+            in.read(reinterpret_cast<char*>(block.data()), sizeof(block));
+            mat.block<6,6>(inner[pp]*6,jj*6) = block;
+        }
+    }
+    return !in.fail();
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// A synthetic problem of poses along an arc observing random points with a
+/// linear camera. The first two poses are fixed, which fixes the gauge and the
+/// scale.
+struct SyntheticProblem
+{
+    Eigen::VectorXd cameraParams;
+    // the intrinsics of each pose, if they differ from cameraParams
+    std::vector<Eigen::VectorXd> poseCameraParams;
+    std::vector<Sophus::SE3d, Eigen::aligned_allocator<Sophus::SE3d> > poses;
+    std::vector<Eigen::Vector4d, Eigen::aligned_allocator<Eigen::Vector4d> > landmarks;
+    std::vector<unsigned int> refPoses;
+    // the poses relative to each pose of the rig cameras after the first, which
+    // is at the pose
+    std::vector<Sophus::SE3d, Eigen::aligned_allocator<Sophus::SE3d> > rigCameraPoses;
+    // the pose, landmark and pixel of each measurement
+    std::vector<unsigned int> measPoses;
+    std::vector<unsigned int> measLandmarks;
+    // the camera of each measurement, or the first camera if empty
+    std::vector<unsigned int> measCameras;
+    std::vector<Eigen::Vector2d, Eigen::aligned_allocator<Eigen::Vector2d> > meas;
+};
+
+/////////////////////////////////////////////////////////////////////////////
+/// Creates a synthetic problem with uniform pixel noise of at most noise, and
+/// returns it with perturbed poses and points to start from. The ground truth
+/// is returned in truth.
+SyntheticProblem CreateSyntheticProblem(const double noise, SyntheticProblem& truth)
+{
+    const Eigen::Vector2i imageSize(640,480);
+    const unsigned int numPoses = 8, numLandmarks = 120;
+    truth = SyntheticProblem();
+    truth.cameraParams.resize(4);
+    truth.cameraParams << 500, 500, 320, 240;
+    calibu::LinearCamera<double> camera(truth.cameraParams, imageSize);
+    for(unsigned int ii = 0 ; ii < numPoses ; ++ii){
+        Eigen::Matrix<double,6,1> x;
+        x << 0.4*ii, 0.05*std::sin(ii), 0, 0, -0.03*ii, 0;
+        truth.poses.push_back(Sophus::SE3d::exp(x));
+    }
+
+    while(truth.landmarks.size() < numLandmarks){
+        const Eigen::Vector3d r = Eigen::Vector3d::Random();
+        const Eigen::Vector4d point(1.5 + 2.5*r[0], 1.5*r[1], 6 + 2*r[2], 1);
+        std::vector<unsigned int> poses;
+        std::vector<Eigen::Vector2d, Eigen::aligned_allocator<Eigen::Vector2d> > pixels;
+        for(unsigned int ii = 0 ; ii < numPoses ; ++ii){
+            const Sophus::SE3d t_sw = truth.poses[ii].inverse();
+            if((t_sw*point.head<3>())[2] < 1){
+                continue;
+            }
+            const Eigen::Vector2d p = camera.Transfer3d(t_sw, point.head<3>(), point[3]);
+            if(p[0] >= 0 && p[1] >= 0 && p[0] < imageSize[0] && p[1] < imageSize[1]){
+                poses.push_back(ii);
+                pixels.push_back(p + noise*Eigen::Vector2d::Random());
+            }
+        }
+        if(poses.size() < 3){
+            continue;
+        }
+        for(size_t ii = 0 ; ii < poses.size() ; ++ii){
+            truth.measPoses.push_back(poses[ii]);
+            truth.measLandmarks.push_back(truth.landmarks.size());
+            truth.meas.push_back(pixels[ii]);
+        }
+        truth.refPoses.push_back(poses[0]);
+        truth.landmarks.push_back(point);
+    }
+
+    SyntheticProblem problem = truth;
+    for(unsigned int ii = 2 ; ii < numPoses ; ++ii){
+        problem.poses[ii] = problem.poses[ii]*
+            Sophus::SE3d::exp(Eigen::Matrix<double,6,1>::Random()*0.01);
+    }
+    for(Eigen::Vector4d& point : problem.landmarks){
+        point.head<3>() += Eigen::Vector3d::Random()*0.05;
+    }
+    return problem;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// Options for solving the synthetic problems with Gauss-Newton until the
+/// error stops decreasing, so that all solvers end at the same minimum.
+Options<double> GetSyntheticProblemOptions()
+{
+    Options<double> options;
+    options.use_dogleg = false;
+    options.error_change_threshold = 0;
+    options.param_change_threshold = 0;
+    return options;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// Solves a synthetic problem with num_solves calls of num_iterations
+/// iterations on a BundleAdjuster with the given options, and updates its poses
+/// and points (and camera parameters, if they are calibrated) with the result.
+template<int LmSize, int CalibSize>
+void SolveSyntheticProblem(const Options<double>& options, const unsigned int num_iterations,
+                           SyntheticProblem& problem, const unsigned int num_solves = 1)
+{
+    BundleAdjuster<double,LmSize,6,CalibSize> ba;
+    ba.Init(options, problem.poses.size(), problem.meas.size(), problem.landmarks.size());
+    const std::shared_ptr<calibu::CameraInterface<double> > camera =
+        std::make_shared<calibu::LinearCamera<double> >(problem.cameraParams,
+                                                        Eigen::Vector2i(640,480));
+    ba.AddCamera(camera);
+    for(const Sophus::SE3d& t_pc : problem.rigCameraPoses){
+        const std::shared_ptr<calibu::CameraInterface<double> > rigCamera =
+            std::make_shared<calibu::LinearCamera<double> >(problem.cameraParams,
+                                                            Eigen::Vector2i(640,480));
+        rigCamera->SetPose(t_pc);
+        ba.AddCamera(rigCamera);
+    }
+    for(size_t ii = 0 ; ii < problem.poses.size() ; ++ii){
+        if(options.use_per_pose_cam_params){
+            const Eigen::VectorXd& params = problem.poseCameraParams.empty() ?
+                problem.cameraParams : problem.poseCameraParams[ii];
+            ba.AddPose(problem.poses[ii], params, Eigen::Vector3d::Zero(),
+                       Eigen::Matrix<double,6,1>::Zero(), ii >= 2);
+        }else{
+            ba.AddPose(problem.poses[ii], ii >= 2);
+        }
+    }
+    for(size_t ii = 0 ; ii < problem.landmarks.size() ; ++ii){
+        ba.AddLandmark(problem.landmarks[ii], problem.refPoses[ii], 0, true);
+    }
+    for(size_t ii = 0 ; ii < problem.meas.size() ; ++ii){
+        ba.AddProjectionResidual(problem.meas[ii], problem.measPoses[ii],
+                                 problem.measLandmarks[ii],
+                                 problem.measCameras.empty() ? 0 : problem.measCameras[ii]);
+    }
+    for(unsigned int ii = 0 ; ii < num_solves ; ++ii){
+        ba.Solve(num_iterations);
+    }
+
+    for(size_t ii = 0 ; ii < problem.poses.size() ; ++ii){
+        problem.poses[ii] = ba.GetPose(ii).t_wp;
+    }
+    // inverse depth landmarks are returned with the inverse depth as w
+    for(size_t ii = 0 ; ii < problem.landmarks.size() ; ++ii){
+        problem.landmarks[ii] = ba.GetLandmark(ii)/ba.GetLandmark(ii)[3];
+    }
+    problem.cameraParams = camera->GetParams();
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// Sum of the differences of the poses, points and camera parameters of two
+/// solutions of a synthetic problem.
+double GetSyntheticProblemDifference(const SyntheticProblem& a, const SyntheticProblem& b)
+{
+    double difference = (a.cameraParams - b.cameraParams).norm();
+    for(size_t ii = 0 ; ii < a.poses.size() ; ++ii){
+        difference += (a.poses[ii].inverse()*b.poses[ii]).log().norm();
+    }
+    for(size_t ii = 0 ; ii < a.landmarks.size() ; ++ii){
+        difference += (a.landmarks[ii] - b.landmarks[ii]).norm();
+    }
+    return difference;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// Solves a synthetic problem with the given options, and prints the
+/// difference of the result from a reference solution.
+template<int LmSize, int CalibSize>
+void ReportSyntheticProblemError(const std::string& name, const Options<double>& options,
+                                 const SyntheticProblem& problem,
+                                 const SyntheticProblem& reference)
+{
+    const unsigned int kNumIterations = 20;
+    SyntheticProblem solution = problem;
+    SolveSyntheticProblem<LmSize,CalibSize>(options, kNumIterations, solution);
+    std::cout << "Error for BundleAdjuster (" << name << "): " <<
+                 GetSyntheticProblemDifference(solution, reference) << std::endl;
+}
+
 /////////////////////////////////////////////////////////////////////////////
 int main( int argc, char** argv )
 {
@@ -312,4 +587,362 @@ int main( int argc, char** argv )
 
         std::cout << "Error for SparseBlockAddDenseResult: " << (denseAddRes - sparseDenseRes).norm() << std::endl;
     }
+
+    // test the block cholesky factorizations against Eigen::LLT
+    {
+        const unsigned int uBlocks = 60;
+        for(const double density : {0.05, 0.3, 1.0}){
+            BlockMat66 testBlockMat;
+            Eigen::MatrixXd testMat;
+            LoadRandomSpdBlockMatrix(uBlocks, [&](int,int){ return rand() < density*RAND_MAX; },
+                                     testBlockMat, testMat);
+            const Eigen::MatrixXd rhs = Eigen::MatrixXd::Random(testMat.rows(),3);
+            const Eigen::MatrixXd denseSol = testMat.llt().solve(rhs);
+
+            Eigen::SparseBlockLLT<BlockMat66> sparseLlt;
+            double time = Tic();
+            sparseLlt.compute(testBlockMat);
+            double duration = Toc(time);
+            std::cout << "Error for SparseBlockLLT solve (density " << density << "): " <<
+                         (sparseLlt.solve(rhs) - denseSol).norm() << " info " << sparseLlt.info() <<
+                         " nonZerosL " << sparseLlt.nonZerosL() << " took " << duration << "s" << std::endl;
+
+            Eigen::DenseBlockLLT<double,6> denseLlt;
+            time = Tic();
+            denseLlt.compute(testMat.triangularView<Eigen::Upper>().toDenseMatrix());
+            duration = Toc(time);
+            std::cout << "Error for DenseBlockLLT solve (density " << density << "): " <<
+                         (denseLlt.solve(rhs) - denseSol).norm() << " info " << denseLlt.info() <<
+                         " took " << duration << "s" << std::endl;
+        }
+
+        // refactorization after changing some blocks and after appending
+        // block columns, which should only recompute part of the factor
+        BlockMat66 testBlockMat, testBlockMatAppended;
+        Eigen::MatrixXd testMat, testMatAppended;
+        LoadRandomSpdBlockMatrix(uBlocks+10, [&](int row,int col){ return row+3 >= col || rand() % 20 == 0; },
+                                 testBlockMatAppended, testMatAppended);
+        testBlockMat.resize(uBlocks,uBlocks);
+        for(unsigned int jj = 0 ; jj < uBlocks ; ++jj){
+            for(BlockMat66::InnerIterator it(testBlockMatAppended,jj) ; it ; ++it){
+                if(it.index() < (int)uBlocks){
+                    testBlockMat.coeffRef(it.index(),jj) = it.value();
+                }
+            }
+        }
+        testBlockMat.makeCompressed();
+        testMat = testMatAppended.topLeftCorner(uBlocks*6,uBlocks*6);
+
+        Eigen::SparseBlockLLT<BlockMat66> sparseLlt;
+        sparseLlt.setPartialRefactorization(true);
+        sparseLlt.compute(testBlockMat);
+        Eigen::MatrixXd rhs = Eigen::MatrixXd::Random(testMat.rows(),1);
+        std::cout << "Error for SparseBlockLLT factorization: " <<
+                     (sparseLlt.solve(rhs) - testMat.llt().solve(rhs)).norm() << std::endl;
+
+        const Eigen::Matrix<double,6,6> update = Eigen::Matrix<double,6,6>::Identity();
+        testBlockMat.coeffRef(uBlocks-2,uBlocks-2) += update;
+        testBlockMatAppended.coeffRef(uBlocks-2,uBlocks-2) += update;
+        testMat.block<6,6>((uBlocks-2)*6,(uBlocks-2)*6) += update;
+        testMatAppended.block<6,6>((uBlocks-2)*6,(uBlocks-2)*6) += update;
+        sparseLlt.factorize(testBlockMat);
+        std::cout << "Error for SparseBlockLLT refactorization: " <<
+                     (sparseLlt.solve(rhs) - testMat.llt().solve(rhs)).norm() << " refactorized " <<
+                     sparseLlt.numRefactorizedSupernodes() << " of " << sparseLlt.numSupernodes() <<
+                     " supernodes" << std::endl;
+
+        sparseLlt.compute(testBlockMatAppended);
+        rhs = Eigen::MatrixXd::Random(testMatAppended.rows(),1);
+        std::cout << "Error for SparseBlockLLT refactorization (appended): " <<
+                     (sparseLlt.solve(rhs) - testMatAppended.llt().solve(rhs)).norm() << " refactorized " <<
+                     sparseLlt.numRefactorizedSupernodes() << " of " << sparseLlt.numSupernodes() <<
+                     " supernodes" << std::endl;
+
+        // the selected inverse has every block of the input pattern
+        const Eigen::MatrixXd denseInv = testMatAppended.inverse();
+        sparseLlt.computeSelectedInverse();
+        double error = 0;
+        int numMissing = 0;
+        for(int jj = 0 ; jj < testBlockMatAppended.outerSize() ; ++jj){
+            for(BlockMat66::InnerIterator it(testBlockMatAppended,jj) ; it ; ++it){
+                Eigen::Matrix<double,6,6> block;
+                if(sparseLlt.selectedInverseBlock(it.index(),jj,block)){
+                    error += (block - denseInv.block<6,6>(it.index()*6,jj*6)).norm();
+                }else{
+                    numMissing++;
+                }
+            }
+        }
+        std::cout << "Error for SparseBlockLLT selected inverse: " << error <<
+                     " missing blocks " << numMissing << std::endl;
+    }
+
+    // test the fill reducing orderings on an arrow and a grid pattern, both of
+    // which fill in badly in the natural order
+    {
+        const int uGrid = 12;
+        for(int pattern = 0 ; pattern < 2 ; ++pattern){
+            BlockMat66 testBlockMat;
+            Eigen::MatrixXd testMat;
+            if(pattern == 0){
+                LoadRandomSpdBlockMatrix(uGrid*uGrid, [](int row,int){ return row == 0; },
+                                         testBlockMat, testMat);
+            }else{
+                LoadRandomSpdBlockMatrix(uGrid*uGrid, [&](int row,int col){
+                    return (col - row == 1 && col % uGrid != 0) || col - row == uGrid; },
+                                         testBlockMat, testMat);
+            }
+            Eigen::SparseBlockLLT<BlockMat66> sparseLlt;
+            sparseLlt.analyzePattern(testBlockMat);
+            std::cout << (pattern == 0 ? "Arrow" : "Grid") << " pattern: nonZerosA " <<
+                         sparseLlt.nonZerosA() << ", nonZerosL with the natural ordering " <<
+                         sparseLlt.nonZerosL() << std::endl;
+
+            for(int ordering = 0 ; ordering < 2 ; ++ordering){
+                std::vector<int> perm;
+                if(ordering == 0){
+                    Eigen::SparseBlockAmdOrdering(testBlockMat, perm);
+                }else{
+                    Eigen::SparseBlockNestedDissectionOrdering(testBlockMat, perm, 8);
+                }
+                std::vector<int> sortedPerm = perm;
+                std::sort(sortedPerm.begin(), sortedPerm.end());
+                bool isPermutation = sortedPerm.size() == (size_t)testBlockMat.outerSize();
+                for(size_t ii = 0 ; isPermutation && ii < sortedPerm.size() ; ++ii){
+                    isPermutation = sortedPerm[ii] == (int)ii;
+                }
+
+                BlockMat66 permutedBlockMat;
+                Eigen::SparseBlockPermuteSymmetricUpper(testBlockMat, perm, permutedBlockMat);
+                sparseLlt.compute(permutedBlockMat);
+                const Eigen::VectorXd rhs = Eigen::VectorXd::Random(testMat.rows());
+                Eigen::VectorXd permutedRhs(rhs.rows());
+                for(size_t ii = 0 ; isPermutation && ii < perm.size() ; ++ii){
+                    permutedRhs.segment<6>(perm[ii]*6) = rhs.segment<6>(ii*6);
+                }
+                const Eigen::VectorXd permutedSol = sparseLlt.solve(permutedRhs);
+                Eigen::VectorXd sol(rhs.rows());
+                for(size_t ii = 0 ; isPermutation && ii < perm.size() ; ++ii){
+                    sol.segment<6>(ii*6) = permutedSol.segment<6>(perm[ii]*6);
+                }
+                std::cout << (ordering == 0 ? "AMD" : "Nested dissection") <<
+                             " ordering: is a permutation " << isPermutation << ", nonZerosL " <<
+                             sparseLlt.nonZerosL() << ", error for the permuted solve " <<
+                             (isPermutation ? (testMat*sol - rhs).norm() : -1) << std::endl;
+            }
+        }
+    }
+
+    // test the exports of sparse block and dense matrices with a round trip
+    {
+        BlockMat66 testBlockMat;
+        Eigen::MatrixXd testMat;
+        LoadRandomSpdBlockMatrix(20, [](int,int){ return rand() % 4 == 0; }, testBlockMat, testMat);
+        Eigen::MatrixXd storedMat(testMat.rows(),testMat.cols());
+        Eigen::LoadDenseFromSparse(testBlockMat,storedMat);
+        const Eigen::MatrixXd testVec = Eigen::MatrixXd::Random(testMat.rows(),2);
+
+        Eigen::MatrixXd readMat;
+        bool success = Eigen::WriteMatrixMarket("math_test.mtx", testBlockMat) &&
+                       ReadDenseFromMatrixMarket("math_test.mtx", readMat);
+        std::cout << "Error for WriteMatrixMarket: " <<
+                     (success ? (readMat - storedMat).norm() : -1) << std::endl;
+        success = Eigen::WriteMatrixMarket("math_test.mtx", testBlockMat, true) &&
+                  ReadDenseFromMatrixMarket("math_test.mtx", readMat);
+        std::cout << "Error for WriteMatrixMarket (symmetric): " <<
+                     (success ? (readMat - testMat).norm() : -1) << std::endl;
+        success = Eigen::WriteDenseMatrixMarket("math_test.mtx", testVec) &&
+                  ReadDenseFromMatrixMarket("math_test.mtx", readMat);
+        std::cout << "Error for WriteDenseMatrixMarket: " <<
+                     (success ? (readMat - testVec).norm() : -1) << std::endl;
+        success = Eigen::WriteBinary("math_test.bin", testBlockMat) &&
+                  ReadDenseFromBinary("math_test.bin", readMat);
+        std::cout << "Error for WriteBinary: " <<
+                     (success ? (readMat - storedMat).norm() : -1) << std::endl;
+        std::remove("math_test.mtx");
+        std::remove("math_test.bin");
+    }
+
+    // test the batched projection kernels against calibu
+    {
+        const Eigen::Vector2i imageSize(640,480);
+        Eigen::VectorXd linearParams(4), fovParams(5), poly3Params(7);
+        linearParams << 500, 510, 320, 240;
+        fovParams << 500, 510, 320, 240, 0.9;
+        poly3Params << 500, 510, 320, 240, 0.1, -0.02, 0.003;
+        std::vector<std::shared_ptr<calibu::CameraInterface<double> > > cameras;
+        cameras.push_back(std::make_shared<calibu::LinearCamera<double> >(linearParams, imageSize));
+        cameras.push_back(std::make_shared<calibu::FovCamera<double> >(fovParams, imageSize));
+        cameras.push_back(std::make_shared<calibu::Poly3Camera<double> >(poly3Params, imageSize));
+
+        const int n = 50;
+        std::vector<Sophus::SE3d> transforms;
+        std::vector<Eigen::Vector4d, Eigen::aligned_allocator<Eigen::Vector4d> > points;
+        for(int ii = 0 ; ii < n ; ++ii){
+            transforms.push_back(Sophus::SE3d::exp(Eigen::Matrix<double,6,1>::Random()*0.3));
+            Eigen::Vector4d point = Eigen::Vector4d::Random();
+            point[2] += 2;
+            point[3] = 0.5 + 0.3*point[3];
+            points.push_back(point);
+        }
+        // the center of the image, where the distortion factors are special cased
+        transforms[0] = Sophus::SE3d();
+        points[0] << 0, 0, 1, 0.1;
+
+        ProjectionBatch<double> batch;
+        for(const std::shared_ptr<calibu::CameraInterface<double> >& cam : cameras){
+            const CameraModel model = GetProjectionModel(*cam);
+            for(int ii = 0 ; ii < n ; ++ii){
+                batch.Set(ii, transforms[ii], points[ii]);
+            }
+            batch.SetParams(cam->GetParams(), n);
+            ProjectBatch(model, batch, n, true);
+
+            double pixelError = 0, jacobianError = 0;
+            for(int ii = 0 ; ii < n ; ++ii){
+                const Eigen::Vector2d p = cam->Transfer3d(transforms[ii], points[ii].head<3>(), points[ii][3]);
+                pixelError += (p - batch.p.col(ii).matrix()).norm();
+                const Eigen::Vector4d x_c = MultHomogeneous(transforms[ii], points[ii]);
+                const Eigen::Matrix<double,2,3> dp_dx = cam->dTransfer3d_dray(
+                    Sophus::SE3d(), x_c.head<3>(), x_c[3]).leftCols<3>();
+                Eigen::Matrix<double,2,3> batch_dp_dx;
+                batch_dp_dx << batch.dp_dx.col(ii).head<3>().transpose().matrix(),
+                               batch.dp_dx.col(ii).tail<3>().transpose().matrix();
+                jacobianError += (dp_dx - batch_dp_dx).norm();
+            }
+            std::cout << "Error for ProjectBatch (model " << model << "): " << pixelError <<
+                         ", jacobians: " << jacobianError << std::endl;
+        }
+    }
+
+    // solve a synthetic problem with each solver and assembly mode, and compare
+    // the result with the dense solve of the reduced camera matrix
+    {
+        const unsigned int kNumIterations = 20;
+        SyntheticProblem truth;
+        const SyntheticProblem problem = CreateSyntheticProblem(0.5, truth);
+        Options<double> denseOptions = GetSyntheticProblemOptions();
+        denseOptions.use_sparse_solver = false;
+        SyntheticProblem denseSolution = problem;
+        SolveSyntheticProblem<3,0>(denseOptions, kNumIterations, denseSolution);
+
+        Options<double> options = GetSyntheticProblemOptions();
+        options.use_pcg_solver = true;
+        ReportSyntheticProblemError<3,0>("conjugate gradients", options, problem, denseSolution);
+
+        options = GetSyntheticProblemOptions();
+        options.use_mixed_precision_solver = true;
+        ReportSyntheticProblemError<3,0>("mixed precision", options, problem, denseSolution);
+
+        options = GetSyntheticProblemOptions();
+        options.use_levenberg_marquardt = true;
+        ReportSyntheticProblemError<3,0>("Levenberg-Marquardt", options, problem, denseSolution);
+
+        options = GetSyntheticProblemOptions();
+        options.use_direct_hessian_assembly = true;
+        ReportSyntheticProblemError<3,0>("direct assembly", options, problem, denseSolution);
+
+        options.use_fused_landmark_linearization = true;
+        ReportSyntheticProblemError<3,0>("fused linearization", options, problem, denseSolution);
+
+        // landmarks are eliminated in parallel in every mode, so also check the
+        // default sparse solve, and that a noise free problem is solved exactly
+        ReportSyntheticProblemError<3,0>("sparse", GetSyntheticProblemOptions(), problem,
+                                         denseSolution);
+        SyntheticProblem exactTruth;
+        const SyntheticProblem exactProblem = CreateSyntheticProblem(0, exactTruth);
+        ReportSyntheticProblemError<3,0>("noise free", GetSyntheticProblemOptions(),
+                                         exactProblem, exactTruth);
+
+        // the cached patterns of the reduced system are refilled by each Solve
+        SyntheticProblem repeatedSolution = problem;
+        SolveSyntheticProblem<3,0>(GetSyntheticProblemOptions(), 5, repeatedSolution, 4);
+        std::cout << "Error for BundleAdjuster (repeated solves): " <<
+                     GetSyntheticProblemDifference(repeatedSolution, denseSolution) << std::endl;
+
+        // inverse depth landmarks have their own Schur complement path
+        SyntheticProblem denseInverseDepthSolution = problem;
+        SolveSyntheticProblem<1,0>(denseOptions, kNumIterations, denseInverseDepthSolution);
+        ReportSyntheticProblemError<1,0>("inverse depth", GetSyntheticProblemOptions(), problem,
+                                         denseInverseDepthSolution);
+
+        // calibrate the linear camera from perturbed intrinsics, which adds the
+        // calibration border to the reduced system
+        SyntheticProblem calibrationProblem = problem;
+        calibrationProblem.cameraParams += Eigen::Vector4d(5, -5, 2, -2);
+        SyntheticProblem denseCalibrationSolution = calibrationProblem;
+        SolveSyntheticProblem<3,4>(denseOptions, kNumIterations, denseCalibrationSolution);
+        ReportSyntheticProblemError<3,4>("calibration", GetSyntheticProblemOptions(),
+                                         calibrationProblem, denseCalibrationSolution);
+        options = GetSyntheticProblemOptions();
+        options.use_block_sparse_solver = true;
+        options.pose_ordering = OrderingAmd;
+        ReportSyntheticProblemError<3,4>("block sparse calibration", options,
+                                         calibrationProblem, denseCalibrationSolution);
+
+        // the landmarks of the noise free problem are back-substituted exactly
+        SyntheticProblem exactSolution = exactProblem;
+        SolveSyntheticProblem<3,0>(GetSyntheticProblemOptions(), kNumIterations, exactSolution);
+        double landmarkError = 0;
+        for(size_t ii = 0 ; ii < exactSolution.landmarks.size() ; ++ii){
+            landmarkError += (exactSolution.landmarks[ii] - exactTruth.landmarks[ii]).norm();
+        }
+        std::cout << "Error for BundleAdjuster (back-substituted landmarks): " <<
+                     landmarkError << std::endl;
+
+        // per pose intrinsics equal to the shared ones must not change the result
+        options = GetSyntheticProblemOptions();
+        options.use_per_pose_cam_params = true;
+        ReportSyntheticProblemError<3,0>("per pose intrinsics", options, problem, denseSolution);
+
+        // the dogleg step only evaluates costs, and must end at the same minimum
+        options = GetSyntheticProblemOptions();
+        options.use_dogleg = true;
+        ReportSyntheticProblemError<3,0>("dogleg", options, problem, denseSolution);
+
+        // measure the noise free problem with different intrinsics for each pose
+        SyntheticProblem perPoseTruth = exactTruth;
+        for(size_t ii = 0 ; ii < perPoseTruth.poses.size() ; ++ii){
+            Eigen::VectorXd params = perPoseTruth.cameraParams;
+            params.head<2>() += Eigen::Vector2d(10, 10)*ii;
+            perPoseTruth.poseCameraParams.push_back(params);
+        }
+        for(size_t ii = 0 ; ii < perPoseTruth.meas.size() ; ++ii){
+            const unsigned int pose = perPoseTruth.measPoses[ii];
+            const Eigen::Vector4d& point = perPoseTruth.landmarks[perPoseTruth.measLandmarks[ii]];
+            const calibu::LinearCamera<double> camera(perPoseTruth.poseCameraParams[pose],
+                                                      Eigen::Vector2i(640,480));
+            perPoseTruth.meas[ii] = camera.Transfer3d(perPoseTruth.poses[pose].inverse(),
+                                                      point.head<3>(), point[3]);
+        }
+        SyntheticProblem perPoseProblem = exactProblem;
+        perPoseProblem.poseCameraParams = perPoseTruth.poseCameraParams;
+        perPoseProblem.meas = perPoseTruth.meas;
+        options = GetSyntheticProblemOptions();
+        options.use_per_pose_cam_params = true;
+        ReportSyntheticProblemError<3,0>("different per pose intrinsics", options,
+                                         perPoseProblem, perPoseTruth);
+
+        // measure the landmarks with a second rig camera as well, whose relative
+        // transforms are cached apart from those of the first
+        SyntheticProblem rigProblem = problem;
+        rigProblem.rigCameraPoses.push_back(
+            Sophus::SE3d(Eigen::Matrix3d::Identity(), Eigen::Vector3d(0.2, 0, 0)));
+        rigProblem.measCameras.assign(rigProblem.meas.size(), 0);
+        const calibu::LinearCamera<double> camera(truth.cameraParams, Eigen::Vector2i(640,480));
+        for(size_t ii = 0 ; ii < truth.meas.size() ; ++ii){
+            const unsigned int pose = truth.measPoses[ii];
+            const Eigen::Vector4d& point = truth.landmarks[truth.measLandmarks[ii]];
+            rigProblem.measPoses.push_back(pose);
+            rigProblem.measLandmarks.push_back(truth.measLandmarks[ii]);
+            rigProblem.measCameras.push_back(1);
+            rigProblem.meas.push_back(camera.Transfer3d(
+                (truth.poses[pose]*rigProblem.rigCameraPoses[0]).inverse(),
+                point.head<3>(), point[3]));
+        }
+        SyntheticProblem denseRigSolution = rigProblem;
+        SolveSyntheticProblem<1,0>(denseOptions, kNumIterations, denseRigSolution);
+        ReportSyntheticProblemError<1,0>("rig", GetSyntheticProblemOptions(), rigProblem,
+                                         denseRigSolution);
+    }
 }
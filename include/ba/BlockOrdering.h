@@ -0,0 +1,313 @@
+#ifndef BLOCKORDERING_H
+#define BLOCKORDERING_H
+
+#include <algorithm>
+#include <vector>
+#include <Eigen/Sparse>
+#include <Eigen/OrderingMethods>
+
+namespace Eigen {
+
+/// Compact copy of the block pattern of a sparse block matrix, used to detect
+/// whether the pattern changed since a result depending on it was computed.
+struct SparseBlockPattern
+{
+  std::vector<int> outer;
+  std::vector<int> inner;
+
+  template<typename MatrixType>
+  void Assign(const MatrixType& a)
+  {
+    outer.resize(a.outerSize() + 1);
+    inner.clear();
+    for (int jj = 0; jj < a.outerSize(); ++jj) {
+      outer[jj] = inner.size();
+      for (typename MatrixType::InnerIterator it(a, jj); it; ++it) {
+        inner.push_back(it.index());
+      }
+    }
+    outer[a.outerSize()] = inner.size();
+  }
+
+  template<typename MatrixType>
+  bool Matches(const MatrixType& a) const
+  {
+    if (outer.size() != size_t(a.outerSize() + 1)) {
+      return false;
+    }
+    size_t pos = 0;
+    for (int jj = 0; jj < a.outerSize(); ++jj) {
+      if (outer[jj] != (int)pos) {
+        return false;
+      }
+      for (typename MatrixType::InnerIterator it(a, jj); it; ++it) {
+        if (pos >= inner.size() || inner[pos] != it.index()) {
+          return false;
+        }
+        ++pos;
+      }
+    }
+    return outer.back() == (int)pos;
+  }
+
+  /// \return true if a only extends the pattern with new block rows and
+  /// columns, i.e. its leading block columns, restricted to the leading block
+  /// rows, match the stored pattern.
+  template<typename MatrixType>
+  bool IsExtendedBy(const MatrixType& a) const
+  {
+    const int num_cols = outer.size() - 1;
+    if (outer.empty() || a.outerSize() < num_cols) {
+      return false;
+    }
+    for (int jj = 0; jj < num_cols; ++jj) {
+      int pos = outer[jj];
+      for (typename MatrixType::InnerIterator it(a, jj); it; ++it) {
+        if (it.index() >= num_cols) {
+          continue;
+        }
+        if (pos >= outer[jj + 1] || inner[pos] != it.index()) {
+          return false;
+        }
+        ++pos;
+      }
+      if (pos != outer[jj + 1]) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+/// Builds the (symmetric, loop free) adjacency of the block graph of a square
+/// block sparse matrix. Either triangle, or both, may be stored.
+template<typename MatrixType>
+static void SparseBlockAdjacency(const MatrixType& a,
+                                 std::vector<std::vector<int>>& adj)
+{
+  const int n = a.outerSize();
+  adj.assign(n, std::vector<int>());
+  for (int jj = 0; jj < n; ++jj) {
+    for (typename MatrixType::InnerIterator it(a, jj); it; ++it) {
+      const int ii = it.index();
+      if (ii != jj) {
+        adj[ii].push_back(jj);
+        adj[jj].push_back(ii);
+      }
+    }
+  }
+  for (std::vector<int>& nodes : adj) {
+    std::sort(nodes.begin(), nodes.end());
+    nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+  }
+}
+
+namespace internal {
+/// Orders the given nodes (a subgraph of adj) with approximate minimum
+/// degree, appending them to order. local must be -1 for all nodes of the
+/// graph, and is restored on return.
+inline void AmdOrderSubgraph(const std::vector<std::vector<int>>& adj,
+                             const std::vector<int>& nodes,
+                             std::vector<int>& local,
+                             std::vector<int>& order)
+{
+  const int n = nodes.size();
+  for (int ii = 0; ii < n; ++ii) {
+    local[nodes[ii]] = ii;
+  }
+
+  std::vector<Triplet<double>> triplets;
+  for (int ii = 0; ii < n; ++ii) {
+    triplets.push_back(Triplet<double>(ii, ii, 1));
+    for (const int neighbour : adj[nodes[ii]]) {
+      if (local[neighbour] != -1) {
+        triplets.push_back(Triplet<double>(local[neighbour], ii, 1));
+      }
+    }
+  }
+  SparseMatrix<double> pattern(n, n);
+  pattern.setFromTriplets(triplets.begin(), triplets.end());
+
+  // The AMD result maps new positions to old ones.
+  PermutationMatrix<Dynamic, Dynamic, int> perm_inv;
+  AMDOrdering<int> amd;
+  amd(pattern, perm_inv);
+  for (int ii = 0; ii < n; ++ii) {
+    order.push_back(nodes[perm_inv.indices()[ii]]);
+  }
+
+  for (int ii = 0; ii < n; ++ii) {
+    local[nodes[ii]] = -1;
+  }
+}
+
+/// Breadth first level structure of the connected component of root within
+/// the nodes where label == current_label. Returns the number of levels.
+inline int BfsLevels(const std::vector<std::vector<int>>& adj,
+                     const int root, const std::vector<int>& label,
+                     const int current_label, std::vector<int>& level,
+                     std::vector<int>& visited)
+{
+  visited.clear();
+  visited.push_back(root);
+  level[root] = 0;
+  int num_levels = 1;
+  for (size_t head = 0; head < visited.size(); ++head) {
+    const int node = visited[head];
+    for (const int neighbour : adj[node]) {
+      if (label[neighbour] == current_label && level[neighbour] == -1) {
+        level[neighbour] = level[node] + 1;
+        num_levels = std::max(num_levels, level[neighbour] + 1);
+        visited.push_back(neighbour);
+      }
+    }
+  }
+  return num_levels;
+}
+
+inline void NestedDissection(const std::vector<std::vector<int>>& adj,
+                             const std::vector<int>& nodes,
+                             const int leaf_size, std::vector<int>& label,
+                             int& next_label, std::vector<int>& level,
+                             std::vector<int>& local, std::vector<int>& order)
+{
+  if ((int)nodes.size() <= leaf_size) {
+    AmdOrderSubgraph(adj, nodes, local, order);
+    return;
+  }
+
+  const int current_label = next_label++;
+  for (const int node : nodes) {
+    label[node] = current_label;
+  }
+
+  // Find a pseudo peripheral node, by repeatedly restarting the breadth
+  // first search from a node of the last level.
+  std::vector<int> visited;
+  int root = nodes[0];
+  int num_levels = 0;
+  for (int sweep = 0; sweep < 4; ++sweep) {
+    const int levels = BfsLevels(adj, root, label, current_label, level,
+                                 visited);
+    const int last = visited.back();
+    for (const int node : visited) {
+      level[node] = -1;
+    }
+    if (levels <= num_levels) {
+      break;
+    }
+    num_levels = levels;
+    root = last;
+  }
+  num_levels = BfsLevels(adj, root, label, current_label, level, visited);
+
+  std::vector<int> part_a, part_b, separator;
+  if (num_levels < 3) {
+    // No useful separator, the component is too densely connected.
+    for (const int node : visited) {
+      level[node] = -1;
+    }
+    AmdOrderSubgraph(adj, nodes, local, order);
+    return;
+  }
+
+  // Split at the level where half the nodes of the subgraph are reached.
+  // Nodes not reached (other components) go to the second part. The split
+  // level is never the last one, so that both parts are smaller than the
+  // subgraph (e.g. for a star, whose last level does not connect further).
+  std::vector<int> level_count(num_levels, 0);
+  for (const int node : visited) {
+    level_count[level[node]]++;
+  }
+  int split_level = 1;
+  int count = level_count[0];
+  while (split_level < num_levels - 2 &&
+         count + level_count[split_level] < (int)nodes.size() / 2) {
+    count += level_count[split_level];
+    split_level++;
+  }
+
+  for (const int node : nodes) {
+    const int node_level = level[node];
+    if (node_level == -1 || node_level > split_level) {
+      part_b.push_back(node);
+    } else if (node_level < split_level) {
+      part_a.push_back(node);
+    } else {
+      // Separator nodes without neighbours in the next level can be moved
+      // into the first part.
+      bool connects = false;
+      for (const int neighbour : adj[node]) {
+        if (label[neighbour] == current_label &&
+            level[neighbour] == split_level + 1) {
+          connects = true;
+          break;
+        }
+      }
+      (connects ? separator : part_a).push_back(node);
+    }
+  }
+  for (const int node : visited) {
+    level[node] = -1;
+  }
+
+  NestedDissection(adj, part_a, leaf_size, label, next_label, level, local,
+                   order);
+  NestedDissection(adj, part_b, leaf_size, label, next_label, level, local,
+                   order);
+  AmdOrderSubgraph(adj, separator, local, order);
+}
+} // end namespace internal
+
+/// Computes a fill reducing ordering of the block graph of a with approximate
+/// minimum degree. perm[ii] is the new position of block ii.
+template<typename MatrixType>
+static void SparseBlockAmdOrdering(const MatrixType& a, std::vector<int>& perm)
+{
+  std::vector<std::vector<int>> adj;
+  SparseBlockAdjacency(a, adj);
+  const int n = adj.size();
+  std::vector<int> nodes(n), local(n, -1), order;
+  for (int ii = 0; ii < n; ++ii) {
+    nodes[ii] = ii;
+  }
+  order.reserve(n);
+  internal::AmdOrderSubgraph(adj, nodes, local, order);
+
+  perm.resize(n);
+  for (int ii = 0; ii < n; ++ii) {
+    perm[order[ii]] = ii;
+  }
+}
+
+/// Computes a fill reducing ordering of the block graph of a with nested
+/// dissection. The graph is recursively bisected with separators taken from
+/// breadth first level structures, and subgraphs of at most leaf_size blocks
+/// are ordered with approximate minimum degree. perm[ii] is the new position
+/// of block ii.
+template<typename MatrixType>
+static void SparseBlockNestedDissectionOrdering(const MatrixType& a,
+                                                std::vector<int>& perm,
+                                                const int leaf_size = 32)
+{
+  std::vector<std::vector<int>> adj;
+  SparseBlockAdjacency(a, adj);
+  const int n = adj.size();
+  std::vector<int> nodes(n), label(n, -1), level(n, -1), local(n, -1), order;
+  for (int ii = 0; ii < n; ++ii) {
+    nodes[ii] = ii;
+  }
+  order.reserve(n);
+  int next_label = 0;
+  internal::NestedDissection(adj, nodes, std::max(leaf_size, 1), label,
+                             next_label, level, local, order);
+
+  perm.resize(n);
+  for (int ii = 0; ii < n; ++ii) {
+    perm[order[ii]] = ii;
+  }
+}
+
+} // end namespace Eigen
+
+#endif // BLOCKORDERING_H
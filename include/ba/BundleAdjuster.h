@@ -2,6 +2,8 @@
 #define BUNDLEADUJSTER_H
 
 #include <sophus/se3.hpp>
+#include <array>
+#include <string>
 #include <vector>
 #include <Eigen/StdVector>
 #include <calibu/Calibu.h>
@@ -14,6 +16,12 @@
 #include <Eigen/Sparse>
 #include "SparseBlockMatrix.h"
 #include "SparseBlockMatrixOps.h"
+#include "SparseBlockExport.h"
+#include "ProjectionKernels.h"
+#include "SparseBlockCholesky.h"
+#include "SparseSelectedInverse.h"
+#include "DenseBlockCholesky.h"
+#include "BlockOrdering.h"
 #include "CeresCostFunctions.h"
 #include "Utils.h"
 #include "Types.h"
@@ -35,6 +43,23 @@ using BlockMat = Eigen::SparseBlockMatrix<Scalar>;
 template<typename Scalar>
 using aligned_vector = std::vector<Scalar, Eigen::aligned_allocator<Scalar>>;
 
+// Ordering of the poses in the reduced camera matrix, computed on the block
+// (covisibility) graph of the poses.
+enum PoseOrdering
+{
+  OrderingNatural,
+  OrderingAmd,
+  OrderingNestedDissection
+};
+
+// File format of the matrices written with write_reduced_camera_matrix.
+enum MatrixExportFormat
+{
+  ExportCsv,           // Dense text files, only usable for small problems.
+  ExportMatrixMarket,  // Matrix Market coordinate (sparse) or array (dense).
+  ExportBinary         // See SparseBlockExport.h.
+};
+
 enum OptimizationResult
 {
   Success,
@@ -65,6 +90,30 @@ struct SolutionSummary
   MatrixXt calibration_marginals;
   OptimizationResult result;
 
+  // Conjugate gradient iterations of the last linear solve, and in total
+  // over the last call to Solve (including marginal computations).
+  uint32_t pcg_iterations = 0;
+  uint32_t num_pcg_iterations = 0;
+
+  // Scalar non zeros in the upper triangle of the reduced camera matrix and in
+  // its factor, as a measure of the fill-in of the pose ordering. The block
+  // sparse solver does not count the dense calibration border.
+  uint32_t reduced_system_nonzeros = 0;
+  uint32_t factor_nonzeros = 0;
+
+  // Iterative refinement steps of the last mixed precision solve.
+  uint32_t refinement_iterations = 0;
+
+  // Supernodes recomputed by the last block sparse factorization, out of the
+  // total number of supernodes.
+  uint32_t num_refactorized_supernodes = 0;
+  uint32_t num_supernodes = 0;
+
+  // Levenberg-Marquardt damping of every step tried over the last call to
+  // Solve, accepted or not, and the number of rejected steps.
+  std::vector<Scalar> lm_lambdas;
+  uint32_t num_lm_rejected_steps = 0;
+
   bool IsResultGood()
   { return (result != SolverError) && (result != FactorizationError); }
 };
@@ -88,11 +137,87 @@ struct Options
   uint32_t dogleg_max_inner_iterations = 100;
   bool apply_results = true;
   bool use_dogleg = true;
+  // Levenberg-Marquardt instead of dogleg or Gauss-Newton. The reduced camera
+  // matrix is damped with lambda * diag(S). A rejected step only re-applies
+  // the damping and refactors numerically, the problem is not rebuilt.
+  bool use_levenberg_marquardt = false;
+  Scalar lm_initial_lambda = 1e-4;
+  Scalar lm_lambda_increase = 10;
+  Scalar lm_lambda_decrease = 0.1;
+  Scalar lm_min_lambda = 1e-12;
+  Scalar lm_max_lambda = 1e16;
+  uint32_t lm_max_inner_iterations = 10;
   bool use_triangular_matrices = true;
+  // Accumulate the pose Hessian, the pose/landmark coupling and the
+  // calibration terms directly from the residual jacobians, without building
+  // the block sparse jacobians and their transposes. Not used with
+  // write_reduced_camera_matrix, which writes out the jacobians.
+  bool use_direct_hessian_assembly = false;
+  // With direct assembly, linearize the projection residuals of each
+  // landmark track in the task that forms the landmark's hessian block and
+  // pose coupling, instead of in a separate pass over all residuals.
+  bool use_fused_landmark_linearization = false;
   bool use_sparse_solver = true;
+  // Factor the dense reduced camera matrix (use_sparse_solver = false) with
+  // the multithreaded blocked LLt instead of a single threaded LDLT.
+  bool use_blocked_dense_solver = false;
+  // Factor the reduced camera matrix with the multithreaded supernodal block
+  // Cholesky instead of SimplicialLDLT. Only used with use_sparse_solver.
+  bool use_block_sparse_solver = false;
+  // Factorize a single precision copy of the reduced camera matrix with
+  // SimplicialLDLT, and recover the accuracy of the double precision solve
+  // with iterative refinement. Falls back to the double precision
+  // factorization if the refinement does not converge.
+  bool use_mixed_precision_solver = false;
+  uint32_t mixed_precision_max_refinement_iterations = 10;
+  // Relative residual |b - S x| / |b| at which the refinement stops.
+  Scalar mixed_precision_tolerance = 1e-9;
+  // Fill reducing ordering of the poses for the sparse solvers. With
+  // OrderingNatural the poses are kept in opt_id order, and SimplicialLDLT
+  // orders the scalar reduced camera matrix itself with AMD. The block sparse
+  // solver has no ordering of its own, so it should be used with OrderingAmd
+  // or OrderingNestedDissection.
+  PoseOrdering pose_ordering = OrderingNatural;
+  // Incremental mode for the block sparse solver: only the supernodes of the
+  // factor affected by changed blocks of the reduced camera matrix are
+  // recomputed, and poses appended to the problem are appended to the
+  // existing pose ordering instead of reordering all poses. Blocks that
+  // changed by less than relinearization_threshold (relative) keep their
+  // previous value in the factor, and the solve is refined against the
+  // actual matrix.
+  bool use_incremental_factorization = false;
+  Scalar relinearization_threshold = 0;
+  uint32_t incremental_max_refinement_iterations = 5;
+  Scalar incremental_refinement_tolerance = 1e-9;
+  // Solve the reduced camera system with block-Jacobi preconditioned
+  // conjugate gradients. The Schur complement is applied implicitly and
+  // never formed.
+  bool use_pcg_solver = false;
+  uint32_t pcg_max_iterations = 500;
+  // The conjugate gradient solve stops when |r| < eta * |b|, with the forcing
+  // term eta = min(pcg_max_forcing, sqrt(|b|)), but no less than
+  // pcg_tolerance.
+  Scalar pcg_tolerance = 1e-6;
+  Scalar pcg_max_forcing = 0.1;
+  // Write the reduced camera matrix, its rhs and the projection jacobians of
+  // every iteration into reduced_camera_matrix_directory (which must exist).
+  // The csv files (s.txt, rhs.txt, ...) are overwritten by each iteration.
+  // The files of the sparse formats are tagged with the Solve() call and
+  // iteration numbers, and stream the block sparse matrices block by block.
   bool write_reduced_camera_matrix = false;
+  MatrixExportFormat reduced_camera_matrix_format = ExportCsv;
+  std::string reduced_camera_matrix_directory = ".";
   bool calculate_calibration_marginals = false;
 
+  // Evaluate the projections with the intrinsics of the measurement pose
+  // (Pose::cam_params, stored inline). The residuals go through the batched
+  // kernels without allocating. The jacobians go through the calibu cameras,
+  // which take their parameters as a VectorXd, through buffers of each
+  // evaluation body that are only allocated once. The remaining allocations
+  // are the camera copies of each body, one parameter vector per camera per
+  // evaluation, and the check of the batched kernels when residuals are
+  // added. Models that can not be copied re-parametrize and restore the
+  // shared rig camera for each residual, and are evaluated serially.
   bool use_per_pose_cam_params = false;
 
   // Initialization.
@@ -136,6 +261,7 @@ class BundleAdjuster
   typedef PoseT<Scalar> Pose;
   typedef LandmarkT<Scalar,LmSize> Landmark;
   typedef ProjectionResidualT<Scalar,LmSize> ProjectionResidual;
+  typedef ProjectionPairT<Scalar> ProjectionPair;
   typedef ImuMeasurementT<Scalar>     ImuMeasurement;
   typedef UnaryResidualT<Scalar> UnaryResidual;
   typedef BinaryResidualT<Scalar> BinaryResidual;
@@ -167,8 +293,18 @@ class BundleAdjuster
     debug_level_threshold(0),
     debug_level(0),
     imu_(SE3t(),Vector3t::Zero(),Vector3t::Zero(),Vector2t::Zero()),
+    is_assembly_pattern_valid_(false),
+    is_s_pp_index_valid_(false),
+    is_s_pp_pattern_current_(false),
+    is_s_pp_permuted_(false),
+    is_sparse_pattern_analyzed_(false),
+    is_sparse_solver_analyzed_(false),
+    is_sparse_solver_f_analyzed_(false),
+    is_sparse_solver_f_used_(false),
+    is_selected_inverse_valid_(false),
     translation_enabled_(kCalibDim > 15 ? false : true),
-    total_tvs_change_(0)
+    total_tvs_change_(0),
+    num_solves_(0)
   {
   }
 
@@ -191,9 +327,11 @@ class BundleAdjuster
 
     options_ = options;
     trust_region_size_ = options_.trust_region_size;
+    lm_lambda_ = options_.lm_initial_lambda;
     root_pose_id_ = 0;
     num_active_poses_ = 0;
     num_active_landmarks_ = 0;
+    num_solves_ = 0;
     proj_residual_offset = 0;
     binary_residual_offset_ = 0;
     unary_residual_offset_ = 0;
@@ -234,6 +372,17 @@ class BundleAdjuster
 
     conditioning_inertial_residuals_.clear();
     conditioning_proj_residuals_.clear();
+    proj_observations_.clear();
+    proj_point_jacobians_.clear();
+    proj_pairs_.clear();
+    proj_pair_ids_.clear();
+    proj_pair_order_.clear();
+
+    // The cached patterns depend on the structure and on the options.
+    is_assembly_pattern_valid_ = false;
+    is_s_pp_index_valid_ = false;
+    is_s_pp_pattern_current_ = false;
+    schur_w_pattern_ = Eigen::SparseBlockPattern();
   }
 
   ////////////////////////////////////////////////////////////////////////////
@@ -280,7 +429,7 @@ class BundleAdjuster
   /// \param t_vs is the vehicle to sensor extrinsics calibration (if required)
   /// which can be set to identity if not needed.
   /// \param cam_params is the vector of camera intrinsics used in calibration
-  /// which can be empty if not needed.
+  /// (at most kMaxCamParams) which can be empty if not needed.
   /// \param v_w is the 3D velocity vector.
   /// \param b is the 6d gyro/imu bias vector.
   /// \param is_active defines whether or not this pose is active in the
@@ -294,6 +443,14 @@ class BundleAdjuster
                    const bool is_active = true, const double time = -1,
                    const int external_id = -1)
   {
+    // cam_params has a fixed capacity, which Eigen only checks in debug.
+    if (cam_params.rows() > kMaxCamParams) {
+      std::cerr << "Attempted to add a pose with " << cam_params.rows()
+                << " camera parameters to BA, when at most " << kMaxCamParams
+                << " are supported. Aborting..." << std::endl;
+      throw 0;
+    }
+
     Pose pose;
     pose.external_id = external_id;
     pose.time = time;
@@ -316,6 +473,7 @@ class BundleAdjuster
     }
 
     poses_.push_back(pose);
+    is_assembly_pattern_valid_ = false;
     // std::cout << "Addeded pose with IsActive= " << pose.IsActive <<
     // ", Id = " << pose.Id << " and OptId = " << pose.OptId << std::endl;
 
@@ -360,6 +518,7 @@ class BundleAdjuster
     }
 
     landmarks_.push_back(landmark);
+    is_assembly_pattern_valid_ = false;
     //std::cout << "Adding landmark with Xw = [" << Xw.transpose() <<
     // "], refPoseId " << uRefPoseId << ", uRefCamId " << uRefCamId <<
     // ", OptId " << landmark.OptId << std::endl;
@@ -399,6 +558,7 @@ class BundleAdjuster
     residual.cov_inv_sqrt = residual.cov_inv.sqrt();
 
     unary_residuals_.push_back(residual);
+    is_assembly_pattern_valid_ = false;
     unary_residual_offset_ += UnaryResidual::kResSize;
 
     // we add this to both poses, as each one has a jacobian cell associated
@@ -446,6 +606,7 @@ class BundleAdjuster
     residual.use_rotation = use_rotation;
 
     binary_residuals_.push_back(residual);
+    is_assembly_pattern_valid_ = false;
     binary_residual_offset_ += BinaryResidual::kResSize;
 
     // we add this to both poses, as each one has a jacobian cell associated
@@ -501,6 +662,7 @@ class BundleAdjuster
     }
 
     proj_residuals_.push_back(residual);
+    is_assembly_pattern_valid_ = false;
     proj_residual_offset += ProjectionResidual::kResSize;
 
     if (poses_[residual.x_ref_id].is_active == false &&
@@ -532,6 +694,7 @@ class BundleAdjuster
     residual.residual_offset = inertial_residual_offset_;
 
     inertial_residuals_.push_back(residual);
+    is_assembly_pattern_valid_ = false;
     inertial_residual_offset_ += ImuResidual::kResSize;
 
     poses_[pose1_id].inertial_residuals.push_back(residual.residual_id);
@@ -550,6 +713,45 @@ class BundleAdjuster
              const Scalar gn_damping = 1.0,
              const bool error_increase_allowed = false);
 
+  ////////////////////////////////////////////////////////////////////////////
+  /// \brief Forces the symbolic analysis (ordering) of the reduced camera
+  /// matrix to be redone on the next factorization. The analysis is otherwise
+  /// kept across iterations and Solve calls, and only redone when the sparsity
+  /// pattern of the reduced camera matrix changes. Call this when poses or
+  /// residuals have been added and the cached analysis should not be trusted.
+  ///
+  void InvalidateFactorization()
+  {
+    is_sparse_pattern_analyzed_ = false;
+    pose_ordering_pattern_ = Eigen::SparseBlockPattern();
+    block_solver_ = decltype(block_solver_)();
+    is_selected_inverse_valid_ = false;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////
+  /// \brief Gets the covariance of a pose, or the cross covariance of two
+  /// poses, with the landmarks marginalized. The covariance is read from the
+  /// selected inverse of the last factorization of the reduced camera matrix
+  /// (at the last linearization point, including any Levenberg-Marquardt
+  /// damping), which is computed on the first call after each
+  /// factorization (in double precision, also after a mixed precision
+  /// solve). Only blocks in the pattern of the factor are available,
+  /// which includes all pairs of poses sharing a residual or a landmark.
+  /// \return an empty matrix if a pose is not active, the block is not
+  /// available, or the solver does not keep a factorization (pcg).
+  ///
+  MatrixXt GetPoseCovariance(const uint32_t id)
+  {
+    return GetPoseCovariance(id, id);
+  }
+  MatrixXt GetPoseCovariance(const uint32_t id1, const uint32_t id2);
+
+  ////////////////////////////////////////////////////////////////////////////
+  /// \brief Gets the covariance of the calibration parameters, from the same
+  /// selected inverse as GetPoseCovariance.
+  ///
+  MatrixXt GetCalibrationCovariance();
+
   void SetRootPoseId(const uint32_t id) { root_pose_id_ = id; }
   uint32_t GetRootPoseId() { return root_pose_id_; }
 
@@ -651,10 +853,107 @@ private:
     return max_dim + 3;
   }
 
+  bool IsDirectAssemblyUsed() const
+  {
+    return options_.use_direct_hessian_assembly &&
+        !options_.write_reduced_camera_matrix;
+  }
+
+  bool IsFusedLinearizationUsed() const
+  {
+    return IsDirectAssemblyUsed() &&
+        options_.use_fused_landmark_linearization;
+  }
+
+  // The poses with a jacobian block for a projection residual, i.e. the ones
+  // listing it in their proj_residuals. Returns the number of poses.
+  uint32_t GetProjectionResidualPoses(const ProjectionResidual& res,
+                                      uint32_t* pose_ids) const
+  {
+    if (LmSize != 1) {
+      pose_ids[0] = res.x_meas_id;
+      return 1;
+    }
+    if (res.x_meas_id != res.x_ref_id) {
+      pose_ids[0] = res.x_meas_id;
+      pose_ids[1] = res.x_ref_id;
+      return 2;
+    }
+    return 0;
+  }
+
+  // Unweighted calibration jacobian of a projection residual, as stored in
+  // j_kpr_.
+  Eigen::Matrix<Scalar, ProjectionResidual::kResSize, kCalibDim>
+  GetCalibrationJacobian(const ProjectionResidual& res) const
+  {
+    Eigen::Matrix<Scalar, ProjectionResidual::kResSize, kCalibDim> dz_dk;
+    dz_dk.setZero();
+    if (kCamParamsInCalib) {
+      dz_dk.template block(0, 0, 2, res.dz_dcam_params.cols()) =
+          res.dz_dcam_params;
+    }
+    if (kTvsInCalib) {
+      dz_dk.template block(0, kTvsOffset, 2, 6) = res.dz_dtvs;
+    }
+    return dz_dk;
+  }
+
+  // Inertial jacobian with respect to one of its poses, with the masked
+  // parameters zeroed as in j_i_.
+  Eigen::Matrix<Scalar, ImuResidual::kResSize, kPoseDim>
+  GetMaskedImuJacobian(const ImuResidual& res, const Pose& pose) const
+  {
+    Eigen::Matrix<Scalar, ImuResidual::kResSize, kPoseDim> dz_dx =
+        res.pose1_id == pose.id ? res.dz_dx1 : res.dz_dx2;
+    if (pose.is_param_mask_used) {
+      for (uint32_t ii = 0 ; ii < kPoseDim ; ++ii) {
+        if (!pose.param_mask[ii]) {
+          dz_dx.col(ii).setZero();
+        }
+      }
+    }
+    return dz_dx;
+  }
+
   bool SolveInternal(VectorXt rhs_p_sc, const Scalar gn_damping,
                      const bool error_increase_allowed, const bool use_dogleg);
+  bool SolveLevenbergMarquardt(const VectorXt& rhs_p_sc);
+  bool ComputeSelectedInverse();
+  template<typename Solver>
+  bool ComputeSparseSelectedInverse(Solver& solver);
+  template<typename Solver>
+  void SetSelectedInversePermutation(const Solver& solver);
+  // Position of a row of the reduced system in selected_inverse_.
+  int SelectedInversePosition(const int row) const
+  {
+    return selected_inverse_perm_.empty() ? row : selected_inverse_perm_[row];
+  }
+  bool GetReducedCovariance(const uint32_t row, const uint32_t col,
+                            const uint32_t rows, const uint32_t cols,
+                            MatrixXt& cov);
+  void DampReducedCameraMatrix();
+  void UpdateLmDamping();
 
   void CalculateGn(const VectorXt& rhs_p, Delta &delta);
+  bool IsSparsePatternAnalyzed() const;
+  void AnalyzeSparsePattern();
+  template<typename Solver>
+  void CalculateGnSparse(Solver& solver, const VectorXt& rhs_p, Delta &delta);
+  template<typename SolverF>
+  bool CalculateGnMixedPrecision(SolverF& solver_f, const VectorXt& rhs_p,
+                                 Delta &delta);
+  template<typename SolverF>
+  bool SolveMixedPrecision(const SolverF& solver_f, const VectorXt& b,
+                           VectorXt& x);
+  void CalculateGnBlockSparse(const VectorXt& rhs_p, Delta &delta);
+  MatrixXt SolveBlockSparse(const MatrixXt& b);
+  bool IsPoseOrderingUsed() const;
+  void PermuteReducedCameraMatrix(VectorXt& rhs_p_sc);
+  void CalculateGnPcg(const VectorXt& rhs_p, Delta &delta);
+  void BuildPcgPreconditioner();
+  void ApplyReducedCameraMatrix(const VectorXt& x, VectorXt& y);
+  uint32_t SolvePcg(const VectorXt& b, VectorXt& x);
   void GetLandmarkDelta(const Delta& delta, const uint32_t num_poses,
                         const uint32_t num_lm, VectorXt &delta_l);
 
@@ -663,7 +962,39 @@ private:
   void EvaluateResiduals(
       Scalar* proj_error = nullptr, Scalar* binary_error = nullptr,
       Scalar* unary_error = nullptr, Scalar* inertial_error = nullptr);
+  // The costs of EvaluateResiduals at the state BuildProblem linearized, summed
+  // from the residuals and robust weights it evaluated.
+  void GetLinearizationErrors(Scalar* proj_error, Scalar* binary_error,
+                              Scalar* unary_error, Scalar* inertial_error);
+  // Fills the t_sw cache of every pose and rig camera.
+  void CacheTsw();
+  // Evaluates proj_pairs_ at the current state, expects CacheTsw().
+  void UpdateProjectionPairs();
+  // Evaluates res.residual of every projection residual, with the batched
+  // kernels for the cameras that have one. With compute_jacobians, the
+  // kernels also fill proj_point_jacobians_.
+  void EvaluateProjectionResiduals(const bool compute_jacobians = false);
+  void UpdateProjectionObservations();
+  // params are the intrinsics shared by the batch, or nullptr to use those
+  // of the measurement poses.
+  void EvaluateProjectionBatch(const uint32_t cam_id, const VectorXt* params,
+                               const size_t begin, const size_t end,
+                               ProjectionBatch<Scalar>& batch,
+                               const bool compute_jacobians);
   void BuildProblem();
+  void BuildAssemblyPattern(const std::vector<uint32_t>& pose_ids,
+                            const std::vector<uint32_t>& lm_ids);
+  void AssembleHessian();
+  void AccumulateLandmarkHessian(Landmark& lm);
+  void LinearizeLandmarks(const std::vector<uint32_t>& lm_ids);
+  void UpdateLandmarkCoupling();
+  void EliminateLandmarks(const bool form_s_pp, VectorXt& rhs_p_sc);
+  void EliminateLandmarksFromCalibration(VectorXt& rhs_p_sc);
+  void WriteReducedCameraMatrix(const VectorXt& rhs_p_sc,
+                                const uint32_t iteration);
+  void MultiplyJacobians(VectorXt& j_p_rhs_p, VectorXt& j_kp_rhs_k,
+                         VectorXt& j_pp_rhs_p, VectorXt& j_u_rhs_p,
+                         VectorXt& j_i_rhs_p, VectorXt& j_l_rhs_l);
 
   ImuCalibration imu_;
 
@@ -708,6 +1039,37 @@ private:
   BlockMat<Eigen::Matrix<Scalar, kLmDim, kPrPoseDim>> jt_l_j_pr_;
   BlockMat< Eigen::Matrix<Scalar, kLmDim, kCalibDim>> jt_l_j_kpr_;
   BlockMat<Eigen::Matrix<Scalar, kPrPoseDim, kLmDim>> jt_pr_j_l_;
+  BlockMat<Eigen::Matrix<Scalar, kPrPoseDim, kLmDim>> jt_pr_j_l_vi_;
+
+  // The block patterns only depend on the problem structure, so they are
+  // kept between iterations, and only the values are refilled.
+  // Direct assembly: the patterns of u_, jt_pr_j_l_ and jt_l_j_kpr_, with
+  // the per-residual positions of the blocks it adds to in the value arrays
+  // of u_ ([column pose * 2 + row pose], -1 if not stored) and jt_pr_j_l_.
+  // They are invalidated whenever a pose, landmark or residual is added.
+  bool is_assembly_pattern_valid_;
+  std::vector<std::array<int, 4>> proj_u_index_;
+  std::vector<std::array<int, 2>> proj_w_index_;
+  std::vector<std::array<int, 4>> binary_u_index_;
+  std::vector<int> unary_u_index_;
+  std::vector<std::array<int, 4>> inertial_u_index_;
+  // Schur complement: the pattern of jt_pr_j_l_ that jt_l_j_pr_ and
+  // jt_pr_j_l_vi_ were built for, and for each block of jt_l_j_pr_ the
+  // position of the transposed block in jt_pr_j_l_.
+  Eigen::SparseBlockPattern schur_w_pattern_;
+  std::vector<int> w_transpose_index_;
+  // The pattern of s_pp_ for the pattern of u_ in schur_u_pattern_, the
+  // positions of the blocks of u_ in s_pp_, and per pose column, of each
+  // landmark product in the order EliminateLandmarks visits them.
+  // is_s_pp_pattern_current_ is cleared when s_pp_ is modified
+  // structurally (e.g. a diagonal block is inserted), so that its pattern is
+  // restored.
+  bool is_s_pp_index_valid_;
+  bool is_s_pp_pattern_current_;
+  Eigen::SparseBlockPattern schur_u_pattern_;
+  std::vector<std::vector<int>> s_pp_pattern_;
+  std::vector<int> s_pp_u_index_;
+  std::vector<std::vector<int>> s_pp_index_;
 
 
   VectorXt rhs_p_;
@@ -715,9 +1077,87 @@ private:
   VectorXt rhs_l_;
   VectorXt r_pi_;
 
+  // Reduced camera matrix. The pose/pose part is kept block-sparse (upper
+  // triangular), with the calibration parameters as a dense border.
+  BlockMat<Eigen::Matrix<Scalar, kPoseDim, kPoseDim>> s_pp_;
+  // With a pose ordering, s_pp_ is swapped with its permutation for the
+  // solve, and swapped back before the next assembly, so that both keep their
+  // pattern. s_pp_perm_source_ is the position in the opt_id ordered s_pp_ of
+  // each block of the permuted one.
+  BlockMat<Eigen::Matrix<Scalar, kPoseDim, kPoseDim>> s_pp_swap_;
+  std::vector<Eigen::SparseBlockPermutedEntry> s_pp_perm_source_;
+  bool is_s_pp_permuted_;
+  MatrixXt s_pk_;
+  MatrixXt s_kk_;
+  // Only formed for the dense solver.
   Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> s_;
+  // Persistent blocked factorization of s_, keeping its storage between
+  // iterations.
+  Eigen::DenseBlockLLT<Scalar, kPoseDim> dense_solver_;
   Eigen::SparseMatrix<Scalar> s_sparse_;
+  // Persistent factorization of s_sparse_. The symbolic analysis is only
+  // redone when the sparsity pattern below differs from the one it was
+  // computed for. sparse_solver_ orders the scalar matrix itself with AMD.
+  // With a pose ordering, the poses are already ordered by
+  // PermuteReducedCameraMatrix (with the calibration parameters last), and
+  // ordered_sparse_solver_ keeps that order.
+  Eigen::SimplicialLDLT<Eigen::SparseMatrix<Scalar>, Eigen::Upper>
+      sparse_solver_;
+  Eigen::SimplicialLDLT<Eigen::SparseMatrix<Scalar>, Eigen::Upper,
+                        Eigen::NaturalOrdering<int>>
+      ordered_sparse_solver_;
+  std::vector<int> s_sparse_outer_index_;
+  std::vector<int> s_sparse_inner_index_;
+  bool is_sparse_pattern_analyzed_;
+  // Single precision copy and factorization for the mixed precision solver.
+  // Each factorization is only analyzed once it is used for a pattern.
+  Eigen::SparseMatrix<float> s_sparse_f_;
+  Eigen::SimplicialLDLT<Eigen::SparseMatrix<float>, Eigen::Upper>
+      sparse_solver_f_;
+  Eigen::SimplicialLDLT<Eigen::SparseMatrix<float>, Eigen::Upper,
+                        Eigen::NaturalOrdering<int>>
+      ordered_sparse_solver_f_;
+  bool is_sparse_solver_analyzed_;
+  bool is_sparse_solver_f_analyzed_;
+  // Block sparse factorization of s_pp_. The calibration border is eliminated
+  // separately through the (dense) Schur complement of s_pp_.
+  Eigen::SparseBlockLLT<BlockMat<Eigen::Matrix<Scalar, kPoseDim, kPoseDim>>>
+      block_solver_;
+  MatrixXt s_pp_inv_s_pk_;
+  Eigen::LDLT<MatrixXt> calib_schur_solver_;
+  // Covariance recovery from the last factorization: the selected inverse of
+  // the SimplicialLDLT factor (block_solver_ keeps its own), or the full
+  // inverse for the dense solver. is_sparse_solver_f_used_ is set when the
+  // last sparse solve used the single precision factor, in which case the
+  // double precision factor is computed on demand.
+  bool is_sparse_solver_f_used_;
+  bool is_selected_inverse_valid_;
+  Eigen::SparseLdltSelectedInverse<Scalar> selected_inverse_;
+  // Position of each row of s_sparse_ in the factor selected_inverse_ was
+  // computed from, empty if the solver kept the order of s_sparse_.
+  std::vector<int> selected_inverse_perm_;
+  MatrixXt s_inverse_;
+  // Fill reducing ordering of the poses: pose_perm_[opt_id] is the position
+  // of the pose in the reduced camera matrix. It is recomputed when the block
+  // pattern it was computed for changes.
+  std::vector<int> pose_perm_;
+  Eigen::SparseBlockPattern pose_ordering_pattern_;
+  // Conjugate gradient solver state. u_transpose_ is only used with
+  // triangular matrices, to apply the lower triangle of u_.
+  BlockMat<Eigen::Matrix<Scalar, kPoseDim, kPoseDim>> u_transpose_;
+  std::vector<Eigen::Matrix<Scalar, kPoseDim, kPoseDim>,
+              Eigen::aligned_allocator<
+                Eigen::Matrix<Scalar, kPoseDim, kPoseDim>>> pcg_preconditioner_;
+  Eigen::LDLT<MatrixXt> pcg_preconditioner_k_;
+  VectorXt pcg_mask_diagonal_;
+  VectorXt pcg_lm_temp_;
   Scalar trust_region_size_;
+  // Levenberg-Marquardt damping. s_diagonal_ is the undamped diagonal of the
+  // reduced camera matrix of the current linearization (empty until the
+  // first damped solve), and lm_damping_ the diagonal currently added to it.
+  Scalar lm_lambda_;
+  VectorXt s_diagonal_;
+  VectorXt lm_damping_;
 
   bool translation_enabled_;
   bool is_param_mask_used_;
@@ -730,6 +1170,20 @@ private:
   uint32_t root_pose_id_;
   uint32_t num_active_poses_;
   uint32_t num_active_landmarks_;
+  // Number of Solve() calls since Init, used to tag the exported matrices.
+  uint32_t num_solves_;
+  // The projection residuals of each rig camera, for the batched kernels.
+  std::vector<ProjectionObservations<Scalar>> proj_observations_;
+  // Jacobian of each projection with respect to the point in the camera
+  // frame, from the batched kernels, by residual id. Only valid for cameras
+  // with a batched kernel, at the state of the last BuildProblem.
+  aligned_vector<Eigen::Matrix<Scalar, 2, 3>> proj_point_jacobians_;
+  // Inverse depth only: the distinct (measurement pose, reference pose,
+  // camera, reference camera) pairs of the projection residuals, the pair of
+  // each residual and the residuals ordered by pair.
+  aligned_vector<ProjectionPair> proj_pairs_;
+  std::vector<uint32_t> proj_pair_ids_;
+  std::vector<uint32_t> proj_pair_order_;
   uint32_t binary_residual_offset_;
   uint32_t unary_residual_offset_;
   uint32_t proj_residual_offset;
@@ -0,0 +1,153 @@
+#ifndef DENSEBLOCKCHOLESKY_H
+#define DENSEBLOCKCHOLESKY_H
+
+#include <algorithm>
+#include <cmath>
+#include <Eigen/Dense>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+namespace Eigen {
+
+/// Blocked right-looking LLt factorization of a dense symmetric positive
+/// definite matrix, e.g. the reduced camera matrix of a small, fully
+/// covisible problem. Only the upper triangle of the input is read. The tile
+/// width is a multiple of _BlockSize (the pose dimension), so that tiles do
+/// not split poses. The panel solve and the trailing update of each step are
+/// done in parallel over the tile rows. The factor storage is kept between
+/// factorizations of matrices of the same size.
+template<typename _Scalar, int _BlockSize>
+class DenseBlockLLT
+{
+ public:
+  typedef _Scalar Scalar;
+  typedef Matrix<Scalar, Dynamic, Dynamic> MatrixXt;
+  typedef typename MatrixXt::Index Index;
+  static const int kBlockSize = _BlockSize;
+  // Tiles of about 64 columns, rounded up to whole blocks.
+  static const int kTileSize = kBlockSize * ((64 + kBlockSize - 1) / kBlockSize);
+
+  DenseBlockLLT() : info_(Success) {}
+
+  /// \brief Factorizes the matrix whose upper triangle is given by a.
+  template<typename InputType>
+  void compute(const MatrixBase<InputType>& a);
+
+  ComputationInfo info() const { return info_; }
+
+  Index rows() const { return l_.rows(); }
+  Index cols() const { return l_.cols(); }
+
+  /// \brief Solves A x = b in place. b may have several columns.
+  template<typename Rhs>
+  void solveInPlace(MatrixBase<Rhs> const & b_mat) const
+  {
+    MatrixBase<Rhs>& x = const_cast<MatrixBase<Rhs>&>(b_mat);
+    eigen_assert(x.rows() == rows());
+    l_.template triangularView<Lower>().solveInPlace(x);
+    l_.template triangularView<Lower>().adjoint().solveInPlace(x);
+  }
+
+  template<typename Rhs>
+  Matrix<Scalar, Dynamic, Rhs::ColsAtCompileTime> solve(
+      const MatrixBase<Rhs>& b) const
+  {
+    Matrix<Scalar, Dynamic, Rhs::ColsAtCompileTime> x = b;
+    solveInPlace(x);
+    return x;
+  }
+
+ protected:
+  bool FactorizeTile(const Index start, const Index size);
+
+  ComputationInfo info_;
+  // Lower triangle of the factor. The strict upper triangle is not used.
+  MatrixXt l_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+template<typename _Scalar, int _BlockSize>
+template<typename InputType>
+void DenseBlockLLT<_Scalar, _BlockSize>::compute(
+    const MatrixBase<InputType>& a)
+{
+  eigen_assert(a.rows() == a.cols());
+  const Index n = a.rows();
+  if (l_.rows() != n) {
+    l_.resize(n, n);
+  }
+  l_.template triangularView<Lower>() =
+      a.template triangularView<Upper>().transpose();
+  info_ = Success;
+
+  const Index num_tiles = (n + kTileSize - 1) / kTileSize;
+  for (Index kk = 0; kk < num_tiles; ++kk) {
+    const Index k0 = kk * kTileSize;
+    const Index kw = std::min<Index>(kTileSize, n - k0);
+    if (!FactorizeTile(k0, kw)) {
+      info_ = NumericalIssue;
+      return;
+    }
+    if (kk + 1 == num_tiles) {
+      break;
+    }
+
+    // L_ik = A_ik L_kk^-T for the tiles below the diagonal tile.
+    const auto l_kk = l_.block(k0, k0, kw, kw);
+    tbb::parallel_for(tbb::blocked_range<Index>(kk + 1, num_tiles, 1),
+                      [&](const tbb::blocked_range<Index>& r) {
+      for (Index ii = r.begin(); ii != r.end(); ++ii) {
+        const Index i0 = ii * kTileSize;
+        const Index iw = std::min<Index>(kTileSize, n - i0);
+        auto l_ik = l_.block(i0, k0, iw, kw);
+        l_kk.template triangularView<Lower>().adjoint().
+            template solveInPlace<OnTheRight>(l_ik);
+      }
+    });
+
+    // A_ij -= L_ik L_jk^T for the trailing tiles in the lower triangle.
+    tbb::parallel_for(tbb::blocked_range<Index>(kk + 1, num_tiles, 1),
+                      [&](const tbb::blocked_range<Index>& r) {
+      for (Index ii = r.begin(); ii != r.end(); ++ii) {
+        const Index i0 = ii * kTileSize;
+        const Index iw = std::min<Index>(kTileSize, n - i0);
+        const auto l_ik = l_.block(i0, k0, iw, kw);
+        for (Index jj = kk + 1; jj < ii; ++jj) {
+          const Index j0 = jj * kTileSize;
+          l_.block(i0, j0, iw, kTileSize).noalias() -=
+              l_ik * l_.block(j0, k0, kTileSize, kw).transpose();
+        }
+        l_.block(i0, i0, iw, iw).template selfadjointView<Lower>().
+            rankUpdate(l_ik, Scalar(-1));
+      }
+    });
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+template<typename _Scalar, int _BlockSize>
+bool DenseBlockLLT<_Scalar, _BlockSize>::FactorizeTile(const Index start,
+                                                       const Index size)
+{
+  // Unblocked left-looking factorization of the diagonal tile in place.
+  auto a = l_.block(start, start, size, size);
+  for (Index jj = 0; jj < size; ++jj) {
+    const Scalar d = a(jj, jj) - a.row(jj).head(jj).squaredNorm();
+    if (!(d > 0)) {
+      return false;
+    }
+    const Scalar l_jj = std::sqrt(d);
+    a(jj, jj) = l_jj;
+    const Index below = size - jj - 1;
+    if (below > 0) {
+      a.col(jj).tail(below).noalias() -=
+          a.block(jj + 1, 0, below, jj) * a.row(jj).head(jj).transpose();
+      a.col(jj).tail(below) /= l_jj;
+    }
+  }
+  return true;
+}
+
+} // end namespace Eigen
+
+#endif // DENSEBLOCKCHOLESKY_H
@@ -0,0 +1,232 @@
+#ifndef PROJECTIONKERNELS_H
+#define PROJECTIONKERNELS_H
+
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <Eigen/Dense>
+#include <calibu/Calibu.h>
+
+namespace ba {
+
+/// The calibu camera models the residuals are specialized for.
+enum CameraModel
+{
+  CameraFov,
+  CameraPoly2,
+  CameraPoly3,
+  CameraKannalaBrandt,
+  CameraLinear,
+  CameraGeneric   // Any other model, through calibu::CameraInterface.
+};
+
+template<typename Scalar>
+static CameraModel GetCameraModel(const calibu::CameraInterface<Scalar>& cam)
+{
+  if (dynamic_cast<const calibu::FovCamera<Scalar>*>(&cam)) {
+    return CameraFov;
+  } else if (dynamic_cast<const calibu::Poly2Camera<Scalar>*>(&cam)) {
+    return CameraPoly2;
+  } else if (dynamic_cast<const calibu::Poly3Camera<Scalar>*>(&cam)) {
+    return CameraPoly3;
+  } else if (dynamic_cast<const calibu::KannalaBrandtCamera<Scalar>*>(&cam)) {
+    return CameraKannalaBrandt;
+  } else if (dynamic_cast<const calibu::LinearCamera<Scalar>*>(&cam)) {
+    return CameraLinear;
+  }
+  return CameraGeneric;
+}
+
+/// Number of parameters of the batched projection kernel of a model, or 0 if
+/// the model has none. The parameters are [fx, fy, cx, cy] followed by the
+/// distortion parameters of the model.
+inline int GetNumProjectionParams(const CameraModel model)
+{
+  switch (model) {
+    case CameraLinear: return 4;  // fx, fy, cx, cy
+    case CameraFov: return 5;     // fx, fy, cx, cy, w
+    case CameraPoly3: return 7;   // fx, fy, cx, cy, k1, k2, k3
+    default: return 0;
+  }
+}
+
+/// Returns the model of a camera if it has a batched projection kernel, or
+/// CameraGeneric if it is evaluated through calibu::CameraInterface.
+template<typename Scalar>
+static CameraModel GetProjectionModel(
+    const calibu::CameraInterface<Scalar>& cam)
+{
+  const CameraModel model = GetCameraModel(cam);
+  const int num_params = GetNumProjectionParams(model);
+  return num_params != 0 && cam.GetParams().rows() == num_params ?
+        model : CameraGeneric;
+}
+
+/// A batch of points to project, in structure of arrays form: every row holds
+/// one field for up to kSize points, so the kernels run over contiguous
+/// arrays and are vectorized by Eigen. Every point carries its own camera
+/// parameters, so the kernels are stateless and per pose intrinsics cost the
+/// same as shared ones.
+template<typename Scalar>
+struct ProjectionBatch
+{
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  static const int kSize = 64;
+  static const int kMaxParams = 7;
+
+  // Transform of each ray into the camera, [r00 r01 r02 t0; ...; r20 .. t2].
+  Eigen::Array<Scalar, 12, kSize, Eigen::RowMajor> t;
+  // Homogeneous point (ray and inverse depth) in the frame of the transform.
+  Eigen::Array<Scalar, 4, kSize, Eigen::RowMajor> x;
+  // Camera parameters of each point.
+  Eigen::Array<Scalar, kMaxParams, kSize, Eigen::RowMajor> k;
+  // Projected pixels.
+  Eigen::Array<Scalar, 2, kSize, Eigen::RowMajor> p;
+  // Jacobians of the pixels with respect to the point in the camera frame,
+  // [dpx/dx dpx/dy dpx/dz; dpy/dx ..], if requested.
+  Eigen::Array<Scalar, 6, kSize, Eigen::RowMajor> dp_dx;
+
+  /// Sets the camera parameters of the first n points.
+  template<typename ParamsType>
+  void SetParams(const ParamsType& params, const int n)
+  {
+    for (int rr = 0; rr < params.rows(); ++rr) {
+      k.row(rr).head(n).setConstant(params[rr]);
+    }
+  }
+
+  /// Sets point ii of the batch to be projected as cam->Transfer3d(t_ba,
+  /// ray, rho).
+  template<typename SE3Type, typename Vector4Type>
+  void Set(const int ii, const SE3Type& t_ba, const Vector4Type& x_a)
+  {
+    const auto r_ba = t_ba.so3().matrix();
+    const auto& tr_ba = t_ba.translation();
+    for (int rr = 0; rr < 3; ++rr) {
+      for (int cc = 0; cc < 3; ++cc) {
+        t(rr * 4 + cc, ii) = r_ba(rr, cc);
+      }
+      t(rr * 4 + 3, ii) = tr_ba[rr];
+    }
+    x.col(ii) = x_a.array();
+  }
+};
+
+/// Projects the first n points of a batch with the kernel of a camera model,
+/// p = K * d(r) * [x / z, y / z], with the radial distortion factor d of the
+/// model evaluated at the radius r of the normalized point. With
+/// compute_jacobians, also fills dp_dx, as the camera's dTransfer3d_dray
+/// for the point in the camera frame.
+template<typename Scalar>
+static void ProjectBatch(const CameraModel model,
+                         ProjectionBatch<Scalar>& batch, const int n,
+                         const bool compute_jacobians = false)
+{
+  // Fixed capacity, so that no temporary is allocated.
+  typedef Eigen::Array<Scalar, 1, Eigen::Dynamic, Eigen::RowMajor, 1,
+                       ProjectionBatch<Scalar>::kSize> Array;
+  const auto& t = batch.t;
+  const auto& x = batch.x;
+  const auto& k = batch.k;
+  const Array rx = t.row(0).head(n) * x.row(0).head(n) +
+      t.row(1).head(n) * x.row(1).head(n) +
+      t.row(2).head(n) * x.row(2).head(n) +
+      t.row(3).head(n) * x.row(3).head(n);
+  const Array ry = t.row(4).head(n) * x.row(0).head(n) +
+      t.row(5).head(n) * x.row(1).head(n) +
+      t.row(6).head(n) * x.row(2).head(n) +
+      t.row(7).head(n) * x.row(3).head(n);
+  const Array rz_inv = (t.row(8).head(n) * x.row(0).head(n) +
+                        t.row(9).head(n) * x.row(1).head(n) +
+                        t.row(10).head(n) * x.row(2).head(n) +
+                        t.row(11).head(n) * x.row(3).head(n)).inverse();
+  const Array u = rx * rz_inv;
+  const Array v = ry * rz_inv;
+
+  // The distortion factor, and its derivative d'(r) / r, which is zero where
+  // the factor is taken to be constant.
+  Array factor, dfactor;
+  if (model == CameraFov) {
+    // d(r) = atan(2 r tan(w / 2)) / (w r), which tends to 2 tan(w / 2) / w
+    // for small r, and to 1 + w^2 (1 / 12 - r^2 / 3) for small w. The
+    // branches not selected may divide by zero.
+    const Array w = k.row(4).head(n);
+    const Array r2 = u.square() + v.square();
+    const Array r = r2.sqrt();
+    const Array mul2_tanw_by2 = Scalar(2) * (w / Scalar(2)).tan();
+    factor = (w.square() < Scalar(1e-5)).select(
+          Scalar(1) + w.square() * (Scalar(1) / 12 - r2 / Scalar(3)),
+          (r2 < Scalar(1e-5)).select(mul2_tanw_by2 / w,
+                                     (r * mul2_tanw_by2).atan() / (r * w)));
+    if (compute_jacobians) {
+      dfactor = (w.square() < Scalar(1e-5)).select(
+            Scalar(-2) / 3 * w.square(),
+            (r2 < Scalar(1e-5)).select(
+              Array::Zero(n),
+              (mul2_tanw_by2 / (w * (Scalar(1) + r2 * mul2_tanw_by2.square())) -
+               factor) / r2));
+    }
+  } else if (model == CameraPoly3) {
+    // d(r) = 1 + k1 r^2 + k2 r^4 + k3 r^6
+    const Array r2 = u.square() + v.square();
+    factor = Scalar(1) + r2 * (k.row(4).head(n) + r2 *
+        (k.row(5).head(n) + r2 * k.row(6).head(n)));
+    if (compute_jacobians) {
+      dfactor = Scalar(2) * (k.row(4).head(n) + r2 *
+          (Scalar(2) * k.row(5).head(n) + Scalar(3) * r2 * k.row(6).head(n)));
+    }
+  } else {
+    factor.setOnes(n);
+    dfactor.setZero(n);
+  }
+
+  batch.p.row(0).head(n) = k.row(0).head(n) * factor * u + k.row(2).head(n);
+  batch.p.row(1).head(n) = k.row(1).head(n) * factor * v + k.row(3).head(n);
+
+  if (compute_jacobians) {
+    // dp/dx = K * (d I + d'(r) / r [u v]^T [u v]) * d[u v]/dx, with
+    // d[u v]/dx = [1 0 -u; 0 1 -v] / z.
+    const Array a = (factor + dfactor * u.square()) * rz_inv;
+    const Array b = dfactor * u * v * rz_inv;
+    const Array d = (factor + dfactor * v.square()) * rz_inv;
+    const auto& fx = k.row(0).head(n);
+    const auto& fy = k.row(1).head(n);
+    batch.dp_dx.row(0).head(n) = fx * a;
+    batch.dp_dx.row(1).head(n) = fx * b;
+    batch.dp_dx.row(2).head(n) = -fx * (a * u + b * v);
+    batch.dp_dx.row(3).head(n) = fy * b;
+    batch.dp_dx.row(4).head(n) = fy * d;
+    batch.dp_dx.row(5).head(n) = -fy * (b * u + d * v);
+  }
+}
+
+/// The projection residuals of one camera in structure of arrays form. Only
+/// the indices needed to gather the batches and the measurements are stored,
+/// the results are written back into the residuals.
+template<typename Scalar>
+struct ProjectionObservations
+{
+  CameraModel model = CameraGeneric;
+  std::vector<uint32_t> residual_ids;
+  std::vector<uint32_t> landmark_ids;
+  // Measurement and reference pose of each residual.
+  std::vector<uint32_t> x_meas_ids;
+  std::vector<uint32_t> x_ref_ids;
+  Eigen::Array<Scalar, 2, Eigen::Dynamic, Eigen::RowMajor> z;
+
+  void clear()
+  {
+    residual_ids.clear();
+    landmark_ids.clear();
+    x_meas_ids.clear();
+    x_ref_ids.clear();
+    z.resize(2, 0);
+  }
+
+  size_t size() const { return residual_ids.size(); }
+};
+
+}  // namespace ba
+
+#endif // PROJECTIONKERNELS_H
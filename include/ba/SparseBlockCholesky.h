@@ -0,0 +1,757 @@
+#ifndef SPARSEBLOCKCHOLESKY_H
+#define SPARSEBLOCKCHOLESKY_H
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+#include <Eigen/Dense>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <tbb/enumerable_thread_specific.h>
+
+namespace Eigen {
+
+/// Supernodal LLt factorization of a symmetric positive definite block sparse
+/// matrix with fixed size square blocks (e.g. the kPoseDim x kPoseDim blocks
+/// of the reduced camera matrix). Only the upper triangle of the input is
+/// read. Consecutive block columns of the factor with identical structure are
+/// grouped into supernodes, which are stored as dense panels. The factor is
+/// computed left-looking, with all supernodes at the same height of the
+/// elimination tree factorized in parallel.
+///
+/// With partial refactorization enabled, a supernode keeps its panel from the
+/// previous factorization if its structure, its input blocks and all the
+/// descendants updating it are unchanged. This also holds across a new
+/// analyzePattern, e.g. when block columns are appended to the matrix.
+template<typename _MatrixType>
+class SparseBlockLLT
+{
+ public:
+  typedef _MatrixType MatrixType;
+  typedef typename MatrixType::Scalar BlockType;
+  typedef typename BlockType::Scalar Scalar;
+  typedef typename MatrixType::Index Index;
+  typedef Matrix<Scalar, Dynamic, Dynamic> MatrixXt;
+  typedef Matrix<Scalar, Dynamic, 1> VectorXt;
+  static const int kBlockSize = BlockType::RowsAtCompileTime;
+
+  SparseBlockLLT() :
+    info_(Success), is_pattern_analyzed_(false), num_blocks_(0),
+    partial_refactorization_(false), relinearization_threshold_(0),
+    num_refactorized_(0) {}
+
+  /// \brief Enables partial refactorization. An input block is considered
+  /// unchanged if it differs from the value last used to factorize by no more
+  /// than relinearization_threshold, relative to that value (max norm). With
+  /// a non zero threshold, the factor is only an approximation of the input,
+  /// and solves should be refined against the input matrix.
+  void setPartialRefactorization(const bool enabled,
+                                 const Scalar relinearization_threshold = 0)
+  {
+    partial_refactorization_ = enabled;
+    relinearization_threshold_ = relinearization_threshold;
+  }
+
+  /// \return the number of supernodes recomputed by the last factorize.
+  Index numRefactorizedSupernodes() const { return num_refactorized_; }
+  Index numSupernodes() const
+  {
+    return snode_start_.empty() ? 0 : snode_start_.size() - 1;
+  }
+
+  /// \brief Performs the symbolic analysis (elimination tree, supernodes and
+  /// the structure of the factor) for the pattern of a.
+  void analyzePattern(const MatrixType& a);
+
+  /// \brief Computes the numeric factorization of a, which must have the same
+  /// pattern as the last matrix passed to analyzePattern.
+  void factorize(const MatrixType& a);
+
+  void compute(const MatrixType& a)
+  {
+    analyzePattern(a);
+    factorize(a);
+  }
+
+  /// \return true if the symbolic analysis was done for the pattern of a.
+  bool hasSamePattern(const MatrixType& a) const
+  {
+    if (!is_pattern_analyzed_ || a.outerSize() != num_blocks_) {
+      return false;
+    }
+    Index pos = 0;
+    for (Index jj = 0; jj < a.outerSize(); ++jj) {
+      if (a_outer_[jj] != pos) {
+        return false;
+      }
+      for (typename MatrixType::InnerIterator it(a, jj); it; ++it) {
+        if (pos >= (Index)a_inner_.size() || a_inner_[pos] != it.index()) {
+          return false;
+        }
+        ++pos;
+      }
+    }
+    return a_outer_[num_blocks_] == pos;
+  }
+
+  ComputationInfo info() const { return info_; }
+
+  Index rows() const { return num_blocks_ * kBlockSize; }
+  Index cols() const { return num_blocks_ * kBlockSize; }
+
+  /// \return the number of scalar non zeros in the lower triangle of the
+  /// factor, including the diagonal.
+  Index nonZerosL() const
+  {
+    Index nnz = 0;
+    for (Index ss = 0; ss < numSupernodes(); ++ss) {
+      const Index width = (snode_start_[ss + 1] - snode_start_[ss]) * kBlockSize;
+      const Index height = snode_rows_[ss].size() * kBlockSize;
+      nnz += width * (width + 1) / 2 + (height - width) * width;
+    }
+    return nnz;
+  }
+
+  /// \return the number of scalar non zeros in the upper triangle of the
+  /// analyzed matrix, including the diagonal.
+  Index nonZerosA() const
+  {
+    Index nnz = 0;
+    for (Index jj = 0; jj < num_blocks_; ++jj) {
+      for (Index pp = a_outer_[jj]; pp < a_outer_[jj + 1]; ++pp) {
+        if (a_inner_[pp] < jj) {
+          nnz += kBlockSize * kBlockSize;
+        } else if (a_inner_[pp] == jj) {
+          nnz += kBlockSize * (kBlockSize + 1) / 2;
+        }
+      }
+    }
+    return nnz;
+  }
+
+  /// \brief Solves A x = b in place. b may have several columns.
+  template<typename Rhs>
+  void solveInPlace(MatrixBase<Rhs> const & b_mat) const;
+
+  template<typename Rhs>
+  Matrix<Scalar, Dynamic, Rhs::ColsAtCompileTime> solve(
+      const MatrixBase<Rhs>& b) const
+  {
+    Matrix<Scalar, Dynamic, Rhs::ColsAtCompileTime> x = b;
+    solveInPlace(x);
+    return x;
+  }
+
+  /// \brief Computes the blocks of the inverse of the factorized matrix that
+  /// lie in the pattern of the factor (the sparse or selected inverse), with
+  /// the Takahashi recursion over the supernodes, from the root of the
+  /// elimination tree down. The pattern of the factor contains the pattern of
+  /// the input matrix, so all its blocks are available.
+  void computeSelectedInverse();
+
+  /// \brief Gets a block of the selected inverse. Only valid after
+  /// computeSelectedInverse.
+  /// \return false if the block is not in the pattern of the factor.
+  bool selectedInverseBlock(Index row, Index col, BlockType& block) const
+  {
+    const bool transpose = row < col;
+    if (transpose) {
+      std::swap(row, col);
+    }
+    const Index ss = col_to_snode_[col];
+    const std::vector<Index>& rows = snode_rows_[ss];
+    const auto it = std::lower_bound(rows.begin(), rows.end(), row);
+    if (it == rows.end() || *it != row) {
+      return false;
+    }
+    const BlockType value = inverse_panels_[ss].template block<kBlockSize,
+        kBlockSize>((it - rows.begin()) * kBlockSize,
+                    (col - snode_start_[ss]) * kBlockSize);
+    block = transpose ? value.transpose() : value;
+    return true;
+  }
+
+ protected:
+  /// \return false if the diagonal block of the supernode is not positive
+  /// definite.
+  bool FactorizeSupernode(const Index ss, std::vector<Index>& row_map,
+                          std::vector<Scalar>& update_buffer);
+  void InvertSupernode(const Index ss, MatrixXt& z_rr, MatrixXt& y);
+
+  ComputationInfo info_;
+  bool is_pattern_analyzed_;
+  Index num_blocks_;
+
+  // Compact copy of the analyzed (input) block pattern.
+  std::vector<Index> a_outer_;
+  std::vector<Index> a_inner_;
+  // For each input block, the row position within the panel of the supernode
+  // it is scattered to, or -1 if it is in the (ignored) lower triangle.
+  std::vector<Index> a_scatter_;
+
+  // Supernode partition: supernode ss spans block columns
+  // [snode_start_[ss], snode_start_[ss + 1]).
+  std::vector<Index> snode_start_;
+  std::vector<Index> col_to_snode_;
+  // Block rows of each supernode panel. The first entries are the columns of
+  // the supernode itself, followed by the sorted off diagonal rows.
+  std::vector<std::vector<Index>> snode_rows_;
+
+  // Descendant supernodes updating each supernode, with the position of the
+  // first row of the descendant falling into the supernode, and the number of
+  // rows of the descendant within the supernode columns.
+  struct Update {
+    Index snode;
+    Index row_begin;
+    Index row_count;
+  };
+  std::vector<std::vector<Update>> snode_updates_;
+
+  // Supernodes grouped by their height in the supernodal elimination tree.
+  std::vector<std::vector<Index>> levels_;
+
+  // Dense panels of the factor, one per supernode.
+  std::vector<MatrixXt, aligned_allocator<MatrixXt>> panels_;
+
+  // Partial refactorization state. a_values_ holds the input blocks the
+  // panels were computed with, and a_is_new_ flags blocks without a
+  // previous value. snode_is_valid_ flags panels holding a factor.
+  bool partial_refactorization_;
+  Scalar relinearization_threshold_;
+  std::vector<BlockType, aligned_allocator<BlockType>> a_values_;
+  std::vector<char> a_is_new_;
+  std::vector<char> snode_is_valid_;
+  Index num_refactorized_;
+
+  // Selected inverse, with the same layout as panels_ except that the
+  // diagonal blocks of each supernode are stored in full.
+  std::vector<MatrixXt, aligned_allocator<MatrixXt>> inverse_panels_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+template<typename MatrixType>
+void SparseBlockLLT<MatrixType>::analyzePattern(const MatrixType& a)
+{
+  const Index n = a.outerSize();
+
+  // Keep the previous factor around, so its panels and input values can be
+  // carried over to the new pattern.
+  std::vector<Index> old_outer, old_inner, old_snode_start, old_col_to_snode;
+  std::vector<std::vector<Index>> old_snode_rows;
+  std::vector<MatrixXt, aligned_allocator<MatrixXt>> old_panels;
+  std::vector<BlockType, aligned_allocator<BlockType>> old_values;
+  std::vector<char> old_is_new, old_snode_is_valid;
+  const Index old_n = is_pattern_analyzed_ ? num_blocks_ : 0;
+  if (partial_refactorization_ && is_pattern_analyzed_) {
+    old_outer.swap(a_outer_);
+    old_inner.swap(a_inner_);
+    old_snode_start.swap(snode_start_);
+    old_col_to_snode.swap(col_to_snode_);
+    old_snode_rows.swap(snode_rows_);
+    old_panels.swap(panels_);
+    old_values.swap(a_values_);
+    old_is_new.swap(a_is_new_);
+    old_snode_is_valid.swap(snode_is_valid_);
+  }
+  num_blocks_ = n;
+
+  // Store a compact copy of the pattern so it can be compared later.
+  a_outer_.resize(n + 1);
+  a_inner_.clear();
+  for (Index jj = 0; jj < n; ++jj) {
+    a_outer_[jj] = a_inner_.size();
+    for (typename MatrixType::InnerIterator it(a, jj); it; ++it) {
+      a_inner_.push_back(it.index());
+    }
+  }
+  a_outer_[n] = a_inner_.size();
+
+  // Elimination tree (Liu's algorithm with path compression) and the lower
+  // triangular block structure of a.
+  std::vector<Index> parent(n, -1);
+  std::vector<Index> ancestor(n, -1);
+  std::vector<std::vector<Index>> lower(n);
+  for (Index jj = 0; jj < n; ++jj) {
+    for (Index pp = a_outer_[jj]; pp < a_outer_[jj + 1]; ++pp) {
+      Index ii = a_inner_[pp];
+      if (ii >= jj) {
+        continue;
+      }
+      lower[ii].push_back(jj);
+      while (ancestor[ii] != -1 && ancestor[ii] != jj) {
+        const Index next = ancestor[ii];
+        ancestor[ii] = jj;
+        ii = next;
+      }
+      if (ancestor[ii] == -1) {
+        ancestor[ii] = jj;
+        parent[ii] = jj;
+      }
+    }
+  }
+
+  // Structure of each column of the factor (strictly below the diagonal).
+  // The structure of a column is the union of its own lower entries and those
+  // of its children in the elimination tree.
+  std::vector<std::vector<Index>> children(n);
+  for (Index jj = 0; jj < n; ++jj) {
+    if (parent[jj] != -1) {
+      children[parent[jj]].push_back(jj);
+    }
+  }
+
+  std::vector<std::vector<Index>> col_struct(n);
+  std::vector<Index> marker(n, -1);
+  for (Index jj = 0; jj < n; ++jj) {
+    std::vector<Index>& cs = col_struct[jj];
+    marker[jj] = jj;
+    for (const Index row : lower[jj]) {
+      if (marker[row] != jj) {
+        marker[row] = jj;
+        cs.push_back(row);
+      }
+    }
+    for (const Index child : children[jj]) {
+      for (const Index row : col_struct[child]) {
+        if (marker[row] != jj) {
+          marker[row] = jj;
+          cs.push_back(row);
+        }
+      }
+    }
+    std::sort(cs.begin(), cs.end());
+  }
+
+  // Group columns into fundamental supernodes. Column jj + 1 joins the
+  // supernode of column jj if it is its parent and the structures nest.
+  snode_start_.clear();
+  col_to_snode_.resize(n);
+  for (Index jj = 0; jj < n; ++jj) {
+    const bool extends = jj > 0 && parent[jj - 1] == jj &&
+        col_struct[jj - 1].size() == col_struct[jj].size() + 1 &&
+        children[jj].size() == 1;
+    if (!extends) {
+      snode_start_.push_back(jj);
+    }
+    col_to_snode_[jj] = snode_start_.size() - 1;
+  }
+  snode_start_.push_back(n);
+  const Index num_snodes = snode_start_.size() - 1;
+
+  snode_rows_.resize(num_snodes);
+  for (Index ss = 0; ss < num_snodes; ++ss) {
+    std::vector<Index>& rows = snode_rows_[ss];
+    rows.clear();
+    for (Index jj = snode_start_[ss]; jj < snode_start_[ss + 1]; ++jj) {
+      rows.push_back(jj);
+    }
+    const std::vector<Index>& last = col_struct[snode_start_[ss + 1] - 1];
+    rows.insert(rows.end(), last.begin(), last.end());
+  }
+
+  // Descendant updates for each supernode.
+  snode_updates_.assign(num_snodes, std::vector<Update>());
+  for (Index dd = 0; dd < num_snodes; ++dd) {
+    const std::vector<Index>& rows = snode_rows_[dd];
+    const Index width = snode_start_[dd + 1] - snode_start_[dd];
+    for (Index rr = width; rr < (Index)rows.size(); ) {
+      const Index target = col_to_snode_[rows[rr]];
+      Update update;
+      update.snode = dd;
+      update.row_begin = rr;
+      update.row_count = 0;
+      while (rr < (Index)rows.size() && rows[rr] < snode_start_[target + 1]) {
+        update.row_count++;
+        rr++;
+      }
+      snode_updates_[target].push_back(update);
+    }
+  }
+
+  // Group the supernodes by height in the supernodal elimination tree. All
+  // descendants of a supernode are at a lower height, so each level can be
+  // factorized in parallel.
+  std::vector<Index> height(num_snodes, 0);
+  Index max_height = 0;
+  for (Index ss = 0; ss < num_snodes; ++ss) {
+    const Index last_col = snode_start_[ss + 1] - 1;
+    if (parent[last_col] != -1) {
+      const Index parent_snode = col_to_snode_[parent[last_col]];
+      height[parent_snode] = std::max(height[parent_snode], height[ss] + 1);
+    }
+    max_height = std::max(max_height, height[ss]);
+  }
+  levels_.assign(num_snodes > 0 ? max_height + 1 : 0, std::vector<Index>());
+  for (Index ss = 0; ss < num_snodes; ++ss) {
+    levels_[height[ss]].push_back(ss);
+  }
+
+  // Scatter positions of the input blocks within the panels. Block (ii, jj)
+  // of the upper triangle lands in column ii, row jj of the factor.
+  std::vector<Index> row_pos(n, -1);
+  a_scatter_.assign(a_inner_.size(), -1);
+  for (Index ss = 0; ss < num_snodes; ++ss) {
+    const std::vector<Index>& rows = snode_rows_[ss];
+    for (size_t rr = 0; rr < rows.size(); ++rr) {
+      row_pos[rows[rr]] = rr;
+    }
+    for (Index ii = snode_start_[ss]; ii < snode_start_[ss + 1]; ++ii) {
+      // the structure of column ii of a's lower triangle is lower[ii]
+      // plus the diagonal.
+      for (const Index jj : lower[ii]) {
+        const Index* begin = a_inner_.data() + a_outer_[jj];
+        const Index* end = a_inner_.data() + a_outer_[jj + 1];
+        const Index pp = std::lower_bound(begin, end, ii) - a_inner_.data();
+        a_scatter_[pp] = row_pos[jj];
+      }
+      const Index* begin = a_inner_.data() + a_outer_[ii];
+      const Index* end = a_inner_.data() + a_outer_[ii + 1];
+      const Index* diag = std::lower_bound(begin, end, ii);
+      if (diag != end && *diag == ii) {
+        a_scatter_[diag - a_inner_.data()] = row_pos[ii];
+      }
+    }
+    for (size_t rr = 0; rr < rows.size(); ++rr) {
+      row_pos[rows[rr]] = -1;
+    }
+  }
+
+  panels_.resize(num_snodes);
+  snode_is_valid_.assign(num_snodes, 0);
+  for (Index ss = 0; ss < num_snodes; ++ss) {
+    // Reuse the panel of an identical supernode of the previous factor.
+    const Index first_col = snode_start_[ss];
+    if (first_col < (Index)old_col_to_snode.size()) {
+      const Index old_ss = old_col_to_snode[first_col];
+      if (old_snode_is_valid[old_ss] &&
+          old_snode_start[old_ss] == first_col &&
+          old_snode_start[old_ss + 1] == snode_start_[ss + 1] &&
+          old_snode_rows[old_ss] == snode_rows_[ss]) {
+        panels_[ss].swap(old_panels[old_ss]);
+        snode_is_valid_[ss] = 1;
+        continue;
+      }
+    }
+    panels_[ss].resize(snode_rows_[ss].size() * kBlockSize,
+                       (snode_start_[ss + 1] - snode_start_[ss]) * kBlockSize);
+  }
+
+  // Carry over the input values the reused panels were computed with.
+  if (partial_refactorization_) {
+    a_values_.resize(a_inner_.size());
+    a_is_new_.assign(a_inner_.size(), 1);
+    for (Index jj = 0; jj < std::min(n, old_n); ++jj) {
+      Index old_pp = old_outer[jj];
+      for (Index pp = a_outer_[jj]; pp < a_outer_[jj + 1]; ++pp) {
+        while (old_pp < old_outer[jj + 1] && old_inner[old_pp] < a_inner_[pp]) {
+          ++old_pp;
+        }
+        if (old_pp < old_outer[jj + 1] && old_inner[old_pp] == a_inner_[pp] &&
+            !old_is_new[old_pp]) {
+          a_values_[pp] = old_values[old_pp];
+          a_is_new_[pp] = 0;
+        }
+      }
+    }
+  } else {
+    a_values_.clear();
+    a_is_new_.clear();
+  }
+
+  is_pattern_analyzed_ = true;
+  info_ = Success;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+template<typename MatrixType>
+void SparseBlockLLT<MatrixType>::factorize(const MatrixType& a)
+{
+  eigen_assert(is_pattern_analyzed_ && hasSamePattern(a));
+  info_ = Success;
+  const Index num_snodes = snode_start_.size() - 1;
+
+  // Find the supernodes to recompute. Without partial refactorization, or
+  // without a valid panel, that is all of them.
+  std::vector<char> dirty(num_snodes, 1);
+  if (partial_refactorization_) {
+    if (a_values_.size() != a_inner_.size()) {
+      a_values_.resize(a_inner_.size());
+      a_is_new_.assign(a_inner_.size(), 1);
+    }
+    for (Index ss = 0; ss < num_snodes; ++ss) {
+      dirty[ss] = !snode_is_valid_[ss];
+    }
+    for (Index jj = 0; jj < num_blocks_; ++jj) {
+      Index pp = a_outer_[jj];
+      for (typename MatrixType::InnerIterator it(a, jj); it; ++it, ++pp) {
+        if (a_scatter_[pp] == -1) {
+          continue;
+        }
+        const Index ss = col_to_snode_[it.index()];
+        if (!dirty[ss] && (a_is_new_[pp] ||
+            (it.value() - a_values_[pp]).template lpNorm<Infinity>() >
+            relinearization_threshold_ *
+            a_values_[pp].template lpNorm<Infinity>())) {
+          dirty[ss] = 1;
+        }
+      }
+    }
+    // Descendants always have a lower index than their ancestors.
+    for (Index ss = 0; ss < num_snodes; ++ss) {
+      for (size_t uu = 0; uu < snode_updates_[ss].size() && !dirty[ss]; ++uu) {
+        dirty[ss] = dirty[snode_updates_[ss][uu].snode];
+      }
+    }
+  }
+  num_refactorized_ = std::count(dirty.begin(), dirty.end(), 1);
+
+  // Scatter the input into the panels.
+  tbb::parallel_for(tbb::blocked_range<Index>(0, num_snodes),
+                    [&](const tbb::blocked_range<Index>& r) {
+    for (Index ss = r.begin(); ss != r.end(); ++ss) {
+      if (dirty[ss]) {
+        panels_[ss].setZero();
+      }
+    }
+  });
+
+  tbb::parallel_for(tbb::blocked_range<Index>(0, num_blocks_),
+                    [&](const tbb::blocked_range<Index>& r) {
+    for (Index jj = r.begin(); jj != r.end(); ++jj) {
+      Index pp = a_outer_[jj];
+      for (typename MatrixType::InnerIterator it(a, jj); it; ++it, ++pp) {
+        if (a_scatter_[pp] == -1) {
+          continue;
+        }
+        const Index ii = it.index();
+        const Index ss = col_to_snode_[ii];
+        if (!dirty[ss]) {
+          continue;
+        }
+        panels_[ss].template block<kBlockSize, kBlockSize>(
+              a_scatter_[pp] * kBlockSize,
+              (ii - snode_start_[ss]) * kBlockSize) = it.value().transpose();
+        if (partial_refactorization_) {
+          a_values_[pp] = it.value();
+          a_is_new_[pp] = 0;
+        }
+      }
+    }
+  });
+
+  // Factorize level by level. Every supernode only writes its own panel and
+  // reads the (already final) panels of its descendants. Failures are only
+  // recorded by the tasks, info_ is set once a level is done.
+  std::atomic<bool> failed(false);
+  tbb::enumerable_thread_specific<std::vector<Index>> row_maps(
+        std::vector<Index>(num_blocks_, -1));
+  tbb::enumerable_thread_specific<std::vector<Scalar>> update_buffers;
+  for (const std::vector<Index>& level : levels_) {
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, level.size()),
+                      [&](const tbb::blocked_range<size_t>& r) {
+      std::vector<Index>& row_map = row_maps.local();
+      std::vector<Scalar>& update_buffer = update_buffers.local();
+      for (size_t ii = r.begin(); ii != r.end(); ++ii) {
+        if (dirty[level[ii]] &&
+            !FactorizeSupernode(level[ii], row_map, update_buffer)) {
+          failed = true;
+        }
+      }
+    });
+    if (failed) {
+      info_ = NumericalIssue;
+      snode_is_valid_.assign(num_snodes, 0);
+      return;
+    }
+  }
+  snode_is_valid_.assign(num_snodes, 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+template<typename MatrixType>
+bool SparseBlockLLT<MatrixType>::FactorizeSupernode(
+    const Index ss, std::vector<Index>& row_map,
+    std::vector<Scalar>& update_buffer)
+{
+  const int b = kBlockSize;
+  MatrixXt& panel = panels_[ss];
+  const std::vector<Index>& rows = snode_rows_[ss];
+  const Index first_col = snode_start_[ss];
+  const Index width = snode_start_[ss + 1] - first_col;
+
+  for (size_t rr = 0; rr < rows.size(); ++rr) {
+    row_map[rows[rr]] = rr;
+  }
+
+  // Apply the updates from all descendants: with L_d the rows of the
+  // descendant panel at or below this supernode, and L_s the rows within this
+  // supernode, panel -= L_d * L_s^T.
+  for (const Update& update : snode_updates_[ss]) {
+    const MatrixXt& desc = panels_[update.snode];
+    const std::vector<Index>& desc_rows = snode_rows_[update.snode];
+    const Index num_rows = desc_rows.size() - update.row_begin;
+    if (update_buffer.size() < size_t(num_rows * b * update.row_count * b)) {
+      update_buffer.resize(num_rows * b * update.row_count * b);
+    }
+    Map<MatrixXt> prod(update_buffer.data(), num_rows * b,
+                       update.row_count * b);
+    prod.noalias() =
+        desc.middleRows(update.row_begin * b, num_rows * b) *
+        desc.middleRows(update.row_begin * b, update.row_count * b).transpose();
+
+    for (Index cc = 0; cc < update.row_count; ++cc) {
+      const Index col = desc_rows[update.row_begin + cc] - first_col;
+      for (Index rr = cc; rr < num_rows; ++rr) {
+        panel.template block<kBlockSize, kBlockSize>(
+              row_map[desc_rows[update.row_begin + rr]] * b, col * b) -=
+            prod.template block<kBlockSize, kBlockSize>(rr * b, cc * b);
+      }
+    }
+  }
+
+  for (size_t rr = 0; rr < rows.size(); ++rr) {
+    row_map[rows[rr]] = -1;
+  }
+
+  // Factorize the diagonal block and solve for the off diagonal rows.
+  const Index num_off_rows = panel.rows() - width * b;
+  if (width == 1) {
+    LLT<Matrix<Scalar, kBlockSize, kBlockSize>> llt(
+          panel.template topLeftCorner<kBlockSize, kBlockSize>());
+    if (llt.info() != Success) {
+      return false;
+    }
+    panel.template topLeftCorner<kBlockSize, kBlockSize>() = llt.matrixL();
+    if (num_off_rows > 0) {
+      llt.matrixU().template solveInPlace<OnTheRight>(
+            panel.bottomRows(num_off_rows));
+    }
+  } else {
+    LLT<MatrixXt> llt(panel.topRows(width * b));
+    if (llt.info() != Success) {
+      return false;
+    }
+    panel.topRows(width * b) = llt.matrixL();
+    if (num_off_rows > 0) {
+      llt.matrixU().template solveInPlace<OnTheRight>(
+            panel.bottomRows(num_off_rows));
+    }
+  }
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+template<typename MatrixType>
+template<typename Rhs>
+void SparseBlockLLT<MatrixType>::solveInPlace(
+    MatrixBase<Rhs> const & b_mat) const
+{
+  MatrixBase<Rhs>& x = const_cast<MatrixBase<Rhs>&>(b_mat);
+  eigen_assert(x.rows() == rows());
+  const int b = kBlockSize;
+  const Index num_snodes = numSupernodes();
+  MatrixXt temp;
+
+  // Forward substitution with L.
+  for (Index ss = 0; ss < num_snodes; ++ss) {
+    const MatrixXt& panel = panels_[ss];
+    const std::vector<Index>& rows = snode_rows_[ss];
+    const Index width = (snode_start_[ss + 1] - snode_start_[ss]);
+    auto x_s = x.middleRows(snode_start_[ss] * b, width * b);
+    panel.topRows(width * b).template triangularView<Lower>().solveInPlace(x_s);
+    const Index num_off_rows = rows.size() - width;
+    if (num_off_rows > 0) {
+      temp.noalias() = panel.bottomRows(num_off_rows * b) * x_s;
+      for (Index rr = 0; rr < num_off_rows; ++rr) {
+        x.middleRows(rows[width + rr] * b, b) -= temp.middleRows(rr * b, b);
+      }
+    }
+  }
+
+  // Backward substitution with L^T.
+  for (Index ss = num_snodes - 1; ss >= 0; --ss) {
+    const MatrixXt& panel = panels_[ss];
+    const std::vector<Index>& rows = snode_rows_[ss];
+    const Index width = (snode_start_[ss + 1] - snode_start_[ss]);
+    auto x_s = x.middleRows(snode_start_[ss] * b, width * b);
+    const Index num_off_rows = rows.size() - width;
+    if (num_off_rows > 0) {
+      temp.resize(num_off_rows * b, x.cols());
+      for (Index rr = 0; rr < num_off_rows; ++rr) {
+        temp.middleRows(rr * b, b) = x.middleRows(rows[width + rr] * b, b);
+      }
+      x_s.noalias() -= panel.bottomRows(num_off_rows * b).transpose() * temp;
+    }
+    panel.topRows(width * b).template triangularView<Lower>().transpose().
+        solveInPlace(x_s);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+template<typename MatrixType>
+void SparseBlockLLT<MatrixType>::computeSelectedInverse()
+{
+  inverse_panels_.resize(numSupernodes());
+  // A supernode only depends on the inverse at its ancestors, i.e. on the
+  // supernodes at larger heights.
+  for (Index level = levels_.size() - 1; level >= 0; --level) {
+    const std::vector<Index>& snodes = levels_[level];
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, snodes.size()),
+                      [&](const tbb::blocked_range<size_t>& r) {
+      MatrixXt z_rr, y;
+      for (size_t ii = r.begin(); ii != r.end(); ++ii) {
+        InvertSupernode(snodes[ii], z_rr, y);
+      }
+    });
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+template<typename MatrixType>
+void SparseBlockLLT<MatrixType>::InvertSupernode(const Index ss, MatrixXt& z_rr,
+                                                 MatrixXt& y)
+{
+  const int b = kBlockSize;
+  const MatrixXt& panel = panels_[ss];
+  const std::vector<Index>& rows = snode_rows_[ss];
+  const Index width = (snode_start_[ss + 1] - snode_start_[ss]);
+  const Index num_off_rows = rows.size() - width;
+  MatrixXt& z = inverse_panels_[ss];
+  z.resize(panel.rows(), panel.cols());
+
+  // With L = [L_dd 0; L_rd L_rr] and Y = L_rd L_dd^-1, the inverse Z = A^-1
+  // satisfies Z_rd = -Z_rr Y and Z_dd = L_dd^-T L_dd^-1 - Y^T Z_rd. Only the
+  // rows of Z_rr in the structure of the supernode are needed, and those
+  // are in the pattern of the factor of the ancestors.
+  MatrixXt l_dd_inv = MatrixXt::Identity(width * b, width * b);
+  panel.topRows(width * b).template triangularView<Lower>().solveInPlace(
+        l_dd_inv);
+  z.topRows(width * b).noalias() = l_dd_inv.transpose() * l_dd_inv;
+  if (num_off_rows == 0) {
+    return;
+  }
+
+  y.noalias() = panel.bottomRows(num_off_rows * b) * l_dd_inv;
+  z_rr.resize(num_off_rows * b, num_off_rows * b);
+  for (Index qq = 0; qq < num_off_rows; ++qq) {
+    for (Index pp = qq; pp < num_off_rows; ++pp) {
+      BlockType block;
+      const bool found = selectedInverseBlock(rows[width + pp],
+                                              rows[width + qq], block);
+      eigen_assert(found);
+      EIGEN_UNUSED_VARIABLE(found);
+      z_rr.template block<kBlockSize, kBlockSize>(pp * b, qq * b) = block;
+      if (pp != qq) {
+        z_rr.template block<kBlockSize, kBlockSize>(qq * b, pp * b) =
+            block.transpose();
+      }
+    }
+  }
+  z.bottomRows(num_off_rows * b).noalias() = -z_rr * y;
+  z.topRows(width * b).noalias() -=
+      y.transpose() * z.bottomRows(num_off_rows * b);
+}
+
+} // end namespace Eigen
+
+#endif // SPARSEBLOCKCHOLESKY_H
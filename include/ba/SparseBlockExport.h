@@ -0,0 +1,178 @@
+#ifndef SPARSEBLOCKEXPORT_H
+#define SPARSEBLOCKEXPORT_H
+
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <vector>
+#include <Eigen/Dense>
+
+namespace Eigen {
+
+/// Calls f(row, col, value) for the scalar entries of the stored blocks of a
+/// sparse block matrix, one block column at a time. Exact zeros are skipped.
+/// With symmetric_upper only the entries of the upper triangle are visited,
+/// and they are passed transposed (i.e. as the lower triangle), which is
+/// what the symmetric Matrix Market format stores.
+template<typename MatrixType, typename Func>
+static void SparseBlockForEachEntry(const MatrixType& mat,
+                                    const bool symmetric_upper, Func f)
+{
+  typedef typename MatrixType::Scalar BlockType;
+  const int block_rows = BlockType::RowsAtCompileTime;
+  const int block_cols = BlockType::ColsAtCompileTime;
+  for (int jj = 0; jj < mat.outerSize(); ++jj) {
+    for (typename MatrixType::InnerIterator it(mat, jj); it; ++it) {
+      const BlockType& block = it.value();
+      for (int cc = 0; cc < block_cols; ++cc) {
+        const int col = jj * block_cols + cc;
+        for (int rr = 0; rr < block_rows; ++rr) {
+          const int row = it.index() * block_rows + rr;
+          if (block(rr, cc) == 0 || (symmetric_upper && row > col)) {
+            continue;
+          }
+          if (symmetric_upper) {
+            f(col, row, block(rr, cc));
+          } else {
+            f(row, col, block(rr, cc));
+          }
+        }
+      }
+    }
+  }
+}
+
+/// Writes a sparse block matrix in Matrix Market coordinate format, streaming
+/// the stored blocks without forming a dense or scalar sparse copy. With
+/// symmetric_upper the matrix is taken to be symmetric with (at least) its
+/// upper triangle stored, as the reduced camera matrix.
+template<typename MatrixType>
+static bool WriteMatrixMarket(const std::string& file_name,
+                              const MatrixType& mat,
+                              const bool symmetric_upper = false)
+{
+  typedef typename MatrixType::Scalar BlockType;
+  std::ofstream out(file_name, std::ios_base::trunc);
+  if (!out) {
+    return false;
+  }
+
+  // The number of entries is part of the header.
+  size_t num_entries = 0;
+  SparseBlockForEachEntry(mat, symmetric_upper,
+                          [&](int, int, const typename BlockType::Scalar&) {
+    ++num_entries;
+  });
+
+  out << "%%MatrixMarket matrix coordinate real "
+      << (symmetric_upper ? "symmetric" : "general") << "\n"
+      << "% block size " << BlockType::RowsAtCompileTime << " x "
+      << BlockType::ColsAtCompileTime << "\n"
+      << mat.innerSize() * BlockType::RowsAtCompileTime << " "
+      << mat.outerSize() * BlockType::ColsAtCompileTime << " "
+      << num_entries << "\n";
+  out.precision(std::numeric_limits<typename BlockType::Scalar>::digits10 + 2);
+  SparseBlockForEachEntry(mat, symmetric_upper,
+                          [&](int row, int col,
+                              const typename BlockType::Scalar& value) {
+    out << row + 1 << " " << col + 1 << " " << value << "\n";
+  });
+  return out.good();
+}
+
+/// Writes a dense matrix (or vector) in Matrix Market array format.
+template<typename Derived>
+static bool WriteDenseMatrixMarket(const std::string& file_name,
+                                   const MatrixBase<Derived>& mat)
+{
+  std::ofstream out(file_name, std::ios_base::trunc);
+  if (!out) {
+    return false;
+  }
+  out << "%%MatrixMarket matrix array real general\n"
+      << mat.rows() << " " << mat.cols() << "\n";
+  out.precision(std::numeric_limits<typename Derived::Scalar>::digits10 + 2);
+  for (int cc = 0; cc < mat.cols(); ++cc) {
+    for (int rr = 0; rr < mat.rows(); ++rr) {
+      out << mat(rr, cc) << "\n";
+    }
+  }
+  return out.good();
+}
+
+/// Writes a sparse block matrix in a compact binary format, in the byte order
+/// of the host:
+///   char[8]   "BASBM01\0"
+///   int32     block rows, block cols (scalars per block)
+///   int32     rows, cols (in blocks), number of stored blocks
+///   int32     scalar size in bytes
+///   int32     outer index [cols + 1], inner (block row) index [blocks]
+///   scalar    block values, column major within each block
+/// The pattern (outer and inner indices) is written before any value, so it
+/// can be read on its own.
+template<typename MatrixType>
+static bool WriteBinary(const std::string& file_name, const MatrixType& mat)
+{
+  typedef typename MatrixType::Scalar BlockType;
+  typedef typename BlockType::Scalar Scalar;
+  std::ofstream out(file_name, std::ios_base::trunc | std::ios_base::binary);
+  if (!out) {
+    return false;
+  }
+
+  std::vector<int32_t> outer(mat.outerSize() + 1, 0);
+  std::vector<int32_t> inner;
+  for (int jj = 0; jj < mat.outerSize(); ++jj) {
+    for (typename MatrixType::InnerIterator it(mat, jj); it; ++it) {
+      inner.push_back(it.index());
+    }
+    outer[jj + 1] = inner.size();
+  }
+
+  const int32_t header[6] = {
+    BlockType::RowsAtCompileTime, BlockType::ColsAtCompileTime,
+    (int32_t)mat.innerSize(), (int32_t)mat.outerSize(), (int32_t)inner.size(),
+    (int32_t)sizeof(Scalar) };
+  out.write("BASBM01", 8);
+  out.write(reinterpret_cast<const char*>(header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(outer.data()),
+            outer.size() * sizeof(int32_t));
+  out.write(reinterpret_cast<const char*>(inner.data()),
+            inner.size() * sizeof(int32_t));
+  for (int jj = 0; jj < mat.outerSize(); ++jj) {
+    for (typename MatrixType::InnerIterator it(mat, jj); it; ++it) {
+      out.write(reinterpret_cast<const char*>(it.value().data()),
+                BlockType::SizeAtCompileTime * sizeof(Scalar));
+    }
+  }
+  return out.good();
+}
+
+/// Writes a dense matrix (or vector) in binary, in the byte order of the
+/// host:
+///   char[8]   "BADNS01\0"
+///   int32     rows, cols, scalar size in bytes
+///   scalar    values, column major
+template<typename Derived>
+static bool WriteDenseBinary(const std::string& file_name,
+                             const MatrixBase<Derived>& mat)
+{
+  typedef typename Derived::Scalar Scalar;
+  std::ofstream out(file_name, std::ios_base::trunc | std::ios_base::binary);
+  if (!out) {
+    return false;
+  }
+  const int32_t header[3] = { (int32_t)mat.rows(), (int32_t)mat.cols(),
+                              (int32_t)sizeof(Scalar) };
+  out.write("BADNS01", 8);
+  out.write(reinterpret_cast<const char*>(header), sizeof(header));
+  const Matrix<Scalar, Dynamic, Dynamic> values = mat;
+  out.write(reinterpret_cast<const char*>(values.data()),
+            values.size() * sizeof(Scalar));
+  return out.good();
+}
+
+} // end namespace Eigen
+
+#endif // SPARSEBLOCKEXPORT_H
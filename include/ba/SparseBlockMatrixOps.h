@@ -315,6 +315,88 @@ static void SparseBlockAdd(const Lhs& lhs, const Rhs& rhs, Lhs& res,
   res.finalize();
 }
 
+/// Adds rhs (times rhs_coef) to res in place, with the blocks of rhs added
+/// at (block_y, block_x) within the blocks of res as in SparseBlockAdd. If
+/// the pattern of rhs is contained in the pattern of res only the values are
+/// updated. Otherwise the merged pattern is built into a new matrix, which
+/// takes over the values of res and is swapped with it.
+template<typename Lhs, typename Rhs, int block_y = 0, int block_x = 0>
+static void SparseBlockAddInPlace(Lhs& res, const Rhs& rhs,
+                                  const int rhs_coef = 1)
+{
+  typedef typename Rhs::Scalar RhsBlockType;
+  typedef typename Lhs::Scalar BlockType;
+  typedef typename Lhs::Index Index;
+
+  // make sure to call innerSize/outerSize since we fake the storage order.
+  const Index rows = res.innerSize();
+  const Index cols = res.outerSize();
+  eigen_assert(res.innerSize() == rhs.innerSize() &&
+               res.outerSize() == rhs.outerSize());
+
+  // The inner indices are sorted, so the patterns are compared by merging
+  // each column.
+  bool is_contained = res.isCompressed();
+  for (Index jj = 0; jj < cols && is_contained; ++jj) {
+    typename Lhs::InnerIterator res_it(res, jj);
+    for (typename Rhs::InnerIterator rhs_it(rhs, jj); rhs_it; ++rhs_it) {
+      while (res_it && res_it.index() < rhs_it.index()) {
+        ++res_it;
+      }
+      if (!res_it || res_it.index() != rhs_it.index()) {
+        is_contained = false;
+        break;
+      }
+    }
+  }
+
+  if (is_contained) {
+    for (Index jj = 0; jj < cols; ++jj) {
+      typename Lhs::InnerIterator res_it(res, jj);
+      for (typename Rhs::InnerIterator rhs_it(rhs, jj); rhs_it; ++rhs_it) {
+        while (res_it.index() < rhs_it.index()) {
+          ++res_it;
+        }
+        res_it.valueRef().template block<
+            RhsBlockType::RowsAtCompileTime, RhsBlockType::ColsAtCompileTime>(
+              block_y, block_x).noalias() += rhs_it.value() * (double)rhs_coef;
+      }
+    }
+    return;
+  }
+
+  Lhs merged(rows, cols);
+  merged.reserve(res.nonZeros() + rhs.nonZeros());
+  for (Index jj = 0; jj < cols; ++jj) {
+    merged.startVec(jj);
+    typename Lhs::InnerIterator res_it(res, jj);
+    typename Rhs::InnerIterator rhs_it(rhs, jj);
+    while (res_it || rhs_it) {
+      if (rhs_it && (!res_it || rhs_it.index() < res_it.index())) {
+        BlockType& block = merged.insertBackByOuterInner(jj, rhs_it.index());
+        block.setZero();
+        block.template block<
+            RhsBlockType::RowsAtCompileTime, RhsBlockType::ColsAtCompileTime>(
+              block_y, block_x) = rhs_it.value() * (double)rhs_coef;
+        ++rhs_it;
+        continue;
+      }
+
+      BlockType& block = merged.insertBackByOuterInner(jj, res_it.index());
+      block = res_it.value();
+      if (rhs_it && rhs_it.index() == res_it.index()) {
+        block.template block<
+            RhsBlockType::RowsAtCompileTime, RhsBlockType::ColsAtCompileTime>(
+              block_y, block_x).noalias() += rhs_it.value() * (double)rhs_coef;
+        ++rhs_it;
+      }
+      ++res_it;
+    }
+  }
+  merged.finalize();
+  res.swap(merged);
+}
+
 template<typename Lhs, typename Rhs, typename Res,
          int block_y = 0, int block_x = 0>
 static void SparseBlockAddDenseResult(const Lhs& lhs, const Rhs& rhs,
@@ -380,6 +462,285 @@ static void SparseBlockSubtractDenseResult(const Lhs& lhs, const Rhs& rhs,
 }
 
 
+/// Expands the upper triangle of a symmetric block sparse matrix, bordered by
+/// a dense block column (border) and a dense corner block, into a scalar
+/// compressed column sparse matrix. Only the upper triangle is written. The
+/// diagonal is always present in the result (even if zero), and explicit zero
+/// values within blocks are kept, so the sparsity pattern of the result only
+/// depends on the block pattern of lhs.
+template<typename Lhs, typename Border, typename Corner, typename ResultType>
+static void LoadSparseUpperFromSparseBlock(const Lhs& lhs,
+                                           const Border& border,
+                                           const Corner& corner,
+                                           ResultType& res)
+{
+  typedef typename Lhs::Scalar BlockType;
+  typedef typename Lhs::Index Index;
+  const int block_size = BlockType::RowsAtCompileTime;
+  eigen_assert(BlockType::ColsAtCompileTime == block_size);
+
+  const Index num_blocks = lhs.outerSize();
+  const Index num_block_params = num_blocks * block_size;
+  const Index num_border = corner.cols();
+  const Index size = num_block_params + num_border;
+  eigen_assert(border.cols() == num_border &&
+               (num_border == 0 || border.rows() == num_block_params));
+
+  // pass 1: count the non zeros in each scalar column.
+  res.resize(size, size);
+  auto* outer = res.outerIndexPtr();
+  outer[0] = 0;
+  for (Index jj = 0; jj < num_blocks; ++jj) {
+    Index num_upper_blocks = 0;
+    bool has_diagonal = false;
+    for (typename Lhs::InnerIterator it(lhs, jj); it; ++it) {
+      if (it.index() < jj) {
+        num_upper_blocks++;
+      } else if (it.index() == jj) {
+        has_diagonal = true;
+      }
+    }
+    for (int cc = 0; cc < block_size; ++cc) {
+      const Index col = jj * block_size + cc;
+      outer[col + 1] = outer[col] + num_upper_blocks * block_size +
+          (has_diagonal ? cc + 1 : 1);
+    }
+  }
+  for (Index kk = 0; kk < num_border; ++kk) {
+    const Index col = num_block_params + kk;
+    outer[col + 1] = outer[col] + num_block_params + kk + 1;
+  }
+  res.resizeNonZeros(outer[size]);
+
+  // pass 2: copy the values.
+  auto* inner = res.innerIndexPtr();
+  auto* values = res.valuePtr();
+  for (Index jj = 0; jj < num_blocks; ++jj) {
+    for (int cc = 0; cc < block_size; ++cc) {
+      const Index col = jj * block_size + cc;
+      Index pos = outer[col];
+      bool has_diagonal = false;
+      for (typename Lhs::InnerIterator it(lhs, jj); it; ++it) {
+        if (it.index() > jj) {
+          break;
+        }
+        const Index row_offset = it.index() * block_size;
+        const int num_rows = it.index() == jj ? cc + 1 : block_size;
+        has_diagonal = it.index() == jj;
+        for (int rr = 0; rr < num_rows; ++rr) {
+          inner[pos] = row_offset + rr;
+          values[pos] = it.value()(rr, cc);
+          ++pos;
+        }
+      }
+      if (!has_diagonal) {
+        inner[pos] = col;
+        values[pos] = 0;
+        ++pos;
+      }
+      eigen_assert(pos == outer[col + 1]);
+    }
+  }
+
+  for (Index kk = 0; kk < num_border; ++kk) {
+    Index pos = outer[num_block_params + kk];
+    for (Index rr = 0; rr < num_block_params; ++rr) {
+      inner[pos] = rr;
+      values[pos] = border(rr, kk);
+      ++pos;
+    }
+    for (Index rr = 0; rr <= kk; ++rr) {
+      inner[pos] = num_block_params + rr;
+      values[pos] = corner(rr, kk);
+      ++pos;
+    }
+  }
+}
+
+/// Computes res = lhs * rhs for a symmetric block sparse lhs, of which only
+/// the upper triangle is read, and a dense rhs with any number of columns.
+template<typename Lhs, typename Rhs, typename ResultType>
+static void SparseBlockSymmetricUpperProductDenseResult(const Lhs& lhs,
+                                                        const Rhs& rhs,
+                                                        ResultType& res)
+{
+  typedef typename Lhs::Scalar BlockType;
+  typedef typename Lhs::Index Index;
+  const int block_size = BlockType::RowsAtCompileTime;
+
+  res.resize(rhs.rows(), rhs.cols());
+  res.setZero();
+  for (Index jj = 0; jj < lhs.outerSize(); ++jj) {
+    for (typename Lhs::InnerIterator it(lhs, jj); it; ++it) {
+      const Index ii = it.index();
+      if (ii > jj) {
+        continue;
+      }
+      res.template middleRows<block_size>(ii * block_size).noalias() +=
+          it.value() * rhs.template middleRows<block_size>(jj * block_size);
+      if (ii != jj) {
+        res.template middleRows<block_size>(jj * block_size).noalias() +=
+            it.value().transpose() *
+            rhs.template middleRows<block_size>(ii * block_size);
+      }
+    }
+  }
+}
+
+/// Position of a block of a symmetrically permuted matrix in the original
+/// one: the pos-th stored block of block column outer, transposed if
+/// transpose is set.
+struct SparseBlockPermutedEntry
+{
+  int outer;
+  int pos;
+  bool transpose;
+};
+
+/// Sets the pattern of the symmetric permutation of a square block sparse
+/// matrix, of which only the upper triangle is read: block (ii, jj) moves to
+/// (perm[ii], perm[jj]). Blocks that would end up below the diagonal are
+/// stored transposed in the upper triangle of res. The blocks of res are set
+/// to zero, and source[kk] is the position in lhs of the kk-th stored block
+/// of res, so that SparseBlockPermuteSymmetricUpperValues can refill res as
+/// long as the pattern of lhs and perm do not change.
+template<typename Lhs, typename Perm>
+static void SparseBlockPermuteSymmetricUpperPattern(
+    const Lhs& lhs, const Perm& perm, Lhs& res,
+    std::vector<SparseBlockPermutedEntry>& source)
+{
+  typedef typename Lhs::Index Index;
+  struct Entry {
+    Index row;
+    SparseBlockPermutedEntry source;
+    bool operator<(const Entry& other) const { return row < other.row; }
+  };
+
+  const Index num_blocks = lhs.outerSize();
+  std::vector<std::vector<Entry>> cols(num_blocks);
+  for (Index jj = 0; jj < num_blocks; ++jj) {
+    int pos = 0;
+    for (typename Lhs::InnerIterator it(lhs, jj); it; ++it, ++pos) {
+      if (it.index() > jj) {
+        continue;
+      }
+      const Index new_row = perm[it.index()];
+      const Index new_col = perm[jj];
+      Entry entry;
+      entry.source.outer = jj;
+      entry.source.pos = pos;
+      if (new_row <= new_col) {
+        entry.row = new_row;
+        entry.source.transpose = false;
+        cols[new_col].push_back(entry);
+      } else {
+        entry.row = new_col;
+        entry.source.transpose = true;
+        cols[new_row].push_back(entry);
+      }
+    }
+  }
+
+  source.clear();
+  res.resize(num_blocks, num_blocks);
+  res.reserve(lhs.nonZeros());
+  for (Index jj = 0; jj < num_blocks; ++jj) {
+    std::sort(cols[jj].begin(), cols[jj].end());
+    res.startVec(jj);
+    for (const Entry& entry : cols[jj]) {
+      res.insertBackByOuterInner(jj, entry.row).setZero();
+      source.push_back(entry.source);
+    }
+  }
+  res.finalize();
+}
+
+/// Copies the blocks of lhs into the permuted pattern set by
+/// SparseBlockPermuteSymmetricUpperPattern, without changing the pattern of
+/// res.
+template<typename Lhs>
+static void SparseBlockPermuteSymmetricUpperValues(
+    const Lhs& lhs, const std::vector<SparseBlockPermutedEntry>& source,
+    Lhs& res)
+{
+  typename Lhs::Scalar* values = res.valuePtr();
+  for (size_t kk = 0; kk < source.size(); ++kk) {
+    const SparseBlockPermutedEntry& entry = source[kk];
+    const typename Lhs::Scalar& value =
+        lhs.valuePtr()[lhs.outerIndexPtr()[entry.outer] + entry.pos];
+    if (entry.transpose) {
+      values[kk] = value.transpose();
+    } else {
+      values[kk] = value;
+    }
+  }
+}
+
+/// Symmetrically permutes a square block sparse matrix, of which only the
+/// upper triangle is read: block (ii, jj) moves to (perm[ii], perm[jj]).
+/// Blocks that would end up below the diagonal are stored transposed in the
+/// upper triangle of res.
+template<typename Lhs, typename Perm>
+static void SparseBlockPermuteSymmetricUpper(const Lhs& lhs, const Perm& perm,
+                                             Lhs& res)
+{
+  std::vector<SparseBlockPermutedEntry> source;
+  SparseBlockPermuteSymmetricUpperPattern(lhs, perm, res, source);
+  SparseBlockPermuteSymmetricUpperValues(lhs, source, res);
+}
+
+/// Sets the pattern of res to the given sorted inner indices of each outer
+/// vector, with all blocks set to zero.
+template<typename ResultType, typename Index>
+static void SparseBlockSetPattern(const std::vector<std::vector<Index>>& inner,
+                                  typename ResultType::Index rows,
+                                  typename ResultType::Index cols,
+                                  ResultType& res)
+{
+  size_t num_blocks = 0;
+  for (const std::vector<Index>& indices : inner) {
+    num_blocks += indices.size();
+  }
+  res.resize(rows, cols);
+  res.reserve(num_blocks);
+  for (size_t jj = 0; jj < inner.size(); ++jj) {
+    res.startVec(jj);
+    for (const Index ii : inner[jj]) {
+      res.insertBackByOuterInner(jj, ii).setZero();
+    }
+  }
+  res.finalize();
+}
+
+/// \return the block at (outer, inner) of a compressed block sparse matrix,
+/// or nullptr if it is not in the pattern. The inner indices must be sorted.
+template<typename MatrixType>
+static typename MatrixType::Scalar* SparseBlockFind(
+    MatrixType& mat, const typename MatrixType::Index outer,
+    const typename MatrixType::Index inner)
+{
+  typedef typename MatrixType::Index Index;
+  const Index* begin = mat.innerIndexPtr() + mat.outerIndexPtr()[outer];
+  const Index* end = mat.innerIndexPtr() + mat.outerIndexPtr()[outer + 1];
+  const Index* it = std::lower_bound(begin, end, inner);
+  if (it == end || *it != inner) {
+    return nullptr;
+  }
+  return mat.valuePtr() + (it - mat.innerIndexPtr());
+}
+
+/// Sets all blocks of a compressed block sparse matrix to zero, keeping its
+/// pattern (setZero removes the blocks).
+template<typename MatrixType>
+static void SparseBlockZeroValues(MatrixType& mat)
+{
+  typedef typename MatrixType::Index Index;
+  const Index num_blocks = mat.outerIndexPtr()[mat.outerSize()];
+  for (Index ii = 0; ii < num_blocks; ++ii) {
+    mat.valuePtr()[ii].setZero();
+  }
+}
+
 /// UNOPTIMIZED -- USED FOR TESTING ONLY
 template<typename SparseMatrix, typename DenseMatrix>
 static void LoadSparseFromDense(const DenseMatrix& dense,
@@ -428,6 +789,37 @@ static void LoadDenseFromSparse(const SparseMatrix& sparse,
   }
 }
 
+/// Adds coef times the blocks of sparse into dense, at the same (optionally
+/// strided) positions as LoadDenseFromSparse, without clearing dense or
+/// going through a dense copy of sparse.
+template<typename SparseMatrix, typename DenseMatrix,
+         int stride_rows = SparseMatrix::Scalar::RowsAtCompileTime,
+         int stride_cols = SparseMatrix::Scalar::ColsAtCompileTime>
+static void AccumulateDenseFromSparse(const SparseMatrix& sparse,
+                                      DenseMatrix const & dense_mat,
+                                      const double coef = 1)
+{
+  DenseMatrix& dense = const_cast< DenseMatrix& >(dense_mat);
+
+  typedef typename SparseMatrix::Scalar BlockType;
+  assert(dense.rows() >= stride_rows * (sparse.rows() - 1) +
+         BlockType::RowsAtCompileTime &&
+         dense.cols() >= stride_cols * (sparse.cols() - 1) +
+         BlockType::ColsAtCompileTime);
+
+  for (int jj = 0; jj < sparse.cols(); ++jj)
+  {
+    for (typename SparseMatrix::InnerIterator sparse_it(sparse, jj);
+         sparse_it; ++sparse_it)
+    {
+      dense.template block<BlockType::RowsAtCompileTime,
+          BlockType::ColsAtCompileTime>(sparse_it.index() * stride_rows,
+                                        jj * stride_cols) +=
+          sparse_it.value() * coef;
+    }
+  }
+}
+
 } // end namespace Eigen
 
 
@@ -0,0 +1,110 @@
+#ifndef SPARSESELECTEDINVERSE_H
+#define SPARSESELECTEDINVERSE_H
+
+#include <algorithm>
+#include <vector>
+#include <Eigen/Sparse>
+
+namespace Eigen {
+
+/// Selected (sparse) inverse of a symmetric matrix A = L D L^T, given its
+/// factor, e.g. from SimplicialLDLT with NaturalOrdering. The entries of the
+/// inverse are computed with the Takahashi recursion on the pattern of L and
+/// the diagonal, which contains the pattern of A. The columns are computed
+/// from the last one backwards and each only depends on later columns, so
+/// computing just the trailing columns (e.g. a dense calibration corner) is
+/// cheap.
+template<typename _Scalar>
+class SparseLdltSelectedInverse
+{
+ public:
+  typedef _Scalar Scalar;
+  typedef SparseMatrix<Scalar> SparseMatrixType;
+  typedef Matrix<Scalar, Dynamic, 1> VectorXt;
+
+  SparseLdltSelectedInverse() : first_col_(0) {}
+
+  /// \brief Computes the selected inverse for columns first_col and above.
+  /// \param l strictly lower triangular part of the unit lower factor, with
+  /// sorted row indices.
+  /// \param d diagonal of D.
+  void compute(const SparseMatrixType& l, const VectorXt& d,
+               const int first_col = 0)
+  {
+    const int n = l.cols();
+    z_ = l;
+    z_.makeCompressed();
+    z_diag_.resize(n);
+    first_col_ = std::min(std::max(first_col, 0), n);
+
+    const int* outer = z_.outerIndexPtr();
+    const int* inner = z_.innerIndexPtr();
+    Scalar* values = z_.valuePtr();
+    std::vector<Scalar> l_col;
+    for (int jj = n - 1; jj >= first_col_; --jj) {
+      const int begin = outer[jj];
+      const int end = outer[jj + 1];
+      l_col.assign(values + begin, values + end);
+
+      // z_ij = -sum_k l_kj z_ik, with i and k in the structure of column j.
+      Scalar z_jj = 1 / d[jj];
+      for (int pp = begin; pp < end; ++pp) {
+        Scalar z_ij = 0;
+        for (int qq = begin; qq < end; ++qq) {
+          z_ij -= l_col[qq - begin] * Lookup(inner[pp], inner[qq]);
+        }
+        values[pp] = z_ij;
+        z_jj -= l_col[pp - begin] * z_ij;
+      }
+      z_diag_[jj] = z_jj;
+    }
+  }
+
+  int rows() const { return z_.rows(); }
+  int cols() const { return z_.cols(); }
+  int firstCol() const { return first_col_; }
+
+  /// \return false if (row, col) is not in the pattern of the factor, or was
+  /// not computed.
+  bool coeff(int row, int col, Scalar& value) const
+  {
+    if (row < col) {
+      std::swap(row, col);
+    }
+    if (col < first_col_) {
+      return false;
+    }
+    if (row == col) {
+      value = z_diag_[col];
+      return true;
+    }
+    const int* begin = z_.innerIndexPtr() + z_.outerIndexPtr()[col];
+    const int* end = z_.innerIndexPtr() + z_.outerIndexPtr()[col + 1];
+    const int* it = std::lower_bound(begin, end, row);
+    if (it == end || *it != row) {
+      return false;
+    }
+    value = z_.valuePtr()[it - z_.innerIndexPtr()];
+    return true;
+  }
+
+ protected:
+  // Entry of the inverse in an already computed column. Both indices are in
+  // the structure of a column of L, so the entry is in the pattern of L.
+  Scalar Lookup(int row, int col) const
+  {
+    Scalar value = 0;
+    const bool found = coeff(row, col, value);
+    eigen_assert(found);
+    EIGEN_UNUSED_VARIABLE(found);
+    return value;
+  }
+
+  SparseMatrixType z_;
+  VectorXt z_diag_;
+  int first_col_;
+};
+
+} // end namespace Eigen
+
+#endif // SPARSESELECTEDINVERSE_H
@@ -37,13 +37,16 @@
 
 namespace ba {
 static const double Gravity = 9.8007;
+// Upper bound on the number of intrinsics of a camera, so that the per pose
+// intrinsics are stored inline.
+static const int kMaxCamParams = 16;
 template<typename Scalar = double>
 struct PoseT {
   Sophus::SE3Group<Scalar> t_wp;
   Eigen::Matrix<Scalar, 3, 1> v_w;
   /// Gyroscope and Acceleromeoter bias vector, in that order
   Eigen::Matrix<Scalar, 6, 1> b;
-  Eigen::Matrix<Scalar, Eigen::Dynamic, 1> cam_params;
+  Eigen::Matrix<Scalar, Eigen::Dynamic, 1, 0, kMaxCamParams, 1> cam_params;
   std::vector<bool> param_mask;
   bool is_param_mask_used;
   bool is_active;
@@ -297,6 +300,30 @@ struct ProjectionResidualT : public ResidualT<Scalar, 6> {
   bool is_conditioning = false;
 };
 
+/// The parts of the inverse depth projection jacobians that only depend on
+/// the measurement and reference poses and cameras of a residual, and so are
+/// shared by every landmark observed between them.
+template<typename Scalar = double>
+struct ProjectionPairT {
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  uint32_t x_meas_id;
+  uint32_t x_ref_id;
+  uint32_t cam_id;
+  uint32_t ref_cam_id;
+
+  // t_sw_m * t_ws_r, and t_sw_m * t_wp_r.
+  Sophus::SE3Group<Scalar> t_sm_r;
+  Sophus::SE3Group<Scalar> t_sm_wr;
+  Eigen::Matrix<Scalar, 4, 4> t_sm_r_matrix;
+  Eigen::Matrix<Scalar, 4, 4> t_ws_r_matrix;
+  Eigen::Matrix<Scalar, 4, 4> t_vs_r_matrix;
+  // Chain rule factors of the measurement pose, reference pose and t_vs
+  // jacobians, which follow the derivative of the transfer.
+  Eigen::Matrix<Scalar, 7, 6> dt_dx_meas;
+  Eigen::Matrix<Scalar, 7, 6> dt_dx_ref;
+  Eigen::Matrix<Scalar, 7, 6> dt_dtvs;
+};
+
 template<typename Scalar = double, int ResidualSize = 15, int PoseSize = 15>
 struct ImuResidualT : public ResidualT<Scalar, PoseSize> {
   typedef ImuPoseT<Scalar> ImuPose;
@@ -1,153 +1,381 @@
 #include <ba/BundleAdjuster.h>
 #pragma once
 #include <ba/Types.h>
+#include <tbb/enumerable_thread_specific.h>
 #include <tbb/parallel_reduce.h>
 #include <tbb/parallel_for.h>
 #include <tbb/blocked_range.h>
 
 namespace ba {
+  // Calls the projection functions of a camera of model CameraT. The calls
+  // are qualified with the model, which bypasses the virtual dispatch so the
+  // projection of the model can be inlined into the residual.
+  template <typename CameraT>
+  struct CameraCalls {
+    template <typename SE3Type, typename RayType, typename Scalar>
+    static auto Transfer3d(CameraT& cam, const SE3Type& t_ba,
+                           const RayType& ray, const Scalar rho)
+    -> decltype(cam.Transfer3d(t_ba, ray, rho)) {
+      return cam.CameraT::Transfer3d(t_ba, ray, rho);
+    }
+
+    template <typename SE3Type, typename RayType, typename Scalar>
+    static auto dTransfer3d_dray(CameraT& cam, const SE3Type& t_ba,
+                                 const RayType& ray, const Scalar rho)
+    -> decltype(cam.dTransfer3d_dray(t_ba, ray, rho)) {
+      return cam.CameraT::dTransfer3d_dray(t_ba, ray, rho);
+    }
+
+    template <typename SE3Type, typename PixelType, typename Scalar>
+    static auto dTransfer_dparams(CameraT& cam, const SE3Type& t_ba,
+                                  const PixelType& pix, const Scalar rho)
+    -> decltype(cam.dTransfer_dparams(t_ba, pix, rho)) {
+      return cam.CameraT::dTransfer_dparams(t_ba, pix, rho);
+    }
+  };
+
+  // The interface itself is dispatched virtually.
+  template <typename Scalar>
+  struct CameraCalls<calibu::CameraInterface<Scalar>> {
+    typedef calibu::CameraInterface<Scalar> CameraT;
+
+    template <typename SE3Type, typename RayType>
+    static auto Transfer3d(CameraT& cam, const SE3Type& t_ba,
+                           const RayType& ray, const Scalar rho)
+    -> decltype(cam.Transfer3d(t_ba, ray, rho)) {
+      return cam.Transfer3d(t_ba, ray, rho);
+    }
+
+    template <typename SE3Type, typename RayType>
+    static auto dTransfer3d_dray(CameraT& cam, const SE3Type& t_ba,
+                                 const RayType& ray, const Scalar rho)
+    -> decltype(cam.dTransfer3d_dray(t_ba, ray, rho)) {
+      return cam.dTransfer3d_dray(t_ba, ray, rho);
+    }
+
+    template <typename SE3Type, typename PixelType>
+    static auto dTransfer_dparams(CameraT& cam, const SE3Type& t_ba,
+                                  const PixelType& pix, const Scalar rho)
+    -> decltype(cam.dTransfer_dparams(t_ba, pix, rho)) {
+      return cam.dTransfer_dparams(t_ba, pix, rho);
+    }
+  };
+
+  // Returns a copy of a camera of one of the calibu models, or nullptr if the
+  // model is not known.
+  template <typename Scalar>
+  static std::shared_ptr<calibu::CameraInterface<Scalar>> CloneCamera(
+      const std::shared_ptr<calibu::CameraInterface<Scalar>>& cam)
+  {
+    calibu::CameraInterface<Scalar>& ref = *cam;
+    switch (GetCameraModel(ref)) {
+      case CameraFov:
+        return std::make_shared<calibu::FovCamera<Scalar>>(
+              static_cast<calibu::FovCamera<Scalar>&>(ref));
+      case CameraPoly2:
+        return std::make_shared<calibu::Poly2Camera<Scalar>>(
+              static_cast<calibu::Poly2Camera<Scalar>&>(ref));
+      case CameraPoly3:
+        return std::make_shared<calibu::Poly3Camera<Scalar>>(
+              static_cast<calibu::Poly3Camera<Scalar>&>(ref));
+      case CameraKannalaBrandt:
+        return std::make_shared<calibu::KannalaBrandtCamera<Scalar>>(
+              static_cast<calibu::KannalaBrandtCamera<Scalar>&>(ref));
+      case CameraLinear:
+        return std::make_shared<calibu::LinearCamera<Scalar>>(
+              static_cast<calibu::LinearCamera<Scalar>&>(ref));
+      default:
+        return nullptr;
+    }
+  }
+
   template <typename BaType, typename Scalar>
   class ParallelProjectionResiduals {
   public:
     BaType& tracker;
 
-    // Reduced quantities.
-    std::vector<Scalar> errors;
-    std::vector<Scalar> cond_errors;
+    // If false only the residuals are evaluated, the jacobians are then
+    // computed per landmark track with Evaluate().
+    bool compute_jacobians;
+
+    // If true the jacobians use the per pose pair quantities of
+    // tracker.proj_pairs_ (inverse depth only), which must be current, and
+    // the residuals are visited in the order of their pairs.
+    bool use_projection_pairs;
+
+    // If true the residuals were already evaluated by
+    // tracker.EvaluateProjectionResiduals(true), and the projection jacobians
+    // of the cameras with a batched kernel are read from
+    // tracker.proj_point_jacobians_.
+    bool use_batched_projections;
+
+    // With per pose camera parameters every body owns copies of the rig
+    // cameras, so that they can be re-parametrized for each residual while
+    // other bodies evaluate theirs. Empty if not needed, or if a camera model
+    // can not be copied, in which case the body must not run concurrently.
+    std::vector<std::shared_ptr<calibu::CameraInterface<Scalar>>> cameras;
+    // The pose whose intrinsics each copy currently holds, or -1.
+    std::vector<int> camera_param_poses;
+    // The model of each rig camera, detected once per body.
+    std::vector<CameraModel> camera_models;
+    // The intrinsics set on a camera for a residual, and those of a shared
+    // rig camera to restore. calibu cameras take their parameters as a
+    // VectorXd, so these keep their size across residuals and are only
+    // allocated by the first one.
+    Eigen::VectorXd pose_params;
+    Eigen::VectorXd backup_params;
 
     ParallelProjectionResiduals(BaType& tracker_ref) :
-      tracker(tracker_ref)
-    {}
+      tracker(tracker_ref),
+      compute_jacobians(true),
+      use_projection_pairs(false),
+      use_batched_projections(false)
+    {
+      CloneCameras();
+    }
 
     ParallelProjectionResiduals(const ParallelProjectionResiduals &other,
                                 tbb::split) :
-      tracker(other.tracker)
-    {}
+      tracker(other.tracker),
+      compute_jacobians(other.compute_jacobians),
+      use_projection_pairs(other.use_projection_pairs),
+      use_batched_projections(other.use_batched_projections)
+    {
+      CloneCameras();
+    }
 
-    void join(ParallelProjectionResiduals& other) {
-      errors.insert(errors.end(), other.errors.begin(),
-                    other.errors.end());
+    // The robust norm statistics are gathered from the residuals afterwards,
+    // so there is nothing to reduce.
+    void join(ParallelProjectionResiduals&) {}
 
-      cond_errors.insert(cond_errors.end(), other.cond_errors.begin(),
-                    other.cond_errors.end());
+    // Whether the bodies can be run concurrently.
+    bool IsThreadSafe() const
+    {
+      return !tracker.options_.use_per_pose_cam_params || !cameras.empty();
     }
 
     void operator() (const tbb::blocked_range<int>& r) {
       for (int ii = r.begin(); ii != r.end(); ii++) {
-        typename BaType::ProjectionResidual& res = tracker.proj_residuals_[ii];
-        // calculate measurement jacobians
-
-        // Tsw = T_cv * T_vw
-        typename BaType::Landmark& lm = tracker.landmarks_[res.landmark_id];
-        typename BaType::Pose& pose = tracker.poses_[res.x_meas_id];
-        typename BaType::Pose& ref_pose = tracker.poses_[res.x_ref_id];
-        std::shared_ptr<calibu::CameraInterface<Scalar>> cam =
-            tracker.rig_->cameras_[res.cam_id];
-
-        const typename BaType::SE3t& t_vs_m = tracker.rig_->cameras_[res.cam_id]->Pose();
-        const typename BaType::SE3t& t_vs_r = tracker.rig_->cameras_[lm.ref_cam_id]->Pose();
-        const typename BaType::SE3t& t_sw_m =
-            pose.GetTsw(res.cam_id, tracker.rig_);
-        const typename BaType::SE3t t_ws_r =
-            ref_pose.GetTsw(lm.ref_cam_id, tracker.rig_).inverse();
-
-        Eigen::VectorXd backup_params = cam->GetParams();
-        if (tracker.options_.use_per_pose_cam_params) {
-          cam->SetParams(pose.cam_params);
+        typename BaType::ProjectionResidual& res = tracker.proj_residuals_[
+            use_projection_pairs && BaType::kLmDim == 1 ?
+              tracker.proj_pair_order_[ii] : ii];
+        Evaluate(res, !use_batched_projections, compute_jacobians);
+
+        // set the residual in m_R which is dense
+        res.weight =  res.orig_weight;
+        res.mahalanobis_distance = res.residual.squaredNorm() * res.weight;
+      }
+    }
+
+    void CloneCameras()
+    {
+      const auto& rig_cameras = tracker.rig_->cameras_;
+      camera_models.resize(rig_cameras.size());
+      for (size_t ii = 0; ii < rig_cameras.size(); ++ii) {
+        camera_models[ii] = GetCameraModel(*rig_cameras[ii]);
+      }
+      if (!tracker.options_.use_per_pose_cam_params) {
+        return;
+      }
+      cameras.resize(rig_cameras.size());
+      camera_param_poses.assign(rig_cameras.size(), -1);
+      for (size_t ii = 0; ii < rig_cameras.size(); ++ii) {
+        cameras[ii] = CloneCamera<Scalar>(rig_cameras[ii]);
+        if (!cameras[ii]) {
+          cameras.clear();
+          return;
+        }
+      }
+    }
+
+    // Evaluates the residual and/or the measurement jacobians of res, with
+    // the instantiation for the model of its camera.
+    void Evaluate(typename BaType::ProjectionResidual& res,
+                  const bool compute_residual, const bool linearize) {
+      const bool use_copy = !cameras.empty();
+      calibu::CameraInterface<Scalar>& cam = use_copy ?
+            *cameras[res.cam_id] : *tracker.rig_->cameras_[res.cam_id];
+      switch (camera_models[res.cam_id]) {
+        case CameraFov:
+          Evaluate(static_cast<calibu::FovCamera<Scalar>&>(cam), use_copy,
+                   res, compute_residual, linearize);
+          break;
+        case CameraPoly2:
+          Evaluate(static_cast<calibu::Poly2Camera<Scalar>&>(cam), use_copy,
+                   res, compute_residual, linearize);
+          break;
+        case CameraPoly3:
+          Evaluate(static_cast<calibu::Poly3Camera<Scalar>&>(cam), use_copy,
+                   res, compute_residual, linearize);
+          break;
+        case CameraKannalaBrandt:
+          Evaluate(static_cast<calibu::KannalaBrandtCamera<Scalar>&>(cam),
+                   use_copy, res, compute_residual, linearize);
+          break;
+        case CameraLinear:
+          Evaluate(static_cast<calibu::LinearCamera<Scalar>&>(cam), use_copy,
+                   res, compute_residual, linearize);
+          break;
+        default:
+          Evaluate(cam, use_copy, res, compute_residual, linearize);
+          break;
+      }
+    }
+
+    template <typename CameraT>
+    void Evaluate(CameraT& cam, const bool use_copy,
+                  typename BaType::ProjectionResidual& res,
+                  const bool compute_residual, const bool linearize) {
+      typedef CameraCalls<CameraT> Calls;
+      // Tsw = T_cv * T_vw
+      typename BaType::Landmark& lm = tracker.landmarks_[res.landmark_id];
+      typename BaType::Pose& pose = tracker.poses_[res.x_meas_id];
+      typename BaType::Pose& ref_pose = tracker.poses_[res.x_ref_id];
+
+      const typename BaType::SE3t& t_vs_m = tracker.rig_->cameras_[res.cam_id]->Pose();
+      const typename BaType::SE3t& t_vs_r = tracker.rig_->cameras_[lm.ref_cam_id]->Pose();
+      const typename BaType::SE3t& t_sw_m =
+          pose.GetTsw(res.cam_id, tracker.rig_);
+      const typename BaType::SE3t t_ws_r =
+          ref_pose.GetTsw(lm.ref_cam_id, tracker.rig_).inverse();
+      const typename BaType::ProjectionPair* pair =
+          use_projection_pairs && BaType::kLmDim == 1 ?
+            &tracker.proj_pairs_[tracker.proj_pair_ids_[res.residual_id]] :
+            nullptr;
+
+      // Only the shared rig camera has to be restored afterwards.
+      const bool restore_params =
+          tracker.options_.use_per_pose_cam_params && !use_copy;
+      if (restore_params) {
+        backup_params = cam.GetParams();
+      }
+      // A copy keeps the intrinsics of the last pose, which are often those
+      // of the next residual.
+      if (restore_params ||
+          (use_copy && camera_param_poses[res.cam_id] != (int)pose.id)) {
+        pose_params = pose.cam_params.template cast<double>();
+        cam.SetParams(pose_params);
+        if (use_copy) {
+          camera_param_poses[res.cam_id] = pose.id;
         }
+      }
 
+      if (compute_residual) {
         const typename BaType::Vector2t p = BaType::kLmDim == 3 ?
-              cam->Transfer3d(t_sw_m, lm.x_w.template head<3>(), lm.x_w(3)) :
-              cam->Transfer3d(t_sw_m * t_ws_r, lm.x_s.template head<3>(),
-                              lm.x_s(3));
+              Calls::Transfer3d(cam, t_sw_m, lm.x_w.template head<3>(),
+                                lm.x_w(3)) :
+              Calls::Transfer3d(cam, t_sw_m * t_ws_r,
+                                lm.x_s.template head<3>(), lm.x_s(3));
 
         res.residual = res.z - p;
         // std::cerr << "res " << res.residual_id << " : pre" <<
         //                res.residual.norm() << std::endl;
+      }
+
+      if (!linearize) {
+        if (restore_params) {
+          cam.SetParams(backup_params);
+        }
+        return;
+      }
 
-        const typename BaType::Vector4t x_s_m = BaType::kLmDim == 1 ?
-              MultHomogeneous(t_sw_m * t_ws_r, lm.x_s) :
-              MultHomogeneous(t_sw_m, lm.x_w);
+      const typename BaType::Vector4t x_s_m = pair ?
+            (pair->t_sm_r_matrix * lm.x_s).eval() : BaType::kLmDim == 1 ?
+            MultHomogeneous(t_sw_m * t_ws_r, lm.x_s) :
+            MultHomogeneous(t_sw_m, lm.x_w);
+
+      // Derivative of the projection of a point in to a camera
+      Eigen::Matrix<Scalar,2,4> dt_dp_m;
+      if (use_batched_projections &&
+          tracker.proj_observations_[res.cam_id].model != CameraGeneric) {
+        dt_dp_m << tracker.proj_point_jacobians_[res.residual_id],
+            Eigen::Matrix<Scalar, 2, 1>::Zero();
+      } else {
+        dt_dp_m = Calls::dTransfer3d_dray(
+              cam, typename BaType::SE3t(), x_s_m.template head<3>(),x_s_m(3));
+      }
 
-        // Derivative of the projection of a point in to a camera
-        const Eigen::Matrix<Scalar,2,4> dt_dp_m = cam->dTransfer3d_dray(
-              typename BaType::SE3t(), x_s_m.template head<3>(),x_s_m(3));
+      const Eigen::Matrix<Scalar,2,4> dt_dp_s = pair ?
+            dt_dp_m * pair->t_sm_r_matrix : BaType::kLmDim == 3 ?
+            dt_dp_m * t_sw_m.matrix() :
+            dt_dp_m * (t_sw_m*t_ws_r).matrix();
 
-        const Eigen::Matrix<Scalar,2,4> dt_dp_s = BaType::kLmDim == 3 ?
-              dt_dp_m * t_sw_m.matrix() :
-              dt_dp_m * (t_sw_m*t_ws_r).matrix();
+      // Landmark Jacobian
+      if (lm.is_active) {
+        res.dz_dlm = -dt_dp_s.template block<2, BaType::kLmDim>(
+              0, BaType::kLmDim == 3 ? 0 : 3 );
+      }
 
-        // Landmark Jacobian
-        if (lm.is_active) {
-          res.dz_dlm = -dt_dp_s.template block<2, BaType::kLmDim>(
-                0, BaType::kLmDim == 3 ? 0 : 3 );
+      const bool diff_poses =  res.x_ref_id != res.x_meas_id;
+
+      if (pose.is_active || ref_pose.is_active) {
+        // If the reference and measurement poses are the same, the derivative
+        // is zero.
+        if (diff_poses && pair) {
+          res.dz_dx_meas =
+              -dt_dp_m *
+              dt_x_dt<Scalar>(t_sw_m, pair->t_ws_r_matrix * lm.x_s) *
+              pair->dt_dx_meas;
+        } else if (diff_poses) {
+          res.dz_dx_meas =
+              -dt_dp_m *
+              dt_x_dt<Scalar>(t_sw_m, t_ws_r.matrix() * lm.x_s) *
+              dt1_t2_dt2(t_vs_m.inverse()/*, pose.t_wp.inverse()*/) *
+              dinv_exp_decoupled_dx(pose.t_wp);
+        } else {
+          res.dz_dx_meas.setZero();
         }
 
-        const bool diff_poses =  res.x_ref_id != res.x_meas_id;
-
-        if (pose.is_active || ref_pose.is_active) {
-          // If the reference and measurement poses are the same, the derivative
-          // is zero.
-          if (diff_poses) {
-            res.dz_dx_meas =
+        // only need this if we are in inverse depth mode and the poses aren't
+        // the same
+        if (BaType::kLmDim == 1) {
+          if (diff_poses && pair) {
+            res.dz_dx_ref =
                 -dt_dp_m *
-                dt_x_dt<Scalar>(t_sw_m, t_ws_r.matrix() * lm.x_s) *
-                dt1_t2_dt2(t_vs_m.inverse()/*, pose.t_wp.inverse()*/) *
-                dinv_exp_decoupled_dx(pose.t_wp);
+                dt_x_dt<Scalar>(pair->t_sm_wr, pair->t_vs_r_matrix * lm.x_s) *
+                pair->dt_dx_ref;
+          } else if (diff_poses) {
+            res.dz_dx_ref =
+                -dt_dp_m *
+                dt_x_dt<Scalar>(t_sw_m * ref_pose.t_wp,
+                                t_vs_r.matrix() * lm.x_s)
+                * dt1_t2_dt2(t_sw_m/*, ref_pose.t_wp*/) *
+                dexp_decoupled_dx(ref_pose.t_wp);
           } else {
-            res.dz_dx_meas.setZero();
+            res.dz_dx_ref.setZero();
           }
 
-          // only need this if we are in inverse depth mode and the poses aren't
-          // the same
-          if (BaType::kLmDim == 1) {
-            if (diff_poses) {
-              res.dz_dx_ref =
-                  -dt_dp_m *
-                  dt_x_dt<Scalar>(t_sw_m * ref_pose.t_wp,
-                                  t_vs_r.matrix() * lm.x_s)
-                  * dt1_t2_dt2(t_sw_m/*, ref_pose.t_wp*/) *
-                  dexp_decoupled_dx(ref_pose.t_wp);
-            } else {
-              res.dz_dx_ref.setZero();
-            }
-
-            if (BaType::kCamParamsInCalib) {
-              res.dz_dcam_params =
-                  -cam->dTransfer_dparams(t_sw_m * t_ws_r,
+          if (BaType::kCamParamsInCalib) {
+            res.dz_dcam_params =
+                -Calls::dTransfer_dparams(cam, pair ? pair->t_sm_r :
+                                                      t_sw_m * t_ws_r,
                                           lm.z_ref, lm.x_s(3));
-            }
-
-            if (BaType::kTvsInCalib) {
-              // Total derivative of transfer.
-              res.dz_dtvs =
-                  -dt_dp_m *
-                  dt_x_dt<Scalar>(t_sw_m * t_ws_r, lm.x_s) *
-                  (dt1_t2_dt2(t_vs_m.inverse()) *
-                   dt1_t2_dt2(pose.t_wp.inverse() * ref_pose.t_wp) *
-                   dexp_decoupled_dx(t_vs_r) +
-                   dt1_t2_dt1(t_vs_m.inverse(),
-                              pose.t_wp.inverse() * ref_pose.t_wp * t_vs_r) *
-                   dinv_exp_decoupled_dx(t_vs_m));
-            }
           }
-        }
 
-        BA_TEST(_Test_dProjectionResidual_dX(res, pose, ref_pose, lm, rig_));
-
-        if (tracker.options_.use_per_pose_cam_params) {
-          cam->SetParams(backup_params);
+          if (BaType::kTvsInCalib && pair) {
+            // Total derivative of transfer.
+            res.dz_dtvs =
+                -dt_dp_m * dt_x_dt<Scalar>(pair->t_sm_r, lm.x_s) *
+                pair->dt_dtvs;
+          } else if (BaType::kTvsInCalib) {
+            // Total derivative of transfer.
+            res.dz_dtvs =
+                -dt_dp_m *
+                dt_x_dt<Scalar>(t_sw_m * t_ws_r, lm.x_s) *
+                (dt1_t2_dt2(t_vs_m.inverse()) *
+                 dt1_t2_dt2(pose.t_wp.inverse() * ref_pose.t_wp) *
+                 dexp_decoupled_dx(t_vs_r) +
+                 dt1_t2_dt1(t_vs_m.inverse(),
+                            pose.t_wp.inverse() * ref_pose.t_wp * t_vs_r) *
+                 dinv_exp_decoupled_dx(t_vs_m));
+          }
         }
+      }
 
-        // set the residual in m_R which is dense
-        res.weight =  res.orig_weight;
-        res.mahalanobis_distance = res.residual.squaredNorm() * res.weight;
-        // this array is used to calculate the robust norm
-        if (res.is_conditioning) {
-          cond_errors.push_back(res.mahalanobis_distance);
-        } else {
-          errors.push_back(res.mahalanobis_distance);
-        }
+      BA_TEST(_Test_dProjectionResidual_dX(res, pose, ref_pose, lm, rig_));
+
+      if (restore_params) {
+        cam.SetParams(backup_params);
       }
     }
   };
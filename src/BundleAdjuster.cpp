@@ -1,6 +1,7 @@
 #include <ba/BundleAdjuster.h>
 #include <iomanip>
 #include <fstream>
+#include <type_traits>
 #include <ba/parallel_algos.h>
 #include <xmmintrin.h>
 
@@ -145,112 +146,122 @@ namespace ba {
       Scalar* proj_error, Scalar* binary_error,
       Scalar* unary_error, Scalar* inertial_error)
   {
+    // Only the residuals and their norms are evaluated, in parallel. The
+    // norms are then summed serially in residual order, so the costs compared
+    // by the solvers do not depend on the scheduling.
     if (proj_error) {
-      // Reset the outlier count.
-      for (Landmark& lm : landmarks_) {
-        lm.num_outlier_residuals = 0;
-      }
-
-      *proj_error = 0;
-      for (ProjectionResidual& res : proj_residuals_) {
-        Landmark& lm = landmarks_[res.landmark_id];
-        Pose& pose = poses_[res.x_meas_id];
-        Pose& ref_pose = poses_[res.x_ref_id];
-        const SE3t t_sw_m = pose.GetTsw(res.cam_id, rig_);
-        const SE3t t_ws_r = ref_pose.GetTsw(lm.ref_cam_id,rig_).inverse();
-
-        Eigen::VectorXd backup_params = rig_->cameras_[res.cam_id]->GetParams();
-        if (options_.use_per_pose_cam_params) {
-          rig_->cameras_[res.cam_id]->SetParams(pose.cam_params);
-        }
-
-        const Vector2t p = kLmDim == 3 ?
-              rig_->cameras_[res.cam_id]->Transfer3d(
-              t_sw_m, lm.x_w.template head<3>(),lm.x_w(3)) :
-            rig_->cameras_[res.cam_id]->Transfer3d(
-              t_sw_m*t_ws_r, lm.x_s.template head<3>(),lm.x_s(3));
-
-        res.residual = res.z - p;
-
-        if (options_.use_per_pose_cam_params) {
-          rig_->cameras_[res.cam_id]->SetParams(backup_params);
+      CacheTsw();
+      EvaluateProjectionResiduals();
+      // The outlier count of a landmark is owned by the task going over its
+      // track.
+      tbb::parallel_for(tbb::blocked_range<size_t>(0, landmarks_.size()),
+                        [&](const tbb::blocked_range<size_t>& r) {
+        for (size_t ii = r.begin(); ii != r.end(); ++ii) {
+          Landmark& lm = landmarks_[ii];
+          lm.num_outlier_residuals = 0;
+          for (const int id : lm.proj_residuals) {
+            ProjectionResidual& res = proj_residuals_[id];
+            res.mahalanobis_distance = res.residual.squaredNorm() * res.weight;
+            // If this is an outlier, mark it as such
+            if (res.residual.norm() > options_.projection_outlier_threshold) {
+              lm.num_outlier_residuals++;
+            }
+          }
         }
+      });
 
-        //  std::cout << "res " << res.residual_id << " : pre" << res.residual.norm() <<
-        //               " post " << res.residual.norm() * res.weight << std::endl;
-        res.mahalanobis_distance = res.residual.squaredNorm() * res.weight;
+      *proj_error = 0;
+      for (const ProjectionResidual& res : proj_residuals_) {
         *proj_error += res.mahalanobis_distance;
-        // If this is an outlier, mark it as such
-        if (res.residual.norm() > options_.projection_outlier_threshold) {
-          landmarks_[res.landmark_id].num_outlier_residuals++;
-        }
       }
     }
 
     if (unary_error) {
-      *unary_error = 0;
-      for (UnaryResidual& res : unary_residuals_) {
-        const Pose& pose = poses_[res.pose_id];
-        // res.residual = SE3t::log(res.t_wp.inverse() * pose.t_wp);
-        res.residual = log_decoupled(pose.t_wp, res.t_wp);
+      tbb::parallel_for(tbb::blocked_range<size_t>(0, unary_residuals_.size()),
+                        [&](const tbb::blocked_range<size_t>& r) {
+        for (size_t ii = r.begin(); ii != r.end(); ++ii) {
+          UnaryResidual& res = unary_residuals_[ii];
+          const Pose& pose = poses_[res.pose_id];
+          // res.residual = SE3t::log(res.t_wp.inverse() * pose.t_wp);
+          res.residual = log_decoupled(pose.t_wp, res.t_wp);
+
+          if (!res.use_rotation) {
+            res.residual.template tail<3>().setZero();
+          }
 
-        if (!res.use_rotation) {
-          res.residual.template tail<3>().setZero();
+          res.mahalanobis_distance =
+              (res.residual.transpose() * res.cov_inv * res.residual);
         }
+      });
 
-        res.mahalanobis_distance =
-            (res.residual.transpose() * res.cov_inv * res.residual);
+      *unary_error = 0;
+      for (const UnaryResidual& res : unary_residuals_) {
         *unary_error += res.mahalanobis_distance;
       }
     }
 
     if (binary_error) {
-      *binary_error = 0;
-      for (BinaryResidual& res : binary_residuals_) {
-        const Pose& pose1 = poses_[res.x1_id];
-        const Pose& pose2 = poses_[res.x2_id];
-        res.residual = log_decoupled(pose1.t_wp.inverse() * pose2.t_wp,
-                                     res.t_12);
+      tbb::parallel_for(tbb::blocked_range<size_t>(0, binary_residuals_.size()),
+                        [&](const tbb::blocked_range<size_t>& r) {
+        for (size_t ii = r.begin(); ii != r.end(); ++ii) {
+          BinaryResidual& res = binary_residuals_[ii];
+          const Pose& pose1 = poses_[res.x1_id];
+          const Pose& pose2 = poses_[res.x2_id];
+          res.residual = log_decoupled(pose1.t_wp.inverse() * pose2.t_wp,
+                                       res.t_12);
+
+          if (!res.use_rotation) {
+            res.residual.template tail<3>().setZero();
+          }
 
-        if (!res.use_rotation) {
-          res.residual.template tail<3>().setZero();
+          // res.residual = SE3t::log(pose1.t_wp.inverse() * pose2.t_wp * res.t_21);
+          res.mahalanobis_distance = res.residual.squaredNorm() * res.weight;
         }
+      });
 
-        // res.residual = SE3t::log(pose1.t_wp.inverse() * pose2.t_wp * res.t_21);
-        res.mahalanobis_distance = res.residual.squaredNorm() * res.weight;
+      *binary_error = 0;
+      for (const BinaryResidual& res : binary_residuals_) {
         *binary_error += res.mahalanobis_distance;
       }
     }
 
     if (inertial_error) {
-      *inertial_error = 0;
-      for (ImuResidual& res : inertial_residuals_) {
-        // set up the initial pose for the integration
-        const Vector3t gravity = kGravityInCalib ? GetGravityVector(imu_.g) :
-                                                   imu_.g_vec;
-
-        const Pose& pose1 = poses_[res.pose1_id];
-        const Pose& pose2 = poses_[res.pose2_id];
+      // set up the initial pose for the integration
+      const Vector3t gravity = kGravityInCalib ? GetGravityVector(imu_.g) :
+                                                 imu_.g_vec;
+      // Every residual integrates its own measurements.
+      tbb::parallel_for(tbb::blocked_range<size_t>(
+                          0, inertial_residuals_.size()),
+                        [&](const tbb::blocked_range<size_t>& r) {
+        for (size_t ii = r.begin(); ii != r.end(); ++ii) {
+          ImuResidual& res = inertial_residuals_[ii];
+          const Pose& pose1 = poses_[res.pose1_id];
+          const Pose& pose2 = poses_[res.pose2_id];
+
+          // Eigen::Matrix<Scalar,10,10> jb_y;
+          const ImuPose imu_pose = ImuResidual::IntegrateResidual(
+                pose1,res.measurements,pose1.b.template head<3>(),
+                pose1.b.template tail<3>(),gravity,res.poses);
+
+          const SE3t& t_wb = pose2.t_wp;
+
+          res.residual.setZero();
+          // TODO: This is bad, as the error is taken in the world frame. The
+          // order of these should be swapped
+          res.residual.template head<6>() = log_decoupled(imu_pose.t_wp, t_wb);
+          res.residual.template segment<3>(6) = imu_pose.v_w - pose2.v_w;
 
-        // Eigen::Matrix<Scalar,10,10> jb_y;
-        const ImuPose imu_pose = ImuResidual::IntegrateResidual(
-              pose1,res.measurements,pose1.b.template head<3>(),
-              pose1.b.template tail<3>(),gravity,res.poses);
-
-        const SE3t& t_wb = pose2.t_wp;
-
-        res.residual.setZero();
-        // TODO: This is bad, as the error is taken in the world frame. The order
-        // of these should be swapped
-        res.residual.template head<6>() = log_decoupled(imu_pose.t_wp, t_wb);
-        res.residual.template segment<3>(6) = imu_pose.v_w - pose2.v_w;
+          if (kBiasInState) {
+            res.residual.template segment<6>(9) = pose1.b - pose2.b;
+          }
 
-        if (kBiasInState) {
-          res.residual.template segment<6>(9) = pose1.b - pose2.b;
+          res.mahalanobis_distance =
+              (res.residual.transpose() * res.cov_inv * res.residual);
         }
+      });
 
-        res.mahalanobis_distance =
-            (res.residual.transpose() * res.cov_inv * res.residual);
+      *inertial_error = 0;
+      for (const ImuResidual& res : inertial_residuals_) {
         *inertial_error += res.mahalanobis_distance;
       }
 
@@ -273,6 +284,363 @@ namespace ba {
 
   }
 
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  GetLinearizationErrors(Scalar* proj_error, Scalar* binary_error,
+                         Scalar* unary_error, Scalar* inertial_error)
+  {
+    // BuildProblem evaluated the projection, unary and inertial residuals at
+    // the accepted state, and their distances already carry the robust
+    // weights of this linearization, with which the steps are compared. The
+    // binary residuals are linearized in a different form, but are cheap to
+    // evaluate.
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, landmarks_.size()),
+                      [&](const tbb::blocked_range<size_t>& r) {
+      for (size_t ii = r.begin(); ii != r.end(); ++ii) {
+        Landmark& lm = landmarks_[ii];
+        lm.num_outlier_residuals = 0;
+        for (const int id : lm.proj_residuals) {
+          if (proj_residuals_[id].residual.norm() >
+              options_.projection_outlier_threshold) {
+            lm.num_outlier_residuals++;
+          }
+        }
+      }
+    });
+
+    *proj_error = 0;
+    for (const ProjectionResidual& res : proj_residuals_) {
+      *proj_error += res.mahalanobis_distance;
+    }
+    *unary_error = 0;
+    for (const UnaryResidual& res : unary_residuals_) {
+      *unary_error += res.mahalanobis_distance;
+    }
+    *inertial_error = 0;
+    for (const ImuResidual& res : inertial_residuals_) {
+      *inertial_error += res.mahalanobis_distance;
+    }
+    EvaluateResiduals(nullptr, binary_error, nullptr, nullptr);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::CacheTsw()
+  {
+    // GetTsw() fills the cache of a pose lazily, which is not safe while the
+    // residuals are evaluated concurrently. ApplyUpdate() clears it.
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, poses_.size()),
+                      [&](const tbb::blocked_range<size_t>& r) {
+      for (size_t jj = r.begin(); jj != r.end(); ++jj) {
+        for (size_t ii = 0; ii < rig_->cameras_.size(); ++ii) {
+          poses_[jj].GetTsw(ii, rig_);
+        }
+      }
+    });
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  UpdateProjectionPairs()
+  {
+    if (kLmDim != 1) {
+      return;
+    }
+
+    // Residuals are only added (or all cleared by Init), so the pairs are
+    // current if every residual has one. Otherwise the residuals are sorted
+    // by pair, which gives the pairs and the order in which the residuals
+    // are linearized.
+    auto key = [&](const uint32_t id) {
+      const ProjectionResidual& res = proj_residuals_[id];
+      return std::array<uint32_t, 4>{{
+          res.x_meas_id, res.x_ref_id, res.cam_id,
+          landmarks_[res.landmark_id].ref_cam_id}};
+    };
+    if (proj_pair_ids_.size() != proj_residuals_.size()) {
+      proj_pair_order_.resize(proj_residuals_.size());
+      for (size_t ii = 0; ii < proj_pair_order_.size(); ++ii) {
+        proj_pair_order_[ii] = ii;
+      }
+      std::stable_sort(proj_pair_order_.begin(), proj_pair_order_.end(),
+                       [&](const uint32_t lhs, const uint32_t rhs) {
+        return key(lhs) < key(rhs);
+      });
+
+      proj_pairs_.clear();
+      proj_pair_ids_.resize(proj_residuals_.size());
+      for (size_t ii = 0; ii < proj_pair_order_.size(); ++ii) {
+        const uint32_t id = proj_pair_order_[ii];
+        const std::array<uint32_t, 4> pair_key = key(id);
+        if (ii == 0 || pair_key != key(proj_pair_order_[ii - 1])) {
+          ProjectionPair pair;
+          pair.x_meas_id = pair_key[0];
+          pair.x_ref_id = pair_key[1];
+          pair.cam_id = pair_key[2];
+          pair.ref_cam_id = pair_key[3];
+          proj_pairs_.push_back(pair);
+        }
+        proj_pair_ids_[id] = proj_pairs_.size() - 1;
+      }
+    }
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, proj_pairs_.size()),
+                      [&](const tbb::blocked_range<size_t>& r) {
+      for (size_t ii = r.begin(); ii != r.end(); ++ii) {
+        ProjectionPair& pair = proj_pairs_[ii];
+        const Pose& pose = poses_[pair.x_meas_id];
+        const Pose& ref_pose = poses_[pair.x_ref_id];
+        const SE3t& t_vs_m = rig_->cameras_[pair.cam_id]->Pose();
+        const SE3t& t_vs_r = rig_->cameras_[pair.ref_cam_id]->Pose();
+        const SE3t& t_sw_m = pose.t_sw[pair.cam_id];
+        const SE3t t_ws_r = ref_pose.t_sw[pair.ref_cam_id].inverse();
+
+        pair.t_sm_r = t_sw_m * t_ws_r;
+        pair.t_sm_wr = t_sw_m * ref_pose.t_wp;
+        pair.t_sm_r_matrix = pair.t_sm_r.matrix();
+        pair.t_ws_r_matrix = t_ws_r.matrix();
+        pair.t_vs_r_matrix = t_vs_r.matrix();
+        pair.dt_dx_meas = dt1_t2_dt2(t_vs_m.inverse()) *
+            dinv_exp_decoupled_dx(pose.t_wp);
+        pair.dt_dx_ref = dt1_t2_dt2(t_sw_m) * dexp_decoupled_dx(ref_pose.t_wp);
+        if (kTvsInCalib) {
+          const SE3t t_wp_m_inv_wp_r = pose.t_wp.inverse() * ref_pose.t_wp;
+          pair.dt_dtvs =
+              dt1_t2_dt2(t_vs_m.inverse()) * dt1_t2_dt2(t_wp_m_inv_wp_r) *
+              dexp_decoupled_dx(t_vs_r) +
+              dt1_t2_dt1(t_vs_m.inverse(), t_wp_m_inv_wp_r * t_vs_r) *
+              dinv_exp_decoupled_dx(t_vs_m);
+        }
+      }
+    });
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  UpdateProjectionObservations()
+  {
+    // Residuals are only added (or all cleared by Init), so the observations
+    // are current if they hold every residual.
+    size_t num_observations = 0;
+    for (const ProjectionObservations<Scalar>& obs : proj_observations_) {
+      num_observations += obs.size();
+    }
+    if (proj_observations_.size() == rig_->cameras_.size() &&
+        num_observations == proj_residuals_.size()) {
+      return;
+    }
+
+    proj_observations_.resize(rig_->cameras_.size());
+    for (ProjectionObservations<Scalar>& obs : proj_observations_) {
+      obs.clear();
+    }
+    for (size_t ii = 0; ii < proj_residuals_.size(); ++ii) {
+      const ProjectionResidual& res = proj_residuals_[ii];
+      ProjectionObservations<Scalar>& obs = proj_observations_[res.cam_id];
+      obs.residual_ids.push_back(ii);
+      obs.landmark_ids.push_back(res.landmark_id);
+      obs.x_meas_ids.push_back(res.x_meas_id);
+      obs.x_ref_ids.push_back(res.x_ref_id);
+    }
+
+    ProjectionBatch<Scalar> batch;
+    for (uint32_t cam_id = 0; cam_id < proj_observations_.size(); ++cam_id) {
+      ProjectionObservations<Scalar>& obs = proj_observations_[cam_id];
+      obs.z.resize(2, obs.size());
+      for (size_t ii = 0; ii < obs.size(); ++ii) {
+        obs.z.col(ii) = proj_residuals_[obs.residual_ids[ii]].z.array();
+      }
+
+      obs.model = GetProjectionModel(*rig_->cameras_[cam_id]);
+      if (obs.model == CameraGeneric || obs.size() == 0) {
+        continue;
+      }
+      // With per pose camera parameters the camera is checked through a
+      // copy, set to the intrinsics of each residual.
+      std::shared_ptr<calibu::CameraInterface<Scalar>> cam =
+          rig_->cameras_[cam_id];
+      if (options_.use_per_pose_cam_params) {
+        const int num_params = GetNumProjectionParams(obs.model);
+        for (const uint32_t pose_id : obs.x_meas_ids) {
+          if (poses_[pose_id].cam_params.rows() != num_params) {
+            obs.model = CameraGeneric;
+            break;
+          }
+        }
+        cam = CloneCamera<Scalar>(cam);
+        if (obs.model == CameraGeneric || !cam) {
+          obs.model = CameraGeneric;
+          continue;
+        }
+      }
+
+      // Check the kernel and its jacobians against the camera on the first
+      // batch of residuals, with the intrinsics they are evaluated with, and
+      // fall back to the camera if they do not agree.
+      proj_point_jacobians_.resize(proj_residuals_.size());
+      const VectorXt params = cam->GetParams().template cast<Scalar>();
+      const size_t num_checked =
+          std::min<size_t>(obs.size(), ProjectionBatch<Scalar>::kSize);
+      Eigen::VectorXd cam_params;
+      EvaluateProjectionBatch(
+            cam_id, options_.use_per_pose_cam_params ? nullptr : &params,
+            0, num_checked, batch, true);
+      for (size_t ii = 0; ii < num_checked; ++ii) {
+        const ProjectionResidual& res = proj_residuals_[obs.residual_ids[ii]];
+        const Landmark& lm = landmarks_[res.landmark_id];
+        if (options_.use_per_pose_cam_params) {
+          cam_params = poses_[res.x_meas_id].cam_params.template cast<double>();
+          cam->SetParams(cam_params);
+        }
+        const SE3t& t_sw_m = poses_[res.x_meas_id].t_sw[cam_id];
+        const Vector4t x_s_m = kLmDim == 3 ?
+              MultHomogeneous(t_sw_m, lm.x_w) :
+              MultHomogeneous(t_sw_m * poses_[res.x_ref_id].t_sw[
+                              lm.ref_cam_id].inverse(), lm.x_s);
+        const Vector2t p = cam->Transfer3d(
+              SE3t(), x_s_m.template head<3>(), x_s_m(3));
+        const Eigen::Matrix<Scalar, 2, 3> dp_dx = cam->dTransfer3d_dray(
+              SE3t(), x_s_m.template head<3>(), x_s_m(3)).
+            template leftCols<3>();
+        const Vector2t p_batch = res.z - res.residual;
+        if ((p - p_batch).norm() > 1e-6 * (1 + p.norm()) ||
+            (dp_dx - proj_point_jacobians_[res.residual_id]).norm() >
+            1e-6 * (1 + dp_dx.norm())) {
+          StreamMessage(debug_level) << "Batched projection of camera " <<
+                                        cam_id << " disagrees with the camera "
+                                        "model, using the camera." << std::endl;
+          obs.model = CameraGeneric;
+          break;
+        }
+      }
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  EvaluateProjectionBatch(const uint32_t cam_id, const VectorXt* params,
+                          const size_t begin, const size_t end,
+                          ProjectionBatch<Scalar>& batch,
+                          const bool compute_jacobians)
+  {
+    // The transforms, points and intrinsics are gathered from the
+    // observations into the batch, projected together and the residuals
+    // written back. Without shared params, each point takes the intrinsics
+    // of its measurement pose.
+    const ProjectionObservations<Scalar>& obs = proj_observations_[cam_id];
+    const int n = end - begin;
+    const int num_params = GetNumProjectionParams(obs.model);
+    if (params) {
+      batch.SetParams(*params, n);
+    } else {
+      for (int ii = 0; ii < n; ++ii) {
+        batch.k.col(ii).head(num_params) =
+            poses_[obs.x_meas_ids[begin + ii]].cam_params.array();
+      }
+    }
+    for (int ii = 0; ii < n; ++ii) {
+      const Landmark& lm = landmarks_[obs.landmark_ids[begin + ii]];
+      const SE3t& t_sw_m = poses_[obs.x_meas_ids[begin + ii]].t_sw[cam_id];
+      if (kLmDim == 3) {
+        batch.Set(ii, t_sw_m, lm.x_w);
+      } else {
+        batch.Set(ii, t_sw_m * poses_[obs.x_ref_ids[begin + ii]].t_sw[
+                  lm.ref_cam_id].inverse(), lm.x_s);
+      }
+    }
+
+    ProjectBatch(obs.model, batch, n, compute_jacobians);
+
+    for (int ii = 0; ii < n; ++ii) {
+      proj_residuals_[obs.residual_ids[begin + ii]].residual =
+          (obs.z.col(begin + ii) - batch.p.col(ii)).matrix();
+    }
+    if (compute_jacobians) {
+      for (int ii = 0; ii < n; ++ii) {
+        Eigen::Matrix<Scalar, 2, 3>& dp_dx =
+            proj_point_jacobians_[obs.residual_ids[begin + ii]];
+        dp_dx.row(0) =
+            batch.dp_dx.col(ii).template head<3>().transpose().matrix();
+        dp_dx.row(1) =
+            batch.dp_dx.col(ii).template tail<3>().transpose().matrix();
+      }
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  EvaluateProjectionResiduals(const bool compute_jacobians)
+  {
+    // Expects CacheTsw(). With per pose camera parameters the intrinsics of
+    // each residual are read from its pose, the shared cameras are not
+    // touched.
+    typedef ParallelProjectionResiduals<BundleAdjuster<Scalar, LmSize,
+        PoseSize, CalibSize, DoTvs>, Scalar> Evaluator;
+    std::vector<uint32_t> generic_cams;
+    UpdateProjectionObservations();
+    if (compute_jacobians) {
+      proj_point_jacobians_.resize(proj_residuals_.size());
+    }
+    for (uint32_t cam_id = 0; cam_id < proj_observations_.size(); ++cam_id) {
+      const ProjectionObservations<Scalar>& obs = proj_observations_[cam_id];
+      if (obs.model == CameraGeneric) {
+        generic_cams.push_back(cam_id);
+        continue;
+      }
+
+      const VectorXt params =
+          rig_->cameras_[cam_id]->GetParams().template cast<Scalar>();
+      const VectorXt* shared_params =
+          options_.use_per_pose_cam_params ? nullptr : &params;
+      const size_t kBatchSize = ProjectionBatch<Scalar>::kSize;
+      const size_t num_batches = (obs.size() + kBatchSize - 1) / kBatchSize;
+      tbb::parallel_for(tbb::blocked_range<size_t>(0, num_batches),
+                        [&](const tbb::blocked_range<size_t>& r) {
+        ProjectionBatch<Scalar> batch;
+        for (size_t ii = r.begin(); ii != r.end(); ++ii) {
+          EvaluateProjectionBatch(
+                cam_id, shared_params, ii * kBatchSize,
+                std::min((ii + 1) * kBatchSize, obs.size()), batch,
+                compute_jacobians);
+        }
+      });
+    }
+
+    if (generic_cams.empty()) {
+      return;
+    }
+
+    // The remaining residuals are evaluated one at a time through their
+    // camera.
+    std::vector<bool> is_generic(rig_->cameras_.size(), false);
+    for (const uint32_t cam_id : generic_cams) {
+      is_generic[cam_id] = true;
+    }
+    tbb::enumerable_thread_specific<Evaluator> evaluators(
+        [&]() { return Evaluator(*this); });
+    auto evaluate = [&](const tbb::blocked_range<size_t>& r) {
+      Evaluator& evaluator = evaluators.local();
+      for (size_t ii = r.begin(); ii != r.end(); ++ii) {
+        ProjectionResidual& res = proj_residuals_[ii];
+        if (is_generic[res.cam_id]) {
+          evaluator.Evaluate(res, true, false);
+        }
+      }
+    };
+
+    const tbb::blocked_range<size_t> range(0, proj_residuals_.size());
+    if (evaluators.local().IsThreadSafe()) {
+      tbb::parallel_for(range, evaluate);
+    } else {
+      evaluate(range);
+    }
+  }
+
   ////////////////////////////////////////////////////////////////////////////////
   template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
   void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::Solve(
@@ -295,6 +663,10 @@ namespace ba {
       }
     }
 
+    ++num_solves_;
+    summary_.num_pcg_iterations = 0;
+    summary_.lm_lambdas.clear();
+    summary_.num_lm_rejected_steps = 0;
     for (uint32_t kk = 0 ; kk < uMaxIter ; ++kk) {
       StreamMessage(debug_level) << ">> Iteration " << kk << std::endl;
       StartTimer(_BuildProblem_);
@@ -311,39 +683,66 @@ namespace ba {
       // calculate bp and bl
       rhs_p_.resize(num_pose_params);
       rhs_k_.resize(kCalibDim);
-      vi_.resize(num_lm, num_lm);
 
       VectorXt rhs_p_sc(num_pose_params + kCalibDim);
-      jt_l_j_pr_.resize(num_lm, num_poses);
 
-      BlockMat< Eigen::Matrix<Scalar, kPrPoseDim, kLmDim>>
-          jt_pr_j_l_vi(num_poses, num_lm);
+      // The patterns of vi_, jt_l_j_pr_, jt_pr_j_l_vi_ and s_pp_ (and of u_
+      // and jt_pr_j_l_ with direct assembly) are kept between iterations.
+      if (is_s_pp_permuted_) {
+        s_pp_.swap(s_pp_swap_);
+        is_s_pp_permuted_ = false;
+      }
+      if (!is_s_pp_pattern_current_) {
+        s_pp_.resize(num_poses, num_poses);
+      }
+      s_pk_.resize(num_pose_params, kCalibDim);
+      s_kk_.resize(kCalibDim, kCalibDim);
 
-      s_.resize(num_pose_params + kCalibDim, num_pose_params + kCalibDim);
+      if (kLmDim > 0 && num_lm > 0) {
+        rhs_l_.resize(num_lm*kLmDim);
+        rhs_l_.setZero();
+        // vi_ is block diagonal, so each landmark writes only its own block
+        // and the landmarks are independent.
+        if (vi_.outerSize() != (int)num_lm ||
+            vi_.outerIndexPtr()[num_lm] != (int)num_lm) {
+          std::vector<std::vector<int>> vi_pattern(num_lm);
+          for (uint32_t ii = 0; ii < num_lm; ++ii) {
+            vi_pattern[ii].push_back(ii);
+          }
+          Eigen::SparseBlockSetPattern(vi_pattern, num_lm, num_lm, vi_);
+        }
+      }
 
       PrintTimer(_rhs_mult_);
 
 
       StartTimer(_jtj_);
-      u_.resize(num_poses, num_poses);
-
-      vi_.setZero();
-      u_.setZero();
       rhs_p_.setZero();
       rhs_k_.setZero();
-      s_.setZero();
+      s_pk_.setZero();
+      s_kk_.setZero();
       rhs_p_sc.setZero();
 
-      if (proj_residuals_.size() > 0 && num_poses > 0) {
+      // Direct assembly forms u_ and rhs_p_ (and jt_pr_j_l_ and the
+      // calibration terms) from the residuals, the products below are only
+      // used with the explicit jacobians.
+      const bool direct_assembly = IsDirectAssemblyUsed();
+      if (direct_assembly) {
+        AssembleHessian();
+      } else {
+        u_.resize(num_poses, num_poses);
+        u_.setZero();
+      }
+
+      if (!direct_assembly && proj_residuals_.size() > 0 && num_poses > 0) {
         BlockMat< Eigen::Matrix<Scalar, kPrPoseDim, kPrPoseDim>> jt_pr_j_pr(
               num_poses, num_poses);
         Eigen::SparseBlockProduct(jt_pr, j_pr_, jt_pr_j_pr,
                                   options_.use_triangular_matrices);
 
-        decltype(u_) temp_u = u_;
         // this is a block add, as jt_pr_j_pr does not have the same block
         // dimensions as u, due to efficiency
-        Eigen::template SparseBlockAdd(temp_u, jt_pr_j_pr, u_);
+        Eigen::SparseBlockAddInPlace(u_, jt_pr_j_pr);
 
         VectorXt jt_pr_r_pr(num_pose_params);
         // this is a strided multiplication, as jt_pr_r_pr might have a larger
@@ -354,14 +753,13 @@ namespace ba {
       }
 
       // add the contribution from the binary terms if any
-      if (binary_residuals_.size() > 0) {
+      if (!direct_assembly && binary_residuals_.size() > 0) {
         BlockMat< Eigen::Matrix<Scalar, kPoseDim, kPoseDim> > jt_pp_j_pp(
               num_poses, num_poses);
 
         Eigen::SparseBlockProduct(jt_pp_ ,j_pp_, jt_pp_j_pp,
                                   options_.use_triangular_matrices);
-        decltype(u_) temp_u = u_;
-        Eigen::SparseBlockAdd(temp_u,jt_pp_j_pp,u_);
+        Eigen::SparseBlockAddInPlace(u_, jt_pp_j_pp);
 
         VectorXt jt_pp_r_pp(num_pose_params);
         Eigen::SparseBlockVectorProductDenseResult(jt_pp_, r_pp_, jt_pp_r_pp);
@@ -371,14 +769,13 @@ namespace ba {
       }
 
       // add the contribution from the unary terms if any
-      if (unary_residuals_.size() > 0) {
+      if (!direct_assembly && unary_residuals_.size() > 0) {
         BlockMat< Eigen::Matrix<Scalar, kPoseDim, kPoseDim> > jt_u_j_u(
               num_poses, num_poses);
 
         Eigen::SparseBlockProduct(jt_u_, j_u_, jt_u_j_u,
                                   options_.use_triangular_matrices);
-        decltype(u_) temp_u = u_;
-        Eigen::SparseBlockAdd(temp_u, jt_u_j_u, u_);
+        Eigen::SparseBlockAddInPlace(u_, jt_u_j_u);
 
         VectorXt jt_u_r_u(num_pose_params);
         Eigen::SparseBlockVectorProductDenseResult(jt_u_, r_u_, jt_u_r_u);
@@ -386,14 +783,13 @@ namespace ba {
       }
 
       // add the contribution from the imu terms if any
-      if (inertial_residuals_.size() > 0) {
+      if (!direct_assembly && inertial_residuals_.size() > 0) {
         BlockMat< Eigen::Matrix<Scalar, kPoseDim, kPoseDim> > jt_i_j_i(
               num_poses, num_poses);
 
         Eigen::SparseBlockProduct(jt_i_, j_i_, jt_i_j_i,
                                   options_.use_triangular_matrices);
-        decltype(u_) temp_u = u_;
-        Eigen::SparseBlockAdd(temp_u, jt_i_j_i, u_);
+        Eigen::SparseBlockAddInPlace(u_, jt_i_j_i);
 
         VectorXt jt_i_r_i(num_pose_params);
         Eigen::SparseBlockVectorProductDenseResult(jt_i_, r_i_, jt_i_r_i);
@@ -407,39 +803,19 @@ namespace ba {
 
       StartTimer(_schur_complement_);
       if (kLmDim > 0 && num_lm > 0) {
-        rhs_l_.resize(num_lm*kLmDim);
-        rhs_l_.setZero();
+        // With fused linearization the landmark blocks were formed in
+        // AssembleHessian.
         StartTimer(_schur_complement_v);
-        Eigen::Matrix<Scalar,kLmDim,1> jtr_l;
-        for (uint32_t ii = 0; ii < landmarks_.size() ; ++ii) {
-          // Skip inactive landmarks.
-          if ( !landmarks_[ii].is_active) {
-            continue;
-          }
-          landmarks_[ii].jtj.setZero();
-          jtr_l.setZero();
-          for (const int id : landmarks_[ii].proj_residuals) {
-            const ProjectionResidual& res = proj_residuals_[id];
-            landmarks_[ii].jtj += (res.dz_dlm.transpose() * res.dz_dlm) *
-                res.weight;
-            jtr_l += (res.dz_dlm.transpose() * sqrt(res.weight) *
-                      r_pr_.template block<ProjectionResidual::kResSize,1>(
-                        res.residual_id*ProjectionResidual::kResSize, 0));
-          }
-          rhs_l_.template block<kLmDim,1>(landmarks_[ii].opt_id*kLmDim, 0) =
-              jtr_l;
-          if (kLmDim == 1) {
-            if (fabs(landmarks_[ii].jtj(0,0)) < 1e-6) {
-              landmarks_[ii].jtj(0,0) += 1e-6;
-            }
-          } else {
-            if (landmarks_[ii].jtj.norm() < 1e-6) {
-              landmarks_[ii].jtj.diagonal() +=
-                  Eigen::Matrix<Scalar, kLmDim, 1>::Constant(1e-6);
+        if (!IsFusedLinearizationUsed()) {
+          tbb::parallel_for(tbb::blocked_range<size_t>(0, landmarks_.size()),
+                            [&](const tbb::blocked_range<size_t>& r) {
+            for (size_t ii = r.begin(); ii != r.end(); ++ii) {
+              // Skip inactive landmarks.
+              if (landmarks_[ii].is_active) {
+                AccumulateLandmarkHessian(landmarks_[ii]);
+              }
             }
-          }
-          vi_.insert(landmarks_[ii].opt_id, landmarks_[ii].opt_id) =
-              landmarks_[ii].jtj.inverse();
+          });
         }
 
         PrintTimer(_schur_complement_v);
@@ -447,75 +823,52 @@ namespace ba {
         // we only do this if there are active poses
         if (num_poses > 0) {
           StartTimer(_schur_complement_jtpr_jl);
-          jt_pr_j_l_.resize(num_poses, num_lm);
-
-          Eigen::SparseBlockProduct(jt_pr,j_l_,jt_pr_j_l_);
+          if (!direct_assembly) {
+            jt_pr_j_l_.resize(num_poses, num_lm);
+            Eigen::SparseBlockProduct(jt_pr,j_l_,jt_pr_j_l_);
+          }
 
-          decltype(jt_l_j_pr_)::forceTranspose(jt_pr_j_l_, jt_l_j_pr_);
           PrintTimer(_schur_complement_jtpr_jl);
 
           // attempt to solve for the poses. W_V_inv is used later on,
           // so we cache it
           StartTimer(_schur_complement_jtpr_jl_vi);
-          Eigen::SparseBlockDiagonalRhsProduct(jt_pr_j_l_, vi_, jt_pr_j_l_vi);
+          UpdateLandmarkCoupling();
           PrintTimer(_schur_complement_jtpr_jl_vi);
 
 
+          // The conjugate gradient solver applies the Schur complement
+          // implicitly, so the pose/pose part is never formed. The reduced
+          // camera matrix is assembled block-sparse, so its size scales with
+          // the covisibility of the poses.
           StartTimer(_schur_complement_jtpr_jl_vi_jtl_jpr);
-          BlockMat< Eigen::Matrix<Scalar, kPrPoseDim, kPrPoseDim>>
-              jt_pr_j_l_vi_jt_l_j_pr(num_poses, num_poses);
-
-          Eigen::SparseBlockProduct(jt_pr_j_l_vi, jt_l_j_pr_,
-                                    jt_pr_j_l_vi_jt_l_j_pr,
-                                    options_.use_triangular_matrices);
+          EliminateLandmarks(!options_.use_pcg_solver, rhs_p_sc);
           PrintTimer(_schur_complement_jtpr_jl_vi_jtl_jpr);
-
-          Eigen::SparseBlockSubtractDenseResult(
-                u_, jt_pr_j_l_vi_jt_l_j_pr,
-                s_.template block(
-                  0, 0, num_pose_params,
-                  num_pose_params ));
-
-          // now form the rhs for the pose equations
-          VectorXt jt_pr_j_l_vi_bll(num_pose_params);
-          Eigen::SparseBlockVectorProductDenseResult(
-                jt_pr_j_l_vi, rhs_l_, jt_pr_j_l_vi_bll, -1, kPoseDim);
-
-          rhs_p_sc.template head(num_pose_params) = rhs_p_ - jt_pr_j_l_vi_bll;
+        } else {
+          s_pp_ = u_;
+          jt_pr_j_l_vi_.resize(num_poses, num_lm);
+          is_s_pp_pattern_current_ = false;
         }
       } else {
-        Eigen::LoadDenseFromSparse(
-              u_, s_.template block(0, 0, num_pose_params, num_pose_params));
+        s_pp_ = u_;
+        is_s_pp_pattern_current_ = false;
         rhs_p_sc.template head(num_pose_params) = rhs_p_;
       }
       PrintTimer(_schur_complement_);
 
-      if(kJkprUsed){
+      if(kJkprUsed && !direct_assembly){
         BlockMat< Eigen::Matrix<Scalar, kCalibDim, kCalibDim>> jt_kpr_j_kpr(1, 1);
         Eigen::SparseBlockProduct(jt_kpr_, j_kpr_, jt_kpr_j_kpr);
-        MatrixXt djt_kpr_j_kpr(kCalibDim, kCalibDim);
-        Eigen::LoadDenseFromSparse(jt_kpr_j_kpr, djt_kpr_j_kpr);
-        s_.template block<kCalibDim, kCalibDim>(num_pose_params, num_pose_params)
-            += djt_kpr_j_kpr;
+        Eigen::AccumulateDenseFromSparse(jt_kpr_j_kpr, s_kk_);
 
         BlockMat<Eigen::Matrix<Scalar, kPrPoseDim, kCalibDim>>
             jt_pr_j_kpr(num_poses, 1);
 
         Eigen::SparseBlockProduct(jt_pr, j_kpr_, jt_pr_j_kpr);
 
-        MatrixXt djt_pr_j_kpr(kPoseDim * num_poses, kCalibDim);
-        // This is a strided load operation, to match kPrPoseDim to kPoseDim
-        Eigen::LoadDenseFromSparse<decltype(jt_pr_j_kpr),
-            MatrixXt,
-            kPoseDim, kCalibDim>
-            (jt_pr_j_kpr, djt_pr_j_kpr);
-        // std::cerr << "djt_pr_j_kpr: " << djt_pr_j_kpr << std::endl;
-        s_.template block(0, num_pose_params, num_pose_params, kCalibDim) +=
-            djt_pr_j_kpr;
-        if (!options_.use_triangular_matrices) {
-          s_.template block(num_pose_params, 0, kCalibDim, num_pose_params) +=
-              djt_pr_j_kpr.transpose();
-        }
+        // This is a strided add, to match kPrPoseDim to kPoseDim
+        Eigen::AccumulateDenseFromSparse<decltype(jt_pr_j_kpr), MatrixXt,
+            kPoseDim, kCalibDim>(jt_pr_j_kpr, s_pk_);
 
         VectorXt jt_kpr_r_pr(kCalibDim, 1);
         Eigen::SparseBlockVectorProductDenseResult(jt_kpr_, r_pr_, jt_kpr_r_pr);
@@ -529,115 +882,109 @@ namespace ba {
 
       // Do the schur complement with the calibration parameters.
       if(kJkprUsed && kLmDim > 0 && num_lm > 0) {
-        jt_l_j_kpr_.resize(num_lm, 1);
-        // schur complement
-        BlockMat< Eigen::Matrix<Scalar, kCalibDim, kLmDim>> jt_kpr_jl(1, num_lm);
-        Eigen::SparseBlockProduct(jt_kpr_, j_l_, jt_kpr_jl);
-        decltype(jt_l_j_kpr_)::forceTranspose(jt_kpr_jl, jt_l_j_kpr_);
-
-        MatrixXt djt_pr_j_l_vi_jt_l_j_kpr(kPoseDim * num_poses, kCalibDim);
-        BlockMat<Eigen::Matrix<Scalar, kPrPoseDim, kCalibDim>>
-            jt_pr_j_l_vi_jt_l_j_kpr(num_poses, 1);
-        jt_pr_j_l_vi_jt_l_j_kpr.setZero();
-
-        Eigen::SparseBlockProduct(
-              jt_pr_j_l_vi, jt_l_j_kpr_, jt_pr_j_l_vi_jt_l_j_kpr);
-        // This is a strided load operation, to match kPrPoseDim to kPoseDim
-        Eigen::LoadDenseFromSparse<decltype(jt_pr_j_l_vi_jt_l_j_kpr),
-            MatrixXt,
-            kPoseDim, kCalibDim>(
-              jt_pr_j_l_vi_jt_l_j_kpr, djt_pr_j_l_vi_jt_l_j_kpr);
-
-        s_.template block(0, num_pose_params, num_pose_params, kCalibDim) -=
-            djt_pr_j_l_vi_jt_l_j_kpr;
-        if (!options_.use_triangular_matrices) {
-          s_.template block(num_pose_params, 0, kCalibDim, num_pose_params) -=
-              djt_pr_j_l_vi_jt_l_j_kpr.transpose();
-        }
-
-        BlockMat<Eigen::Matrix<Scalar, kCalibDim, kLmDim>>
-            jt_kpr_j_l_vi(1, num_lm);
-        Eigen::SparseBlockProduct(jt_kpr_jl, vi_, jt_kpr_j_l_vi);
-
-        BlockMat<Eigen::Matrix<Scalar, kCalibDim, kCalibDim>>
-            jt_kpr_j_l_vi_jt_l_j_kpr(1, 1);
-        Eigen::SparseBlockProduct(
-              jt_kpr_j_l_vi,
-              jt_l_j_kpr_,
-              jt_kpr_j_l_vi_jt_l_j_kpr);
-
-        MatrixXt djt_kpr_j_l_vi_jt_l_j_kpr(kCalibDim, kCalibDim);
-        Eigen::LoadDenseFromSparse(
-              jt_kpr_j_l_vi_jt_l_j_kpr,
-              djt_kpr_j_l_vi_jt_l_j_kpr);
-
-        s_.template block<kCalibDim, kCalibDim>(num_pose_params, num_pose_params)
-            -= djt_kpr_j_l_vi_jt_l_j_kpr;
-
-        VectorXt jt_kpr_j_l_vi_bl;
-        jt_kpr_j_l_vi_bl.resize(kCalibDim);
-        Eigen::SparseBlockVectorProductDenseResult(
-              jt_kpr_j_l_vi, rhs_l_, jt_kpr_j_l_vi_bl);
+        // Direct assembly forms jt_l_j_kpr_ in AssembleHessian.
+        if (!direct_assembly) {
+          BlockMat< Eigen::Matrix<Scalar, kCalibDim, kLmDim>>
+              jt_kpr_jl(1, num_lm);
+          jt_l_j_kpr_.resize(num_lm, 1);
+          Eigen::SparseBlockProduct(jt_kpr_, j_l_, jt_kpr_jl);
+          decltype(jt_l_j_kpr_)::forceTranspose(jt_kpr_jl, jt_l_j_kpr_);
+        }
 
-        rhs_p_sc.template tail<kCalibDim>() -= jt_kpr_j_l_vi_bl;
+        StartTimer(_schur_complement_calibration_);
+        EliminateLandmarksFromCalibration(rhs_p_sc);
+        PrintTimer(_schur_complement_calibration_);
       }
 
 
-      // regularize masked parameters.
-      if (is_param_mask_used_) {
+      // regularize masked parameters. This is done implicitly by the
+      // conjugate gradient solver.
+      if (is_param_mask_used_ && !options_.use_pcg_solver) {
         for (Pose& pose : poses_) {
           if (pose.is_active && pose.is_param_mask_used) {
             for (uint32_t ii = 0 ; ii < pose.param_mask.size() ; ++ii) {
               if (!pose.param_mask[ii]) {
-                const int idx = pose.opt_id*kPoseDim + ii;
-                s_(idx, idx) = 1e6;
+                // Inserting a missing diagonal block changes the pattern.
+                if (!s_pp_.hasCoeff(pose.opt_id, pose.opt_id)) {
+                  is_s_pp_pattern_current_ = false;
+                }
+                s_pp_.coeffRef(pose.opt_id, pose.opt_id)(ii, ii) = 1e6;
               }
             }
           }
         }
       }
 
-      if (options_.write_reduced_camera_matrix) {
-        std::cerr << "Writing reduced camera matrix for " << num_pose_params <<
-                     " pose parameters and " << kCalibDim << " calib "
-                                                             " parameters " << std::endl;
-        std::ofstream("s.txt", std::ios_base::trunc) << s_.format(kLongCsvFmt);
-        std::ofstream("rhs.txt", std::ios_base::trunc) << rhs_p_sc.format(kLongCsvFmt);
-
-        MatrixXt dj_pr(j_pr_.rows() * ProjectionResidual::kResSize,
-                       j_pr_.cols() * kPrPoseDim);
-        Eigen::LoadDenseFromSparse(j_pr_, dj_pr);
-        std::ofstream("j_pr.txt", std::ios_base::trunc) << dj_pr.format(kLongCsvFmt);
+      // The block sparse solver is damped in place on the diagonal blocks of
+      // s_pp_, so (as LoadSparseUpperFromSparseBlock does for the scalar
+      // solver) the pattern must hold every diagonal block, even a zero one.
+      if (options_.use_sparse_solver && options_.use_block_sparse_solver &&
+          !options_.use_pcg_solver) {
+        bool is_inserted = false;
+        for (uint32_t ii = 0; ii < num_poses; ++ii) {
+          if (!s_pp_.hasCoeff(ii, ii)) {
+            s_pp_.coeffRef(ii, ii).setZero();
+            is_inserted = true;
+          }
+        }
+        if (is_inserted) {
+          s_pp_.makeCompressed();
+          is_s_pp_pattern_current_ = false;
+        }
+      }
 
-        std::ofstream("r_pr.txt", std::ios_base::trunc) << r_pr_.format(kLongCsvFmt);
+      // Load the reduced camera matrix into the representation used by the
+      // solver. The sparse solver never goes through a dense matrix.
+      StartTimer(_load_reduced_camera_matrix_);
+      const bool write_dense_s = options_.write_reduced_camera_matrix &&
+          options_.reduced_camera_matrix_format == ExportCsv;
+      if (!options_.use_pcg_solver && (!options_.use_sparse_solver ||
+                                       write_dense_s)) {
+        s_.resize(num_pose_params + kCalibDim, num_pose_params + kCalibDim);
+        Eigen::LoadDenseFromSparse(
+              s_pp_, s_.topLeftCorner(num_pose_params, num_pose_params));
+        s_.topRightCorner(num_pose_params, kCalibDim) = s_pk_;
+        if (options_.use_triangular_matrices) {
+          s_.bottomLeftCorner(kCalibDim, num_pose_params).setZero();
+        } else {
+          s_.bottomLeftCorner(kCalibDim, num_pose_params) = s_pk_.transpose();
+        }
+        s_.bottomRightCorner(kCalibDim, kCalibDim) = s_kk_;
+      }
+      PrintTimer(_load_reduced_camera_matrix_);
 
-        MatrixXt dj_l(j_l_.rows() * ProjectionResidual::kResSize,
-                      j_l_.cols() * kLmDim);
-        Eigen::LoadDenseFromSparse(j_l_, dj_l);
-        std::ofstream("j_l.txt", std::ios_base::trunc) << dj_l.format(kLongCsvFmt);
+      // The reduced camera matrix is written in opt_id order, as the
+      // jacobians, so before the poses are ordered for the sparse solvers.
+      if (options_.write_reduced_camera_matrix && !options_.use_pcg_solver) {
+        WriteReducedCameraMatrix(rhs_p_sc, kk);
+      }
 
-        MatrixXt dj_kpr(j_kpr_.rows() * ProjectionResidual::kResSize,
-                        j_kpr_.cols() * kCalibDim);
-        Eigen::LoadDenseFromSparse(j_kpr_, dj_kpr);
-        std::ofstream("j_kpr.txt", std::ios_base::trunc) << dj_kpr.format(kLongCsvFmt);
+      if (IsPoseOrderingUsed()) {
+        StartTimer(_pose_ordering_);
+        PermuteReducedCameraMatrix(rhs_p_sc);
+        PrintTimer(_pose_ordering_);
+      }
 
-        MatrixXt djt_kpr = dj_kpr.transpose();
-        MatrixXt djt_kpr_dj_kpr = (djt_kpr * dj_kpr).eval();
-        std::ofstream("jt_kpr_j_kpr.txt", std::ios_base::trunc) << djt_kpr_dj_kpr.format(kLongCsvFmt);
+      // The block sparse solver works on s_pp_ directly.
+      if (options_.use_sparse_solver && !options_.use_block_sparse_solver &&
+          !options_.use_pcg_solver) {
+        StartTimer(_load_sparse_reduced_camera_matrix_);
+        Eigen::LoadSparseUpperFromSparseBlock(s_pp_, s_pk_, s_kk_, s_sparse_);
+        PrintTimer(_load_sparse_reduced_camera_matrix_);
       }
 
       PrintTimer(_steup_problem_);
 
       // now we have to solve for the pose constraints
       StartTimer(_solve_);
-      // Precompute the sparse s matrix if necessary.
-      if (options_.use_sparse_solver) {
-        s_sparse_ = s_.sparseView();
-      }
-
       // std::cout << "running solve internal with " << use_dogleg << std::endl;
-      if (!SolveInternal(rhs_p_sc, gn_damping, error_increase_allowed,
-                         options_.use_dogleg)) {
+      // The undamped diagonal belongs to the previous linearization.
+      s_diagonal_.resize(0);
+      const bool solved = options_.use_levenberg_marquardt ?
+            SolveLevenbergMarquardt(rhs_p_sc) :
+            SolveInternal(rhs_p_sc, gn_damping, error_increase_allowed,
+                          options_.use_dogleg);
+      if (!solved) {
         StreamMessage(debug_level) << "Exiting due to error increase." <<
                                       std::endl;
         break;
@@ -690,148 +1037,1037 @@ namespace ba {
       summary_.cond_inertial_error += res.mahalanobis_distance;
     }
 
-    /*for (const ImuResidual& res : inertial_residuals_) {
-    std::cerr << "Mahalanobis dist. for residual " << res.residual_id <<
-                 " : " << res.mahalanobis_distance << std::endl;
-  }*/
+    /*for (const ImuResidual& res : inertial_residuals_) {
+    std::cerr << "Mahalanobis dist. for residual " << res.residual_id <<
+                 " : " << res.mahalanobis_distance << std::endl;
+  }*/
+
+    summary_.num_cond_proj_residuals = conditioning_proj_residuals_.size();
+    summary_.num_proj_residuals = proj_residuals_.size();
+    summary_.proj_error_ = proj_error_;
+    for (uint32_t id : conditioning_proj_residuals_) {
+      const ProjectionResidual& res = proj_residuals_[id];
+      summary_.cond_proj_error += res.mahalanobis_distance / res.weight;
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::GetLandmarkDelta(
+      const Delta& delta,  const uint32_t num_poses, const uint32_t num_lm,
+      VectorXt& delta_l)
+  {
+    StartTimer(_back_substitution_);
+    if (num_lm > 0) {
+      // Only reallocates if the number of landmarks changed.
+      delta_l.resize(num_lm*kLmDim);
+      // Each landmark update only depends on its own blocks of vi_,
+      // jt_pr_j_l_ (its column) and jt_l_j_kpr_, so the landmarks are solved
+      // independently and written straight into delta_l. vi_ holds the
+      // landmark blocks on its diagonal, in order.
+      const bool has_poses = num_poses > 0;
+      tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_lm),
+                        [&](const tbb::blocked_range<uint32_t>& r) {
+        for (uint32_t ii = r.begin(); ii != r.end(); ++ii) {
+          if (kLmDim == 1) {
+            // Inverse depth: the pose and calibration terms are dot
+            // products and vi_ holds scalars.
+            Scalar rhs = rhs_l_[ii];
+            if (has_poses) {
+              for (typename decltype(jt_pr_j_l_)::InnerIterator
+                   it(jt_pr_j_l_, ii); it; ++it) {
+                rhs -= it.value().col(0).dot(
+                      delta.delta_p.template segment<kPrPoseDim>(
+                        it.index() * kPoseDim));
+              }
+              if (kJkprUsed) {
+                const auto* jt_l_j_kpr =
+                    Eigen::SparseBlockFind(jt_l_j_kpr_, 0, ii);
+                if (jt_l_j_kpr != nullptr) {
+                  rhs -= jt_l_j_kpr->row(0).dot(delta.delta_k);
+                }
+              }
+            }
+            delta_l[ii] = vi_.valuePtr()[ii](0, 0) * rhs;
+            continue;
+          }
+
+          Eigen::Matrix<Scalar, kLmDim, 1> rhs =
+              rhs_l_.template segment<kLmDim>(ii * kLmDim);
+          if (has_poses) {
+            // delta_p has all pose parameters, the coupling only the 6
+            // pose parameters.
+            for (typename decltype(jt_pr_j_l_)::InnerIterator
+                 it(jt_pr_j_l_, ii); it; ++it) {
+              rhs.noalias() -= it.value().transpose() *
+                  delta.delta_p.template segment<kPrPoseDim>(
+                    it.index() * kPoseDim);
+            }
+            if (kJkprUsed) {
+              const auto* jt_l_j_kpr =
+                  Eigen::SparseBlockFind(jt_l_j_kpr_, 0, ii);
+              if (jt_l_j_kpr != nullptr) {
+                rhs.noalias() -= *jt_l_j_kpr * delta.delta_k;
+              }
+            }
+          }
+          delta_l.template segment<kLmDim>(ii * kLmDim).noalias() =
+              vi_.valuePtr()[ii] * rhs;
+        }
+      });
+    }
+    PrintTimer(_back_substitution_);
+
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  bool BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  IsSparsePatternAnalyzed() const
+  {
+    if (!is_sparse_pattern_analyzed_) {
+      return false;
+    }
+
+    const int num_outer = s_sparse_.outerSize() + 1;
+    const int num_nonzeros = s_sparse_.nonZeros();
+    if (!s_sparse_.isCompressed() ||
+        s_sparse_outer_index_.size() != (size_t)num_outer ||
+        s_sparse_inner_index_.size() != (size_t)num_nonzeros) {
+      return false;
+    }
+
+    return std::equal(s_sparse_outer_index_.begin(),
+                      s_sparse_outer_index_.end(),
+                      s_sparse_.outerIndexPtr()) &&
+        std::equal(s_sparse_inner_index_.begin(),
+                   s_sparse_inner_index_.end(),
+                   s_sparse_.innerIndexPtr());
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  AnalyzeSparsePattern()
+  {
+    StreamMessage(debug_level) << "Reduced camera matrix sparsity changed, "
+                                  "redoing symbolic analysis." << std::endl;
+    s_sparse_.makeCompressed();
+
+    const int num_outer = s_sparse_.outerSize() + 1;
+    const int num_nonzeros = s_sparse_.nonZeros();
+    s_sparse_outer_index_.assign(s_sparse_.outerIndexPtr(),
+                                 s_sparse_.outerIndexPtr() + num_outer);
+    s_sparse_inner_index_.assign(s_sparse_.innerIndexPtr(),
+                                 s_sparse_.innerIndexPtr() + num_nonzeros);
+    is_sparse_pattern_analyzed_ = true;
+    is_sparse_solver_analyzed_ = false;
+    is_sparse_solver_f_analyzed_ = false;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  template<typename SolverF>
+  bool BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  SolveMixedPrecision(const SolverF& solver_f, const VectorXt& b, VectorXt& x)
+  {
+    x = VectorXt::Zero(b.rows());
+    const Scalar b_norm = b.norm();
+    if (b_norm == 0) {
+      summary_.refinement_iterations = 0;
+      return true;
+    }
+
+    VectorXt r = b;
+    Scalar r_norm = b_norm;
+    for (uint32_t ii = 0;
+         ii <= options_.mixed_precision_max_refinement_iterations; ++ii) {
+      // The residual is normalized before it is converted to single
+      // precision, to keep it within range.
+      const Eigen::VectorXf r_f = (r / r_norm).template cast<float>();
+      x += solver_f.solve(r_f).template cast<Scalar>() * r_norm;
+      r = b - s_sparse_.template selfadjointView<Eigen::Upper>() * x;
+      const Scalar new_r_norm = r.norm();
+      if (!std::isfinite(new_r_norm) || new_r_norm >= r_norm) {
+        StreamMessage(debug_level) << "Iterative refinement diverged after " <<
+                                      ii << " steps." << std::endl;
+        return false;
+      }
+      r_norm = new_r_norm;
+      if (r_norm <= options_.mixed_precision_tolerance * b_norm) {
+        summary_.refinement_iterations = ii;
+        return true;
+      }
+    }
+    StreamMessage(debug_level) << "Iterative refinement did not converge, "
+                                  "relative residual " << r_norm / b_norm <<
+                                  std::endl;
+    return false;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  template<typename SolverF>
+  bool BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  CalculateGnMixedPrecision(SolverF& solver_f, const VectorXt& rhs_p,
+                            Delta& delta)
+  {
+    // Nothing to gain if the adjuster is already single precision.
+    if (std::is_same<Scalar, float>::value) {
+      return false;
+    }
+
+    StartTimer(_symbolic_analysis_);
+    if (!IsSparsePatternAnalyzed()) {
+      AnalyzeSparsePattern();
+    }
+    s_sparse_f_ = s_sparse_.template cast<float>();
+    if (!is_sparse_solver_f_analyzed_) {
+      solver_f.analyzePattern(s_sparse_f_);
+      is_sparse_solver_f_analyzed_ = true;
+    }
+    PrintTimer(_symbolic_analysis_);
+
+    StartTimer(_numeric_factorization_);
+    solver_f.factorize(s_sparse_f_);
+    PrintTimer(_numeric_factorization_);
+    if (solver_f.info() != Eigen::Success) {
+      StreamMessage(debug_level) << "Single precision factorization failed, "
+                                    "falling back to double precision." <<
+                                    std::endl;
+      return false;
+    }
+    summary_.reduced_system_nonzeros = s_sparse_.nonZeros();
+    summary_.factor_nonzeros =
+        solver_f.matrixL().nestedExpression().nonZeros() +
+        s_sparse_.rows();
+
+    if (rhs_p.rows() == 0) {
+      delta.delta_p = VectorXt();
+      delta.delta_k = VectorXt();
+      return true;
+    }
+
+    VectorXt delta_p_k;
+    if (!SolveMixedPrecision(solver_f, rhs_p, delta_p_k)) {
+      StreamMessage(debug_level) << "Falling back to double precision." <<
+                                    std::endl;
+      return false;
+    }
+    const uint32_t num_pose_params = delta_p_k.rows() - kCalibDim;
+    delta.delta_p = delta_p_k.head(num_pose_params);
+    if (kCalibDim) {
+      delta.delta_k = delta_p_k.tail(kCalibDim);
+
+      if (options_.calculate_calibration_marginals) {
+        MatrixXt cov(kCalibDim, kCalibDim);
+        for (uint32_t ii = 0; ii < kCalibDim ; ++ii) {
+          VectorXt res;
+          if (!SolveMixedPrecision(
+                solver_f, VectorXt::Unit(rhs_p.rows(), num_pose_params + ii),
+                res)) {
+            return false;
+          }
+          cov.col(ii) = res.tail(kCalibDim);
+        }
+        summary_.calibration_marginals = cov;
+      }
+    }
+    return true;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  template<typename Solver>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  CalculateGnSparse(Solver& solver, const VectorXt& rhs_p, Delta& delta)
+  {
+    // The ordering and symbolic analysis only depend on the sparsity of
+    // s_sparse_, which rarely changes between iterations or solves.
+    StartTimer(_symbolic_analysis_);
+    if (!IsSparsePatternAnalyzed()) {
+      AnalyzeSparsePattern();
+    }
+    if (!is_sparse_solver_analyzed_) {
+      solver.analyzePattern(s_sparse_);
+      is_sparse_solver_analyzed_ = true;
+    }
+    PrintTimer(_symbolic_analysis_);
+
+    StartTimer(_numeric_factorization_);
+    solver.factorize(s_sparse_);
+    PrintTimer(_numeric_factorization_);
+    summary_.reduced_system_nonzeros = s_sparse_.nonZeros();
+    summary_.factor_nonzeros =
+        solver.matrixL().nestedExpression().nonZeros() + s_sparse_.rows();
+    if (solver.info() != Eigen::Success) {
+      std::cerr << "SimplicialLDLT FAILED!" << std::endl;
+      summary_.result = FactorizationError;
+    }
+    if (rhs_p.rows() != 0) {
+      VectorXt delta_p_k = solver.solve(rhs_p);
+      if (solver.info() != Eigen::Success) {
+        std::cerr << "SimplicialLDLT SOLVE FAILED!" << std::endl;
+        summary_.result = SolverError;
+      }
+      const uint32_t num_pose_params = delta_p_k.rows() - kCalibDim;
+      delta.delta_p = delta_p_k.head(num_pose_params);
+      if (kCalibDim) {
+        delta.delta_k = delta_p_k.tail(kCalibDim);
+
+        if (options_.calculate_calibration_marginals) {
+          // Only the columns of the selected inverse from the first
+          // calibration parameter in the factor on are needed, which are
+          // the trailing ones if the solver kept the order of s_sparse_.
+          SetSelectedInversePermutation(solver);
+          int first_col = SelectedInversePosition(num_pose_params);
+          for (uint32_t ii = 1; ii < kCalibDim ; ++ii) {
+            first_col = std::min(
+                  first_col, SelectedInversePosition(num_pose_params + ii));
+          }
+          selected_inverse_.compute(solver.matrixL().nestedExpression(),
+                                    solver.vectorD(), first_col);
+          MatrixXt cov(kCalibDim, kCalibDim);
+          for (uint32_t ii = 0; ii < kCalibDim ; ++ii) {
+            for (uint32_t jj = 0; jj < kCalibDim ; ++jj) {
+              selected_inverse_.coeff(
+                    SelectedInversePosition(num_pose_params + ii),
+                    SelectedInversePosition(num_pose_params + jj),
+                    cov(ii, jj));
+            }
+          }
+          summary_.calibration_marginals = cov;
+        }
+      }
+    } else {
+      delta.delta_p = VectorXt();
+      delta.delta_k = VectorXt();
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::CalculateGn(
+      const VectorXt& rhs_p, Delta& delta)
+  {
+    summary_.result = Success;
+    is_selected_inverse_valid_ = false;
+    is_sparse_solver_f_used_ = false;
+    if (options_.use_levenberg_marquardt) {
+      DampReducedCameraMatrix();
+    }
+    if (options_.use_pcg_solver) {
+      CalculateGnPcg(rhs_p, delta);
+    } else if (options_.use_sparse_solver && options_.use_block_sparse_solver) {
+      CalculateGnBlockSparse(rhs_p, delta);
+    } else if (options_.use_sparse_solver &&
+               options_.use_mixed_precision_solver &&
+               (IsPoseOrderingUsed() ?
+                CalculateGnMixedPrecision(ordered_sparse_solver_f_, rhs_p,
+                                          delta) :
+                CalculateGnMixedPrecision(sparse_solver_f_, rhs_p, delta))) {
+      // Solved in single precision, refined to double precision accuracy.
+      is_sparse_solver_f_used_ = true;
+    } else if (options_.use_sparse_solver) {
+      if (IsPoseOrderingUsed()) {
+        CalculateGnSparse(ordered_sparse_solver_, rhs_p, delta);
+      } else {
+        CalculateGnSparse(sparse_solver_, rhs_p, delta);
+      }
+    } else if (options_.use_blocked_dense_solver) {
+      StartTimer(_numeric_factorization_);
+      dense_solver_.compute(s_);
+      PrintTimer(_numeric_factorization_);
+      if (dense_solver_.info() != Eigen::Success) {
+        std::cerr << "DenseBlockLLT FAILED!" << std::endl;
+        summary_.result = FactorizationError;
+      }
+      if (rhs_p.rows() != 0) {
+        const VectorXt delta_p_k = dense_solver_.solve(rhs_p);
+        const uint32_t num_pose_params = delta_p_k.rows() - kCalibDim;
+        delta.delta_p = delta_p_k.head(num_pose_params);
+        if (kCalibDim) {
+          delta.delta_k = delta_p_k.tail(kCalibDim);
+
+          if (options_.calculate_calibration_marginals) {
+            MatrixXt cov = MatrixXt::Zero(delta_p_k.rows(), kCalibDim);
+            cov.bottomRows(kCalibDim).setIdentity();
+            dense_solver_.solveInPlace(cov);
+            summary_.calibration_marginals = cov.bottomRows(kCalibDim);
+          }
+        }
+      } else {
+        delta.delta_p = VectorXt();
+        delta.delta_k = VectorXt();
+      }
+    } else {
+      Eigen::LDLT<Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>,
+          Eigen::Upper> solver;
+      solver.compute(s_);
+      if (solver.info() != Eigen::Success) {
+        std::cerr << "LDLT FAILED!" << std::endl;
+      }
+      if (rhs_p.rows() != 0) {
+        const VectorXt delta_p_k = solver.solve(rhs_p);
+        if (solver.info() != Eigen::Success) {
+          std::cerr << "LDLT SOLVE FAILED!" << std::endl;
+        }
+        const uint32_t num_pose_params = delta_p_k.rows() - kCalibDim;
+        delta.delta_p = delta_p_k.head(num_pose_params);
+        if (kCalibDim) {
+          delta.delta_k = delta_p_k.tail(kCalibDim);
+
+          if (options_.calculate_calibration_marginals) {
+            MatrixXt cov(delta_p_k.rows(), kCalibDim);
+            for (uint32_t ii = 0; ii < kCalibDim ; ++ii) {
+              VectorXt res = solver.solve(
+                    VectorXt::Unit(rhs_p.rows(), num_pose_params + ii));
+              if (solver.info() != Eigen::Success) {
+                std::cerr << "LDLT SOLVE FAILED!" << std::endl;
+              }
+              cov.col(ii) = res;
+            }
+            summary_.calibration_marginals =
+                cov.template bottomRightCorner<kCalibDim, kCalibDim>();
+          }
+        }
+      } else {
+        delta.delta_p = VectorXt();
+        delta.delta_k = VectorXt();
+      }
+    }
+
+    // Bring the pose updates back to opt_id order.
+    if (IsPoseOrderingUsed() && delta.delta_p.rows() != 0) {
+      const VectorXt delta_p = delta.delta_p;
+      for (uint32_t ii = 0; ii < pose_perm_.size(); ++ii) {
+        delta.delta_p.template segment<kPoseDim>(ii * kPoseDim) =
+            delta_p.template segment<kPoseDim>(pose_perm_[ii] * kPoseDim);
+      }
+    }
+
+    // Do rank revealing QR
+    // Eigen::FullPivHouseholderQR<Eigen::Matrix<Scalar,
+    //                                          Eigen::Dynamic, Eigen::Dynamic>> qr;
+    // qr.compute(s_);
+    // std::cout << "S dim: " << s_.rows() << " rank: " << qr.rank() << std::endl;
+  }
+
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  bool BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  ComputeSelectedInverse()
+  {
+    if (is_selected_inverse_valid_) {
+      return true;
+    }
+    if (options_.use_pcg_solver) {
+      StreamMessage(debug_level) << "Covariances are not available with the "
+                                    "conjugate gradient solver." << std::endl;
+      return false;
+    }
+
+    StartTimer(_selected_inverse_);
+    if (options_.use_sparse_solver && options_.use_block_sparse_solver) {
+      if (block_solver_.rows() == 0 ||
+          block_solver_.info() != Eigen::Success) {
+        return false;
+      }
+      block_solver_.computeSelectedInverse();
+    } else if (options_.use_sparse_solver) {
+      if (!(IsPoseOrderingUsed() ?
+            ComputeSparseSelectedInverse(ordered_sparse_solver_) :
+            ComputeSparseSelectedInverse(sparse_solver_))) {
+        return false;
+      }
+    } else {
+      if (s_.rows() == 0) {
+        return false;
+      }
+      // Problems solved densely are small, so keep the full inverse.
+      if (options_.use_blocked_dense_solver) {
+        if (dense_solver_.info() != Eigen::Success) {
+          return false;
+        }
+        s_inverse_ = MatrixXt::Identity(s_.rows(), s_.cols());
+        dense_solver_.solveInPlace(s_inverse_);
+      } else {
+        s_inverse_ = Eigen::LDLT<MatrixXt, Eigen::Upper>(s_).solve(
+              MatrixXt::Identity(s_.rows(), s_.cols()));
+      }
+    }
+    PrintTimer(_selected_inverse_);
+    is_selected_inverse_valid_ = true;
+    return true;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  template<typename Solver>
+  bool BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  ComputeSparseSelectedInverse(Solver& solver)
+  {
+    // The single precision factor of a mixed precision solve is only the
+    // preconditioner of the refinement, so the solved system is factorized
+    // in double precision for the covariances.
+    if (is_sparse_solver_f_used_) {
+      if (!is_sparse_solver_analyzed_) {
+        solver.analyzePattern(s_sparse_);
+        is_sparse_solver_analyzed_ = true;
+      }
+      solver.factorize(s_sparse_);
+      is_sparse_solver_f_used_ = false;
+    }
+    if (solver.rows() == 0 || solver.info() != Eigen::Success) {
+      return false;
+    }
+    SetSelectedInversePermutation(solver);
+    selected_inverse_.compute(solver.matrixL().nestedExpression(),
+                              solver.vectorD());
+    return true;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  template<typename Solver>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  SetSelectedInversePermutation(const Solver& solver)
+  {
+    // SimplicialLDLT factorizes P S P^T, so row ii of S is row P(ii) of the
+    // factor. P is empty if the solver keeps the order of S.
+    const auto& indices = solver.permutationP().indices();
+    selected_inverse_perm_.assign(indices.data(),
+                                  indices.data() + indices.size());
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  bool BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  GetReducedCovariance(const uint32_t row, const uint32_t col,
+                       const uint32_t rows, const uint32_t cols, MatrixXt& cov)
+  {
+    cov.resize(rows, cols);
+    if (options_.use_sparse_solver && options_.use_block_sparse_solver) {
+      // The calibration border is eliminated through its Schur complement C,
+      // so with X = s_pp^-1 s_pk the inverse is
+      // [s_pp^-1 + X C^-1 X^T, -X C^-1; -C^-1 X^T, C^-1].
+      const uint32_t num_pose_params = block_solver_.rows();
+      const MatrixXt c_inv = kCalibDim ? calib_schur_solver_.solve(
+            MatrixXt::Identity(kCalibDim, kCalibDim)) : MatrixXt();
+      if (row >= num_pose_params && col >= num_pose_params) {
+        cov = c_inv.block(row - num_pose_params, col - num_pose_params,
+                          rows, cols);
+        return true;
+      }
+      Eigen::Matrix<Scalar, kPoseDim, kPoseDim> block;
+      if (!block_solver_.selectedInverseBlock(row / kPoseDim, col / kPoseDim,
+                                              block)) {
+        return false;
+      }
+      cov = block;
+      if (kCalibDim) {
+        cov += s_pp_inv_s_pk_.middleRows(row, rows) * c_inv *
+            s_pp_inv_s_pk_.middleRows(col, cols).transpose();
+      }
+    } else if (options_.use_sparse_solver) {
+      for (uint32_t ii = 0; ii < rows; ++ii) {
+        for (uint32_t jj = 0; jj < cols; ++jj) {
+          if (!selected_inverse_.coeff(SelectedInversePosition(row + ii),
+                                       SelectedInversePosition(col + jj),
+                                       cov(ii, jj))) {
+            return false;
+          }
+        }
+      }
+    } else {
+      cov = s_inverse_.block(row, col, rows, cols);
+    }
+    return true;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  typename BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::MatrixXt
+  BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  GetPoseCovariance(const uint32_t id1, const uint32_t id2)
+  {
+    if (id1 >= poses_.size() || id2 >= poses_.size() ||
+        !poses_[id1].is_active || !poses_[id2].is_active ||
+        !ComputeSelectedInverse()) {
+      return MatrixXt();
+    }
+
+    // Position of the poses in the (possibly reordered) reduced system.
+    uint32_t pos1 = poses_[id1].opt_id;
+    uint32_t pos2 = poses_[id2].opt_id;
+    if (IsPoseOrderingUsed()) {
+      pos1 = pose_perm_[pos1];
+      pos2 = pose_perm_[pos2];
+    }
+
+    MatrixXt cov;
+    if (!GetReducedCovariance(pos1 * kPoseDim, pos2 * kPoseDim, kPoseDim,
+                              kPoseDim, cov)) {
+      StreamMessage(debug_level) << "Covariance of poses " << id1 << " and " <<
+                                    id2 << " is not in the pattern of the "
+                                    "factor." << std::endl;
+      return MatrixXt();
+    }
+    return cov;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  typename BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::MatrixXt
+  BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  GetCalibrationCovariance()
+  {
+    MatrixXt cov;
+    const uint32_t num_pose_params = num_active_poses_ * kPoseDim;
+    if (kCalibDim == 0 || !ComputeSelectedInverse() ||
+        !GetReducedCovariance(num_pose_params, num_pose_params, kCalibDim,
+                              kCalibDim, cov)) {
+      return MatrixXt();
+    }
+    return cov;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  bool BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  IsPoseOrderingUsed() const
+  {
+    return options_.use_sparse_solver && !options_.use_pcg_solver &&
+        options_.pose_ordering != OrderingNatural;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  PermuteReducedCameraMatrix(VectorXt& rhs_p_sc)
+  {
+    // The ordering only depends on the block pattern of s_pp_, so it is kept
+    // across iterations and solves until the pattern changes, as is the
+    // pattern of the permuted matrix.
+    if (!pose_ordering_pattern_.Matches(s_pp_)) {
+      // If poses were removed, or the opt_ids shifted (e.g. a sliding window
+      // re-initialized with Init), the pattern of the existing poses changes
+      // and the ordering is recomputed.
+      if (options_.use_incremental_factorization && !pose_perm_.empty() &&
+          pose_perm_.size() + 1 == pose_ordering_pattern_.outer.size() &&
+          pose_ordering_pattern_.IsExtendedBy(s_pp_)) {
+        // Only poses were appended: keep the ordering of the existing poses,
+        // and eliminate new poses last, so that most of the factor can be
+        // reused.
+        for (int ii = pose_perm_.size(); ii < s_pp_.outerSize(); ++ii) {
+          pose_perm_.push_back(ii);
+        }
+      } else if (options_.pose_ordering == OrderingNestedDissection) {
+        Eigen::SparseBlockNestedDissectionOrdering(s_pp_, pose_perm_);
+      } else {
+        Eigen::SparseBlockAmdOrdering(s_pp_, pose_perm_);
+      }
+      pose_ordering_pattern_.Assign(s_pp_);
+      s_pp_perm_source_.clear();
+      StreamMessage(debug_level) << "Computed pose ordering for " <<
+                                    pose_perm_.size() << " poses." << std::endl;
+    }
+
+    if (s_pp_perm_source_.empty() ||
+        s_pp_swap_.outerSize() != s_pp_.outerSize()) {
+      Eigen::SparseBlockPermuteSymmetricUpperPattern(
+            s_pp_, pose_perm_, s_pp_swap_, s_pp_perm_source_);
+    }
+    Eigen::SparseBlockPermuteSymmetricUpperValues(
+          s_pp_, s_pp_perm_source_, s_pp_swap_);
+    s_pp_.swap(s_pp_swap_);
+    is_s_pp_permuted_ = true;
+
+    const MatrixXt s_pk = s_pk_;
+    const VectorXt rhs_p = rhs_p_sc;
+    for (uint32_t ii = 0; ii < pose_perm_.size(); ++ii) {
+      s_pk_.template middleRows<kPoseDim>(pose_perm_[ii] * kPoseDim) =
+          s_pk.template middleRows<kPoseDim>(ii * kPoseDim);
+      rhs_p_sc.template segment<kPoseDim>(pose_perm_[ii] * kPoseDim) =
+          rhs_p.template segment<kPoseDim>(ii * kPoseDim);
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  CalculateGnBlockSparse(const VectorXt& rhs_p, Delta& delta)
+  {
+    // The symbolic analysis is kept as long as the pattern of s_pp_ does not
+    // change.
+    StartTimer(_symbolic_analysis_);
+    block_solver_.setPartialRefactorization(
+          options_.use_incremental_factorization,
+          options_.relinearization_threshold);
+    if (!is_sparse_pattern_analyzed_ || !block_solver_.hasSamePattern(s_pp_)) {
+      block_solver_.analyzePattern(s_pp_);
+      is_sparse_pattern_analyzed_ = true;
+    }
+    PrintTimer(_symbolic_analysis_);
+
+    StartTimer(_numeric_factorization_);
+    block_solver_.factorize(s_pp_);
+    PrintTimer(_numeric_factorization_);
+    summary_.reduced_system_nonzeros = block_solver_.nonZerosA();
+    summary_.factor_nonzeros = block_solver_.nonZerosL();
+    summary_.num_refactorized_supernodes =
+        block_solver_.numRefactorizedSupernodes();
+    summary_.num_supernodes = block_solver_.numSupernodes();
+    if (block_solver_.info() != Eigen::Success) {
+      std::cerr << "SparseBlockLLT FAILED!" << std::endl;
+      summary_.result = FactorizationError;
+      delta.delta_p = VectorXt::Zero(rhs_p.rows() - kCalibDim);
+      delta.delta_k = VectorXt::Zero(kCalibDim);
+      return;
+    }
+
+    if (rhs_p.rows() == 0) {
+      delta.delta_p = VectorXt();
+      delta.delta_k = VectorXt();
+      return;
+    }
 
-    summary_.num_cond_proj_residuals = conditioning_proj_residuals_.size();
-    summary_.num_proj_residuals = proj_residuals_.size();
-    summary_.proj_error_ = proj_error_;
-    for (uint32_t id : conditioning_proj_residuals_) {
-      const ProjectionResidual& res = proj_residuals_[id];
-      summary_.cond_proj_error += res.mahalanobis_distance / res.weight;
+    const uint32_t num_pose_params = rhs_p.rows() - kCalibDim;
+    delta.delta_p = SolveBlockSparse(rhs_p.head(num_pose_params));
+    if (kCalibDim) {
+      // Eliminate the poses from the calibration parameters:
+      // (s_kk - s_pk^T s_pp^-1 s_pk) dk = rhs_k - s_pk^T s_pp^-1 rhs_p
+      s_pp_inv_s_pk_ = SolveBlockSparse(s_pk_);
+      calib_schur_solver_.compute(s_kk_ - s_pk_.transpose() * s_pp_inv_s_pk_);
+      if (calib_schur_solver_.info() != Eigen::Success) {
+        std::cerr << "Calibration LDLT FAILED!" << std::endl;
+        summary_.result = SolverError;
+      }
+      delta.delta_k = calib_schur_solver_.solve(
+            rhs_p.tail(kCalibDim) - s_pk_.transpose() * delta.delta_p);
+      delta.delta_p -= s_pp_inv_s_pk_ * delta.delta_k;
+
+      // The calibration block of the inverse is the inverse of the Schur
+      // complement.
+      if (options_.calculate_calibration_marginals) {
+        summary_.calibration_marginals = calib_schur_solver_.solve(
+              MatrixXt::Identity(kCalibDim, kCalibDim));
+      }
     }
   }
 
   ////////////////////////////////////////////////////////////////////////////////
   template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
-  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::GetLandmarkDelta(
-      const Delta& delta,  const uint32_t num_poses, const uint32_t num_lm,
-      VectorXt& delta_l)
+  typename BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::MatrixXt
+  BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  SolveBlockSparse(const MatrixXt& b)
   {
-    StartTimer(_back_substitution_);
-    if (num_lm > 0) {
-      delta_l.resize(num_lm*kLmDim);
-      VectorXt rhs_l_sc =  rhs_l_;
-
-      if (num_poses > 0) {
-        VectorXt wt_delta_p_k;
-        wt_delta_p_k.resize(num_lm * kLmDim);
-        // this is the strided multiplication as delta_p has all pose parameters,
-        // however jt_l_j_pr_delta_p is only with respect to the 6 pose parameters
-        Eigen::SparseBlockVectorProductDenseResult(
-              jt_l_j_pr_, delta.delta_p, wt_delta_p_k, kPoseDim, -1);
+    MatrixXt x = block_solver_.solve(b);
+    if (!options_.use_incremental_factorization ||
+        options_.relinearization_threshold <= 0) {
+      return x;
+    }
 
-        rhs_l_sc.resize(num_lm*kLmDim);
-        rhs_l_sc -=  wt_delta_p_k;
+    // The factor may have been computed with blocks up to the
+    // relinearization threshold away from s_pp_, so refine against s_pp_.
+    const Scalar b_norm = b.norm();
+    MatrixXt r;
+    for (uint32_t ii = 0; ii < options_.incremental_max_refinement_iterations;
+         ++ii) {
+      Eigen::SparseBlockSymmetricUpperProductDenseResult(s_pp_, x, r);
+      r = b - r;
+      if (r.norm() <= options_.incremental_refinement_tolerance * b_norm) {
+        break;
+      }
+      x += block_solver_.solve(r);
+    }
+    return x;
+  }
 
-        if (kJkprUsed) {
-          Eigen::SparseBlockVectorProductDenseResult(
-                jt_l_j_kpr_, delta.delta_k, wt_delta_p_k);
-          rhs_l_sc -=  wt_delta_p_k;
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  ApplyReducedCameraMatrix(const VectorXt& x, VectorXt& y)
+  {
+    const uint32_t num_poses = num_active_poses_;
+    const uint32_t num_pose_params = num_poses * kPoseDim;
+    y.resize(x.rows());
+
+    // u_ x. Each pose gathers its column of u_ and, for triangular storage,
+    // the column of its transpose.
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_poses),
+                      [&](const tbb::blocked_range<uint32_t>& r) {
+      for (uint32_t ii = r.begin(); ii != r.end(); ++ii) {
+        Eigen::Matrix<Scalar, kPoseDim, 1> y_i;
+        y_i.setZero();
+        for (typename decltype(u_)::InnerIterator it(u_, ii); it; ++it) {
+          y_i.noalias() += it.value().transpose() *
+              x.template segment<kPoseDim>(it.index() * kPoseDim);
+        }
+        if (options_.use_triangular_matrices) {
+          for (typename decltype(u_)::InnerIterator it(u_transpose_, ii);
+               it; ++it) {
+            if (it.index() > ii) {
+              y_i.noalias() += it.value().transpose() *
+                  x.template segment<kPoseDim>(it.index() * kPoseDim);
+            }
+          }
         }
+        y.template segment<kPoseDim>(ii * kPoseDim) = y_i;
       }
+    });
 
-      for (size_t ii = 0 ; ii < num_lm ; ++ii) {
-        delta_l.template block<kLmDim,1>( ii*kLmDim, 0 ).noalias() =
-            vi_.coeff(ii, ii) *
-            rhs_l_sc.template block<kLmDim, 1>(ii * kLmDim, 0);
-      }
+    // - jt_pr_j_l_ vi_ jt_l_j_pr_ x
+    if (kLmDim > 0 && num_active_landmarks_ > 0 && num_poses > 0) {
+      const uint32_t num_lm = num_active_landmarks_;
+      pcg_lm_temp_.resize(num_lm * kLmDim);
+      tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_lm),
+                        [&](const tbb::blocked_range<uint32_t>& r) {
+        for (uint32_t ii = r.begin(); ii != r.end(); ++ii) {
+          Eigen::Matrix<Scalar, kLmDim, 1> t_l;
+          t_l.setZero();
+          for (typename decltype(jt_pr_j_l_)::InnerIterator
+               it(jt_pr_j_l_, ii); it; ++it) {
+            t_l.noalias() += it.value().transpose() *
+                x.template segment<kPrPoseDim>(it.index() * kPoseDim);
+          }
+          typename decltype(vi_)::InnerIterator vi_it(vi_, ii);
+          pcg_lm_temp_.template segment<kLmDim>(ii * kLmDim) =
+              vi_it.value() * t_l;
+        }
+      });
+
+      tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_poses),
+                        [&](const tbb::blocked_range<uint32_t>& r) {
+        for (uint32_t ii = r.begin(); ii != r.end(); ++ii) {
+          for (typename decltype(jt_l_j_pr_)::InnerIterator
+               it(jt_l_j_pr_, ii); it; ++it) {
+            y.template segment<kPrPoseDim>(ii * kPoseDim).noalias() -=
+                it.value().transpose() *
+                pcg_lm_temp_.template segment<kLmDim>(it.index() * kLmDim);
+          }
+        }
+      });
+    }
+
+    // Regularization of masked parameters.
+    if (pcg_mask_diagonal_.rows() == num_pose_params) {
+      y.head(num_pose_params) +=
+          pcg_mask_diagonal_.cwiseProduct(x.head(num_pose_params));
+    }
+
+    if (kCalibDim) {
+      y.head(num_pose_params).noalias() += s_pk_ * x.tail(kCalibDim);
+      y.tail(kCalibDim) = s_pk_.transpose() * x.head(num_pose_params) +
+          s_kk_ * x.tail(kCalibDim);
     }
-    PrintTimer(_back_substitution_);
 
+    if (options_.use_levenberg_marquardt && lm_damping_.rows() == x.rows()) {
+      y += lm_damping_.cwiseProduct(x);
+    }
   }
 
   ////////////////////////////////////////////////////////////////////////////////
   template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
-  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::CalculateGn(
-      const VectorXt& rhs_p, Delta& delta)
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  BuildPcgPreconditioner()
   {
-    summary_.result = Success;
-    if (options_.use_sparse_solver) {
-      Eigen::SimplicialLDLT<Eigen::SparseMatrix<Scalar>, Eigen::Upper>
-          solver;
-      solver.compute(s_sparse_);
-      if (solver.info() != Eigen::Success) {
-        std::cerr << "SimplicialLDLT FAILED!" << std::endl;
-        summary_.result = FactorizationError;
-      }
-      if (rhs_p.rows() != 0) {
-        VectorXt delta_p_k = solver.solve(rhs_p);
-        if (solver.info() != Eigen::Success) {
-          std::cerr << "SimplicialLDLT SOLVE FAILED!" << std::endl;
-          summary_.result = SolverError;
-        }
-        const uint32_t num_pose_params = delta_p_k.rows() - kCalibDim;
-        delta.delta_p = delta_p_k.head(num_pose_params);
-        if (kCalibDim) {
-          delta.delta_k = delta_p_k.tail(kCalibDim);
+    const uint32_t num_poses = num_active_poses_;
+    if (options_.use_triangular_matrices) {
+      decltype(u_)::forceTranspose(u_, u_transpose_);
+    }
 
-          if (options_.calculate_calibration_marginals) {
-            MatrixXt cov(delta_p_k.rows(), kCalibDim);
-            for (uint32_t ii = 0; ii < kCalibDim ; ++ii) {
-              VectorXt res = solver.solve(
-                    VectorXt::Unit(rhs_p.rows(), num_pose_params + ii));
-              if (solver.info() != Eigen::Success) {
-                std::cerr << " Cov calculation: SimplicialLDLT SOLVE FAILED!" <<
-                             std::endl;
-              }
-              cov.col(ii) = res;
+    // The diagonal blocks of the reduced camera matrix, i.e. the diagonal
+    // blocks of u_ minus the landmark contributions of each pose.
+    pcg_preconditioner_.resize(num_poses);
+    const bool has_landmarks = kLmDim > 0 && num_active_landmarks_ > 0;
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_poses),
+                      [&](const tbb::blocked_range<uint32_t>& r) {
+      for (uint32_t ii = r.begin(); ii != r.end(); ++ii) {
+        Eigen::Matrix<Scalar, kPoseDim, kPoseDim>& block =
+            pcg_preconditioner_[ii];
+        block.setZero();
+        for (typename decltype(u_)::InnerIterator it(u_, ii); it; ++it) {
+          if (it.index() == ii) {
+            block = it.value();
+            break;
+          }
+        }
+        if (has_landmarks) {
+          for (typename decltype(jt_l_j_pr_)::InnerIterator
+               it(jt_l_j_pr_, ii); it; ++it) {
+            typename decltype(vi_)::InnerIterator vi_it(vi_, it.index());
+            block.template topLeftCorner<kPrPoseDim, kPrPoseDim>() -=
+                it.value().transpose() * vi_it.value() * it.value();
+          }
+        }
+      }
+    });
+
+    // Masked parameters are regularized the same way as in s_pp_, by
+    // replacing their diagonal entry. The operator is corrected by the
+    // difference to the actual diagonal.
+    pcg_mask_diagonal_.resize(0);
+    if (is_param_mask_used_) {
+      pcg_mask_diagonal_ = VectorXt::Zero(num_poses * kPoseDim);
+      for (const Pose& pose : poses_) {
+        if (pose.is_active && pose.is_param_mask_used) {
+          for (uint32_t ii = 0 ; ii < pose.param_mask.size() ; ++ii) {
+            if (!pose.param_mask[ii]) {
+              Scalar& diag = pcg_preconditioner_[pose.opt_id](ii, ii);
+              pcg_mask_diagonal_[pose.opt_id * kPoseDim + ii] = 1e6 - diag;
+              diag = 1e6;
             }
-            summary_.calibration_marginals =
-                cov.template bottomRightCorner<kCalibDim, kCalibDim>();
           }
         }
-      } else {
-        delta.delta_p = VectorXt();
-        delta.delta_k = VectorXt();
       }
+    }
 
-    } else {
-      Eigen::LDLT<Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>,
-          Eigen::Upper> solver;
-      solver.compute(s_);
-      if (solver.info() != Eigen::Success) {
-        std::cerr << "LDLT FAILED!" << std::endl;
+    // The diagonal of the reduced camera matrix is only known here, so the
+    // Levenberg-Marquardt damping is captured and applied here as well.
+    if (options_.use_levenberg_marquardt) {
+      if (s_diagonal_.rows() == 0) {
+        s_diagonal_.resize(num_poses * kPoseDim + kCalibDim);
+        for (uint32_t ii = 0; ii < num_poses; ++ii) {
+          s_diagonal_.template segment<kPoseDim>(ii * kPoseDim) =
+              pcg_preconditioner_[ii].diagonal();
+        }
+        s_diagonal_.tail(kCalibDim) = s_kk_.diagonal();
       }
-      if (rhs_p.rows() != 0) {
-        const VectorXt delta_p_k = solver.solve(rhs_p);
-        if (solver.info() != Eigen::Success) {
-          std::cerr << "LDLT SOLVE FAILED!" << std::endl;
+      UpdateLmDamping();
+      for (uint32_t ii = 0; ii < num_poses; ++ii) {
+        pcg_preconditioner_[ii].diagonal() +=
+            lm_damping_.template segment<kPoseDim>(ii * kPoseDim);
+      }
+    }
+
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_poses),
+                      [&](const tbb::blocked_range<uint32_t>& r) {
+      for (uint32_t ii = r.begin(); ii != r.end(); ++ii) {
+        pcg_preconditioner_[ii] = pcg_preconditioner_[ii].ldlt().solve(
+              Eigen::Matrix<Scalar, kPoseDim, kPoseDim>::Identity());
+      }
+    });
+
+    if (kCalibDim) {
+      if (options_.use_levenberg_marquardt) {
+        MatrixXt s_kk_damped = s_kk_;
+        s_kk_damped.diagonal() += lm_damping_.tail(kCalibDim);
+        pcg_preconditioner_k_.compute(s_kk_damped);
+      } else {
+        pcg_preconditioner_k_.compute(s_kk_);
+      }
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  uint32_t BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  SolvePcg(const VectorXt& b, VectorXt& x)
+  {
+    const uint32_t num_poses = num_active_poses_;
+    auto precondition = [&](const VectorXt& r, VectorXt& z) {
+      z.resize(r.rows());
+      tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_poses),
+                        [&](const tbb::blocked_range<uint32_t>& range) {
+        for (uint32_t ii = range.begin(); ii != range.end(); ++ii) {
+          z.template segment<kPoseDim>(ii * kPoseDim).noalias() =
+              pcg_preconditioner_[ii] *
+              r.template segment<kPoseDim>(ii * kPoseDim);
         }
-        const uint32_t num_pose_params = delta_p_k.rows() - kCalibDim;
-        delta.delta_p = delta_p_k.head(num_pose_params);
-        if (kCalibDim) {
-          delta.delta_k = delta_p_k.tail(kCalibDim);
+      });
+      if (kCalibDim) {
+        z.tail(kCalibDim) = pcg_preconditioner_k_.solve(r.tail(kCalibDim));
+      }
+    };
 
-          if (options_.calculate_calibration_marginals) {
-            MatrixXt cov(delta_p_k.rows(), kCalibDim);
-            for (uint32_t ii = 0; ii < kCalibDim ; ++ii) {
-              VectorXt res = solver.solve(
-                    VectorXt::Unit(rhs_p.rows(), num_pose_params + ii));
-              if (solver.info() != Eigen::Success) {
-                std::cerr << "LDLT SOLVE FAILED!" << std::endl;
-              }
-              cov.col(ii) = res;
-            }
-            summary_.calibration_marginals =
-                cov.template bottomRightCorner<kCalibDim, kCalibDim>();
-          }
+    x = VectorXt::Zero(b.rows());
+    const Scalar b_norm = b.norm();
+    if (b_norm == 0) {
+      return 0;
+    }
+
+    // Inexact solve with the forcing term eta, which tightens as the
+    // gradient goes to zero.
+    const Scalar eta = std::max(options_.pcg_tolerance,
+                                std::min(options_.pcg_max_forcing,
+                                         (Scalar)sqrt(b_norm)));
+    VectorXt r = b;
+    VectorXt z, p, q;
+    precondition(r, z);
+    p = z;
+    Scalar rz = r.dot(z);
+    uint32_t iteration = 0;
+    while (iteration < options_.pcg_max_iterations) {
+      iteration++;
+      ApplyReducedCameraMatrix(p, q);
+      const Scalar pq = p.dot(q);
+      if (!(pq > 0)) {
+        StreamMessage(debug_level) << "PCG: non-positive curvature " << pq <<
+                                      " at iteration " << iteration <<
+                                      std::endl;
+        if (iteration == 1) {
+          summary_.result = SolverError;
         }
-      } else {
-        delta.delta_p = VectorXt();
-        delta.delta_k = VectorXt();
+        break;
       }
+      const Scalar alpha = rz / pq;
+      x += alpha * p;
+      r -= alpha * q;
+      if (r.norm() <= eta * b_norm) {
+        break;
+      }
+      precondition(r, z);
+      const Scalar rz_new = r.dot(z);
+      p = z + (rz_new / rz) * p;
+      rz = rz_new;
     }
 
-    // Do rank revealing QR
-    // Eigen::FullPivHouseholderQR<Eigen::Matrix<Scalar,
-    //                                          Eigen::Dynamic, Eigen::Dynamic>> qr;
-    // qr.compute(s_);
-    // std::cout << "S dim: " << s_.rows() << " rank: " << qr.rank() << std::endl;
+    StreamMessage(debug_level) << "PCG: " << iteration << " iterations, "
+                                  "relative residual " << r.norm() / b_norm <<
+                                  " (eta " << eta << ")" << std::endl;
+    return iteration;
   }
 
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  CalculateGnPcg(const VectorXt& rhs_p, Delta& delta)
+  {
+    if (rhs_p.rows() == 0) {
+      delta.delta_p = VectorXt();
+      delta.delta_k = VectorXt();
+      return;
+    }
+
+    StartTimer(_pcg_preconditioner_);
+    BuildPcgPreconditioner();
+    PrintTimer(_pcg_preconditioner_);
+
+    StartTimer(_pcg_solve_);
+    VectorXt delta_p_k;
+    summary_.pcg_iterations = SolvePcg(rhs_p, delta_p_k);
+    summary_.num_pcg_iterations += summary_.pcg_iterations;
+    PrintTimer(_pcg_solve_);
+
+    const uint32_t num_pose_params = delta_p_k.rows() - kCalibDim;
+    delta.delta_p = delta_p_k.head(num_pose_params);
+    if (kCalibDim) {
+      delta.delta_k = delta_p_k.tail(kCalibDim);
+
+      if (options_.calculate_calibration_marginals) {
+        MatrixXt cov(kCalibDim, kCalibDim);
+        for (uint32_t ii = 0; ii < kCalibDim ; ++ii) {
+          VectorXt res;
+          summary_.num_pcg_iterations += SolvePcg(
+                VectorXt::Unit(rhs_p.rows(), num_pose_params + ii), res);
+          cov.col(ii) = res.tail(kCalibDim);
+        }
+        summary_.calibration_marginals = cov;
+      }
+    }
+  }
 
   ////////////////////////////////////////////////////////////////////////////////
   template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
@@ -876,7 +2112,10 @@ namespace ba {
       StreamMessage(debug_level + 1) << "rhs_l_ norm: " << rhs_l_.squaredNorm() <<
                                         std::endl;
 
-      if (num_active_poses_ > 0) {
+      if (IsDirectAssemblyUsed()) {
+        MultiplyJacobians(j_p_rhs_p, j_kp_rhs_k, j_pp_rhs_p, j_u_rhs_p,
+                          j_i_rhs_p, j_l_rhs_l);
+      } else if (num_active_poses_ > 0) {
         if (proj_residuals_.size() > 0) {
           Eigen::SparseBlockVectorProductDenseResult(j_pr_, rhs_p_, j_p_rhs_p,
                                                      kPoseDim);
@@ -899,7 +2138,8 @@ namespace ba {
         }
       }
 
-      if (num_active_landmarks_ > 0 && proj_residuals_.size() > 0) {
+      if (!IsDirectAssemblyUsed() && num_active_landmarks_ > 0 &&
+          proj_residuals_.size() > 0) {
         Eigen::SparseBlockVectorProductDenseResult(j_l_, rhs_l_, j_l_rhs_l);
       }
 
@@ -930,6 +2170,16 @@ namespace ba {
       StreamMessage(debug_level + 1) << "sd norm : " << delta_sd_norm <<
                                         std::endl;
 
+      // The pre-update norm is carried over from the linearization of the
+      // accepted state. A rejected step restores the state, so it stays valid
+      // for every inner iteration.
+      Scalar pre_proj_error, pre_binary_error, pre_unary_error,
+          pre_inertial_error;
+      GetLinearizationErrors(&pre_proj_error, &pre_binary_error,
+                             &pre_unary_error, &pre_inertial_error);
+      summary_.pre_solve_norm = pre_proj_error + pre_inertial_error +
+          pre_binary_error + pre_unary_error;
+
       uint32_t iteration_count = 0;
       while (1) {
         iteration_count++;
@@ -1028,20 +2278,13 @@ namespace ba {
         }
         // decltype(rig_) rig_copy = rig_;
 
-
-        // We have to calculate the residuals here, as during the inner loop of
-        // dogleg, the residuals are constantly changing.
-        EvaluateResiduals(&proj_error, &binary_error,
-                          &unary_error, &inertial_error);
-        summary_.pre_solve_norm = proj_error + inertial_error + binary_error +
-            unary_error;
         if (options_.apply_results) {
           ApplyUpdate(delta_dl, false);
 
           StreamMessage(debug_level) << std::setprecision (15) <<
                                         "Pre-solve norm: " << summary_.pre_solve_norm << " with Epr:" <<
-                                        proj_error << " and Ei:" << inertial_error <<
-                                        " and Epp: " << binary_error << " and Eu " << unary_error <<
+                                        pre_proj_error << " and Ei:" << pre_inertial_error <<
+                                        " and Epp: " << pre_binary_error << " and Eu " << pre_unary_error <<
                                         std::endl;
         }
 
@@ -1110,10 +2353,9 @@ namespace ba {
       delta.delta_p *= gn_damping;
 
 
-      // We have to calculate the residuals here, as during the inner loop of
-      // dogleg, the residuals are constantly changing.
-      EvaluateResiduals(&proj_error, &binary_error,
-                        &unary_error, &inertial_error);
+      // The residuals were evaluated at this state by BuildProblem.
+      GetLinearizationErrors(&proj_error, &binary_error,
+                             &unary_error, &inertial_error);
       const Scalar prev_error = proj_error + inertial_error + binary_error +
           unary_error;
       if (options_.apply_results) {
@@ -1161,6 +2403,182 @@ namespace ba {
   }
 
 
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  UpdateLmDamping()
+  {
+    // Marquardt scaling, with the diagonal clamped so that parameters without
+    // curvature are still damped and huge entries do not freeze a parameter.
+    lm_damping_ = lm_lambda_ *
+        s_diagonal_.cwiseMax(Scalar(1e-6)).cwiseMin(Scalar(1e32));
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  DampReducedCameraMatrix()
+  {
+    // The conjugate gradient solver is damped in BuildPcgPreconditioner.
+    if (options_.use_pcg_solver) {
+      return;
+    }
+
+    // The diagonal is captured once per linearization. Afterwards, each new
+    // lambda overwrites the diagonal in place, so the sparsity pattern and
+    // the symbolic analysis of the solvers stay valid.
+    const bool capture = s_diagonal_.rows() == 0;
+    if (options_.use_sparse_solver && options_.use_block_sparse_solver) {
+      const uint32_t num_poses = s_pp_.outerSize();
+      if (capture) {
+        s_diagonal_.resize(num_poses * kPoseDim + kCalibDim);
+        for (uint32_t ii = 0; ii < num_poses; ++ii) {
+          s_diagonal_.template segment<kPoseDim>(ii * kPoseDim) =
+              s_pp_.coeff(ii, ii).diagonal();
+        }
+        s_diagonal_.tail(kCalibDim) = s_kk_.diagonal();
+      }
+      UpdateLmDamping();
+      for (uint32_t ii = 0; ii < num_poses; ++ii) {
+        for (typename decltype(s_pp_)::InnerIterator it(s_pp_, ii); it; ++it) {
+          if (it.index() == ii) {
+            it.valueRef().diagonal() =
+                s_diagonal_.template segment<kPoseDim>(ii * kPoseDim) +
+                lm_damping_.template segment<kPoseDim>(ii * kPoseDim);
+            break;
+          }
+        }
+      }
+      s_kk_.diagonal() = s_diagonal_.tail(kCalibDim) +
+          lm_damping_.tail(kCalibDim);
+    } else if (options_.use_sparse_solver) {
+      // s_sparse_ holds the upper triangle in compressed form, so the
+      // diagonal is the last entry of each column.
+      s_sparse_.makeCompressed();
+      const int num_cols = s_sparse_.cols();
+      const int* outer = s_sparse_.outerIndexPtr();
+      Scalar* values = s_sparse_.valuePtr();
+      if (capture) {
+        s_diagonal_.resize(num_cols);
+        for (int jj = 0; jj < num_cols; ++jj) {
+          s_diagonal_[jj] = values[outer[jj + 1] - 1];
+        }
+      }
+      UpdateLmDamping();
+      for (int jj = 0; jj < num_cols; ++jj) {
+        values[outer[jj + 1] - 1] = s_diagonal_[jj] + lm_damping_[jj];
+      }
+    } else {
+      if (capture) {
+        s_diagonal_ = s_.diagonal();
+      }
+      UpdateLmDamping();
+      s_.diagonal() = s_diagonal_ + lm_damping_;
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  bool BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  SolveLevenbergMarquardt(const VectorXt& rhs_p_sc)
+  {
+    // Only the reduced camera system is damped, the landmarks are then
+    // eliminated exactly for the damped pose update. This keeps the Schur
+    // complement of the current linearization valid for every lambda.
+    Scalar proj_error, binary_error, unary_error, inertial_error;
+    GetLinearizationErrors(&proj_error, &binary_error,
+                           &unary_error, &inertial_error);
+    summary_.pre_solve_norm = proj_error + inertial_error + binary_error +
+        unary_error;
+    StreamMessage(debug_level) << std::setprecision (15) <<
+                                  "Pre-solve norm: " << summary_.pre_solve_norm <<
+                                  " with Epr:" << proj_error << " and Ei:" <<
+                                  inertial_error << " and Epp: " <<
+                                  binary_error << " and Eu " << unary_error <<
+                                  std::endl;
+
+    for (uint32_t ii = 0; ii < options_.lm_max_inner_iterations; ++ii) {
+      summary_.lm_lambdas.push_back(lm_lambda_);
+
+      Delta delta;
+      if (num_active_poses_ > 0) {
+        CalculateGn(rhs_p_sc, delta);
+        if (!summary_.IsResultGood()) {
+          // A larger damping makes the system better conditioned.
+          StreamMessage(debug_level) << "Damped solve failed with lambda " <<
+                                        lm_lambda_ << std::endl;
+          summary_.num_lm_rejected_steps++;
+          lm_lambda_ = std::min(lm_lambda_ * options_.lm_lambda_increase,
+                                options_.lm_max_lambda);
+          continue;
+        }
+      }
+
+      // now back substitute the landmarks
+      GetLandmarkDelta(delta, num_active_poses_, num_active_landmarks_,
+                       delta.delta_l);
+
+      decltype(landmarks_) landmarks_copy = landmarks_;
+      decltype(poses_) poses_copy = poses_;
+      decltype(imu_) imu_copy = imu_;
+      Eigen::VectorXd params_backup;
+      if (rig_->NumCams() != 0) {
+        params_backup = rig_->cameras_[0]->GetParams();
+      }
+
+      if (options_.apply_results) {
+        ApplyUpdate(delta, false);
+      }
+
+      EvaluateResiduals(&proj_error, &binary_error,
+                        &unary_error, &inertial_error);
+      const Scalar post_error = proj_error + inertial_error + binary_error +
+          unary_error;
+
+      StreamMessage(debug_level) << std::setprecision (15) <<
+                                    "Post-solve norm: " << post_error <<
+                                    " with lambda " << lm_lambda_ <<
+                                    " update delta: " << summary_.delta_norm <<
+                                    std::endl;
+
+      if (post_error <= summary_.pre_solve_norm) {
+        summary_.post_solve_norm = post_error;
+        proj_error_ = proj_error;
+        unary_error_ = unary_error;
+        binary_error_ = binary_error;
+        inertial_error_ = inertial_error;
+        lm_lambda_ = std::max(lm_lambda_ * options_.lm_lambda_decrease,
+                              options_.lm_min_lambda);
+        return true;
+      }
+
+      if (options_.apply_results) {
+        landmarks_ = landmarks_copy;
+        poses_ = poses_copy;
+        imu_ = imu_copy;
+        if (rig_->NumCams() != 0) {
+          rig_->cameras_[0]->SetParams(params_backup);
+        }
+      }
+      summary_.num_lm_rejected_steps++;
+      if (lm_lambda_ >= options_.lm_max_lambda) {
+        break;
+      }
+      lm_lambda_ = std::min(lm_lambda_ * options_.lm_lambda_increase,
+                            options_.lm_max_lambda);
+      StreamMessage(debug_level) << "Error increased, increasing lambda to " <<
+                                    lm_lambda_ << std::endl;
+    }
+
+    StreamMessage(debug_level) << "No Levenberg-Marquardt step decreased the "
+                                  "error." << std::endl;
+    summary_.post_solve_norm = summary_.pre_solve_norm;
+    if (summary_.IsResultGood()) {
+      summary_.result = ErrorIncreased;
+    }
+    return false;
+  }
+
   ////////////////////////////////////////////////////////////////////////////////
   template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
   void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::BuildProblem()
@@ -1172,19 +2590,27 @@ namespace ba {
     const uint32_t num_bin_res = binary_residuals_.size();
     const uint32_t num_un_res = unary_residuals_.size();
     const uint32_t num_im_res= inertial_residuals_.size();
+    // With direct assembly only the residual vectors are needed.
+    const bool direct_assembly = IsDirectAssemblyUsed();
+    // With fused linearization the projection jacobians are evaluated (and
+    // masked) per landmark track in AssembleHessian.
+    const bool fused = IsFusedLinearizationUsed();
 
     if (num_proj_res > 0) {
+      r_pr_.resize(num_proj_res*ProjectionResidual::kResSize);
+      r_pr_.setZero();
+    }
+
+    if (num_proj_res > 0 && !direct_assembly) {
       j_pr_.resize(num_proj_res, num_poses);
       jt_pr.resize(num_poses, num_proj_res);
       j_l_.resize(num_proj_res, num_lm);
       // jt_l_.resize(num_lm, num_proj_res);
-      r_pr_.resize(num_proj_res*ProjectionResidual::kResSize);
 
       // these calls remove all the blocks, but KEEP allocated memory as long as
       // the object is alive
       j_pr_.setZero();
       jt_pr.setZero();
-      r_pr_.setZero();
       j_l_.setZero();
 
       if (kJkprUsed) {
@@ -1196,35 +2622,38 @@ namespace ba {
     }
 
     if (num_bin_res > 0) {
-      j_pp_.resize(num_bin_res, num_poses);
-      jt_pp_.resize(num_poses, num_bin_res);
       r_pp_.resize(num_bin_res*BinaryResidual::kResSize);
-
-      j_pp_.setZero();
-      jt_pp_.setZero();
       r_pp_.setZero();
+      if (!direct_assembly) {
+        j_pp_.resize(num_bin_res, num_poses);
+        jt_pp_.resize(num_poses, num_bin_res);
+        j_pp_.setZero();
+        jt_pp_.setZero();
+      }
     }
 
     if (num_un_res > 0) {
-      j_u_.resize(num_un_res, num_poses);
-      jt_u_.resize(num_poses, num_un_res);
       r_u_.resize(num_un_res*UnaryResidual::kResSize);
-
-      j_u_.setZero();
-      jt_u_.setZero();
       r_u_.setZero();
+      if (!direct_assembly) {
+        j_u_.resize(num_un_res, num_poses);
+        jt_u_.resize(num_poses, num_un_res);
+        j_u_.setZero();
+        jt_u_.setZero();
+      }
     }
 
     if (num_im_res > 0) {
-      j_i_.resize(num_im_res, num_poses);
-      jt_i_.resize(num_poses, num_im_res);
       r_i_.resize(num_im_res*ImuResidual::kResSize);
-
-      j_i_.setZero();
-      jt_i_.setZero();
       r_i_.setZero();
+      if (!direct_assembly) {
+        j_i_.resize(num_im_res, num_poses);
+        jt_i_.resize(num_poses, num_im_res);
+        j_i_.setZero();
+        jt_i_.setZero();
+      }
 
-      if (kTvsInCalib) {
+      if (kTvsInCalib && !direct_assembly) {
         j_ki_.resize(num_im_res, 1);
         jt_ki_.resize(1, num_im_res);
         j_ki_.setZero();
@@ -1236,12 +2665,12 @@ namespace ba {
 
     is_param_mask_used_ = false;
 
+    CacheTsw();
+    UpdateProjectionPairs();
+
     // go through all the poses to check if they are all active
     bool are_all_active = true;
     for (Pose& pose : poses_) {
-      for (int ii = 0; ii < rig_->cameras_.size(); ++ii) {
-        pose.GetTsw(ii, rig_);
-      }
       if (pose.is_active == false) {
         are_all_active = false;
         break;
@@ -1341,13 +2770,37 @@ namespace ba {
 
     ParallelProjectionResiduals<BundleAdjuster<Scalar, LmSize, PoseSize,
         CalibSize, DoTvs>, Scalar> parallel_proj(*this);
+    parallel_proj.compute_jacobians = !fused;
+    parallel_proj.use_projection_pairs = true;
+    parallel_proj.use_batched_projections = true;
+
+    // The residuals, and the projection jacobians of the cameras with a
+    // batched kernel, are evaluated in batches. The rest of the jacobians
+    // is chained per residual, here or per landmark track when fused.
+    EvaluateProjectionResiduals(true);
+    const tbb::blocked_range<int> proj_range(0, proj_residuals_.size());
+    if (fused) {
+      tbb::parallel_for(proj_range, [&](const tbb::blocked_range<int>& r) {
+        for (int ii = r.begin(); ii != r.end(); ++ii) {
+          ProjectionResidual& res = proj_residuals_[ii];
+          res.weight = res.orig_weight;
+          res.mahalanobis_distance = res.residual.squaredNorm() * res.weight;
+        }
+      });
+    } else if (parallel_proj.IsThreadSafe()) {
+      tbb::parallel_reduce(proj_range, parallel_proj);
+    } else {
+      parallel_proj(proj_range);
+    }
 
-    // tbb::parallel_reduce(tbb::blocked_range<int>(0, proj_residuals_.size()),
-    //                      parallel_proj);
-    parallel_proj(tbb::blocked_range<int>(0, proj_residuals_.size()));
-
-    cond_errors = parallel_proj.cond_errors;
-    errors_ = parallel_proj.errors;
+    // The distances are used to calculate the robust norm.
+    for (const ProjectionResidual& res : proj_residuals_) {
+      if (res.is_conditioning) {
+        cond_errors.push_back(res.mahalanobis_distance);
+      } else {
+        errors_.push_back(res.mahalanobis_distance);
+      }
+    }
 
 
     // get the sigma for robust norm calculation. This call is O(n) on average,
@@ -1494,7 +2947,9 @@ namespace ba {
     tbb::parallel_reduce(tbb::blocked_range<int>(
         0, inertial_residuals_.size()), parallel_in);
 
-    errors_ = parallel_proj.errors;
+    // The robust norm of the inertial residuals is scaled by their own
+    // errors, which also fills r_i_ when there are no projection residuals.
+    errors_.swap(parallel_in.errors);
     StartTimer(_j_evaluation_inertial_sqrt_);
     if (errors_.size() > 0) {
       auto it = errors_.begin()+std::floor(errors_.size()* 0.5);
@@ -1575,7 +3030,7 @@ namespace ba {
 
     StreamMessage(debug_level + 1) << "Reserving jacobians..." << std::endl;
 
-    if (!proj_residuals_.empty() && num_poses > 0) {
+    if (!direct_assembly && !proj_residuals_.empty() && num_poses > 0) {
       j_pr_.reserve(j_pr_sizes);
       jt_pr.reserve(Eigen::VectorXi::Constant(jt_pr.cols(),
                                               kLmDim == 1 ? 2 : 1));
@@ -1586,17 +3041,17 @@ namespace ba {
       }
     }
 
-    if (!binary_residuals_.empty()) {
+    if (!direct_assembly && !binary_residuals_.empty()) {
       j_pp_.reserve(j_pp_sizes);
       jt_pp_.reserve(Eigen::VectorXi::Constant(jt_pp_.cols(), 2));
     }
 
-    if (!unary_residuals_.empty()) {
+    if (!direct_assembly && !unary_residuals_.empty()) {
       j_u_.reserve(j_u_sizes);
       jt_u_.reserve(Eigen::VectorXi::Constant(jt_u_.cols(), 1));
     }
 
-    if (!inertial_residuals_.empty()) {
+    if (!direct_assembly && !inertial_residuals_.empty()) {
       j_i_.reserve(j_i_sizes);
       jt_i_.reserve(Eigen::VectorXi::Constant(jt_i_.cols(), 2));
 
@@ -1606,7 +3061,7 @@ namespace ba {
       }
     }
 
-    if (num_lm > 0) {
+    if (!direct_assembly && num_lm > 0) {
       j_l_.reserve(j_l_sizes);
     }
 
@@ -1621,13 +3076,19 @@ namespace ba {
               res.x_meas_id == pose.id ? res.dz_dx_meas : res.dz_dx_ref;
           if (pose.is_param_mask_used) {
             is_param_mask_used_ = true;
-            for (uint32_t ii = 0 ; ii < kPrPoseDim ; ++ii) {
+            // With fused linearization the jacobians are not evaluated yet,
+            // LinearizeLandmarks masks them.
+            for (uint32_t ii = 0 ; ii < kPrPoseDim && !fused ; ++ii) {
               if (!pose.param_mask[ii]) {
                 dz_dx.col(ii).setZero();
               }
             }
           }
 
+          if (direct_assembly) {
+            continue;
+          }
+
           // StreamMessage(debug_level) << "Inserting into " << res.residual_id <<
           //                               ", " << pose.opt_id << std::endl;
           // insert the jacobians into the sparse matrices
@@ -1659,6 +3120,10 @@ namespace ba {
             }
           }
 
+          if (direct_assembly) {
+            continue;
+          }
+
           j_pp_.insert(
                 res.residual_id, pose.opt_id ).setZero().template block<6,6>(0,0) =
               res.cov_inv_sqrt * dz_dz;
@@ -1680,6 +3145,9 @@ namespace ba {
               }
             }
           }
+          if (direct_assembly) {
+            continue;
+          }
           j_u_.insert(
                 res.residual_id, pose.opt_id ).setZero().template block<6,6>(0,0) =
               res.cov_inv_sqrt * res.dz_dx;
@@ -1704,6 +3172,12 @@ namespace ba {
             }
           }
 
+          // The masked jacobian is only a copy, direct assembly masks it
+          // again with GetMaskedImuJacobian.
+          if (direct_assembly) {
+            continue;
+          }
+
           j_i_.insert(
                 res.residual_id, pose.opt_id ) = res.cov_inv_sqrt * dz_dz;
 
@@ -1730,7 +3204,7 @@ namespace ba {
 
     // fill in calibration jacobians
     StartTimer(_j_insertion_calib);
-    if (kCalibDim > 0) {
+    if (kCalibDim > 0 && !direct_assembly) {
       if (kGravityInCalib) {
         for (const ImuResidual& res : inertial_residuals_) {
           // include gravity terms (t total)
@@ -1786,7 +3260,7 @@ namespace ba {
 
     StartTimer(_j_insertion_landmarks);
     for (Landmark& lm : landmarks_) {
-      if (lm.is_active) {
+      if (lm.is_active && !direct_assembly) {
         // sort the measurements by id so the sparse insert is O(1)
         std::sort(lm.proj_residuals.begin(), lm.proj_residuals.end());
         for (const int id: lm.proj_residuals) {
@@ -1802,6 +3276,955 @@ namespace ba {
     PrintTimer(_j_insertion_);
   }
 
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  BuildAssemblyPattern(const std::vector<uint32_t>& pose_ids,
+                       const std::vector<uint32_t>& lm_ids)
+  {
+    const uint32_t num_poses = num_active_poses_;
+    const uint32_t num_lm = num_active_landmarks_;
+    const bool triangular = options_.use_triangular_matrices;
+
+    // The pattern of u_: the diagonal, and every pose sharing a residual.
+    std::vector<std::vector<int>> pattern(num_poses);
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_poses),
+                      [&](const tbb::blocked_range<uint32_t>& r) {
+      for (uint32_t ii = r.begin(); ii != r.end(); ++ii) {
+        const Pose& pose = poses_[pose_ids[ii]];
+        std::vector<int>& rows = pattern[ii];
+        rows.push_back(ii);
+        auto add_pose = [&](const uint32_t id) {
+          const Pose& other = poses_[id];
+          if (other.is_active && (!triangular || other.opt_id <= ii)) {
+            rows.push_back(other.opt_id);
+          }
+        };
+        uint32_t ids[2];
+        for (const int id : pose.proj_residuals) {
+          const uint32_t num_ids =
+              GetProjectionResidualPoses(proj_residuals_[id], ids);
+          for (uint32_t kk = 0; kk < num_ids; ++kk) {
+            add_pose(ids[kk]);
+          }
+        }
+        for (const int id : pose.binary_residuals) {
+          add_pose(binary_residuals_[id].x1_id);
+          add_pose(binary_residuals_[id].x2_id);
+        }
+        for (const int id : pose.inertial_residuals) {
+          add_pose(inertial_residuals_[id].pose1_id);
+          add_pose(inertial_residuals_[id].pose2_id);
+        }
+        std::sort(rows.begin(), rows.end());
+        rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+      }
+    });
+    Eigen::SparseBlockSetPattern(pattern, num_poses, num_poses, u_);
+
+    // jt_pr_j_l_ has a block for each pose observing a landmark.
+    const bool is_w_used = !lm_ids.empty() && num_poses > 0;
+    if (is_w_used) {
+      pattern.clear();
+      pattern.resize(num_lm);
+      tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_lm),
+                        [&](const tbb::blocked_range<uint32_t>& r) {
+        uint32_t ids[2];
+        for (uint32_t ii = r.begin(); ii != r.end(); ++ii) {
+          std::vector<int>& rows = pattern[ii];
+          for (const int id : landmarks_[lm_ids[ii]].proj_residuals) {
+            const uint32_t num_ids =
+                GetProjectionResidualPoses(proj_residuals_[id], ids);
+            for (uint32_t kk = 0; kk < num_ids; ++kk) {
+              if (poses_[ids[kk]].is_active) {
+                rows.push_back(poses_[ids[kk]].opt_id);
+              }
+            }
+          }
+          std::sort(rows.begin(), rows.end());
+          rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+        }
+      });
+      Eigen::SparseBlockSetPattern(pattern, num_poses, num_lm, jt_pr_j_l_);
+    }
+
+    if (kJkprUsed && !lm_ids.empty()) {
+      pattern.assign(1, std::vector<int>(num_lm));
+      for (uint32_t ii = 0; ii < num_lm; ++ii) {
+        pattern[0][ii] = ii;
+      }
+      Eigen::SparseBlockSetPattern(pattern, num_lm, 1, jt_l_j_kpr_);
+    }
+
+    // The position in u_ of the block (row pose, column pose), if stored.
+    auto u_index = [&](const uint32_t col_id, const uint32_t row_id) {
+      const Pose& col = poses_[col_id];
+      const Pose& row = poses_[row_id];
+      if (!col.is_active || !row.is_active ||
+          (triangular && row.opt_id > col.opt_id)) {
+        return -1;
+      }
+      return int(Eigen::SparseBlockFind(u_, col.opt_id, row.opt_id) -
+                 u_.valuePtr());
+    };
+
+    proj_u_index_.resize(proj_residuals_.size());
+    proj_w_index_.resize(proj_residuals_.size());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, proj_residuals_.size()),
+                      [&](const tbb::blocked_range<size_t>& r) {
+      uint32_t ids[2];
+      for (size_t ii = r.begin(); ii != r.end(); ++ii) {
+        const ProjectionResidual& res = proj_residuals_[ii];
+        std::array<int, 4>& u_pos = proj_u_index_[ii];
+        std::array<int, 2>& w_pos = proj_w_index_[ii];
+        u_pos.fill(-1);
+        w_pos.fill(-1);
+        const uint32_t num_ids = GetProjectionResidualPoses(res, ids);
+        const Landmark& lm = landmarks_[res.landmark_id];
+        for (uint32_t col = 0; col < num_ids; ++col) {
+          for (uint32_t row = 0; row < num_ids; ++row) {
+            u_pos[col * 2 + row] = u_index(ids[col], ids[row]);
+          }
+          const Pose& pose = poses_[ids[col]];
+          if (is_w_used && lm.is_active && pose.is_active) {
+            w_pos[col] = int(Eigen::SparseBlockFind(
+                jt_pr_j_l_, lm.opt_id, pose.opt_id) - jt_pr_j_l_.valuePtr());
+          }
+        }
+      }
+    });
+
+    binary_u_index_.resize(binary_residuals_.size());
+    for (const BinaryResidual& res : binary_residuals_) {
+      const uint32_t ids[2] = { res.x1_id, res.x2_id };
+      for (uint32_t col = 0; col < 2; ++col) {
+        for (uint32_t row = 0; row < 2; ++row) {
+          binary_u_index_[res.residual_id][col * 2 + row] =
+              u_index(ids[col], ids[row]);
+        }
+      }
+    }
+
+    unary_u_index_.resize(unary_residuals_.size());
+    for (const UnaryResidual& res : unary_residuals_) {
+      unary_u_index_[res.residual_id] = u_index(res.pose_id, res.pose_id);
+    }
+
+    inertial_u_index_.resize(inertial_residuals_.size());
+    for (const ImuResidual& res : inertial_residuals_) {
+      const uint32_t ids[2] = { res.pose1_id, res.pose2_id };
+      for (uint32_t col = 0; col < 2; ++col) {
+        for (uint32_t row = 0; row < 2; ++row) {
+          inertial_u_index_[res.residual_id][col * 2 + row] =
+              u_index(ids[col], ids[row]);
+        }
+      }
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  AssembleHessian()
+  {
+    // Forms u_, rhs_p_, jt_pr_j_l_ and the calibration terms (s_kk_, s_pk_,
+    // rhs_k_ and jt_l_j_kpr_) without the block sparse jacobians. Each
+    // column is accumulated by a single task, from the residual lists of its
+    // pose or landmark, so no synchronization is needed. The patterns are
+    // only built once per problem structure, later calls refill the values
+    // through the per-residual indices.
+    typedef Eigen::Matrix<Scalar, kPoseDim, kPoseDim> PoseBlock;
+    const uint32_t num_poses = num_active_poses_;
+    const uint32_t num_lm = num_active_landmarks_;
+
+    std::vector<uint32_t> pose_ids(num_poses);
+    for (const Pose& pose : poses_) {
+      if (pose.is_active) {
+        pose_ids[pose.opt_id] = pose.id;
+      }
+    }
+    std::vector<uint32_t> lm_ids(kLmDim > 0 ? num_lm : 0);
+    for (uint32_t ii = 0; ii < landmarks_.size(); ++ii) {
+      if (kLmDim > 0 && landmarks_[ii].is_active) {
+        lm_ids[landmarks_[ii].opt_id] = ii;
+      }
+    }
+    const bool is_w_used = !lm_ids.empty() && num_poses > 0;
+
+    StartTimer(_assemble_pattern_);
+    if (!is_assembly_pattern_valid_) {
+      BuildAssemblyPattern(pose_ids, lm_ids);
+      is_assembly_pattern_valid_ = true;
+    } else {
+      Eigen::SparseBlockZeroValues(u_);
+      if (is_w_used) {
+        Eigen::SparseBlockZeroValues(jt_pr_j_l_);
+      }
+    }
+    PrintTimer(_assemble_pattern_);
+
+    // With fused linearization the projection jacobians are evaluated here,
+    // together with the landmark columns of jt_pr_j_l_ and jt_l_j_kpr_.
+    const bool fused = IsFusedLinearizationUsed();
+    if (fused) {
+      StartTimer(_assemble_landmarks_);
+      LinearizeLandmarks(lm_ids);
+      PrintTimer(_assemble_landmarks_);
+    }
+
+    // Column ii of u_ holds J_a^T W J_ii for the poses a sharing a residual
+    // with pose ii, and rhs_p_ the matching segment of J^T W r.
+    StartTimer(_assemble_u_);
+    PoseBlock* u_values = u_.valuePtr();
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_poses),
+                      [&](const tbb::blocked_range<uint32_t>& r) {
+      for (uint32_t ii = r.begin(); ii != r.end(); ++ii) {
+        const Pose& pose = poses_[pose_ids[ii]];
+        auto rhs = rhs_p_.template segment<kPoseDim>(ii * kPoseDim);
+
+        uint32_t ids[2];
+        for (const int id : pose.proj_residuals) {
+          const ProjectionResidual& res = proj_residuals_[id];
+          const uint32_t col = res.x_meas_id == pose.id ? 0 : 1;
+          const Eigen::Matrix<Scalar, 2, 6>& dz_dx =
+              col == 0 ? res.dz_dx_meas : res.dz_dx_ref;
+          rhs.template head<kPrPoseDim>() += dz_dx.transpose() *
+              sqrt(res.weight) *
+              r_pr_.template segment<ProjectionResidual::kResSize>(
+                res.residual_id * ProjectionResidual::kResSize);
+          const uint32_t num_ids = GetProjectionResidualPoses(res, ids);
+          for (uint32_t row = 0; row < num_ids; ++row) {
+            const int pos = proj_u_index_[id][col * 2 + row];
+            if (pos >= 0) {
+              const Eigen::Matrix<Scalar, 2, 6>& dz_dx_a =
+                  row == 0 ? res.dz_dx_meas : res.dz_dx_ref;
+              u_values[pos].template topLeftCorner<kPrPoseDim, kPrPoseDim>() +=
+                  dz_dx_a.transpose() * res.weight * dz_dx;
+            }
+          }
+        }
+
+        for (const int id : pose.binary_residuals) {
+          const BinaryResidual& res = binary_residuals_[id];
+          const uint32_t col = res.x1_id == pose.id ? 0 : 1;
+          const Eigen::Matrix<Scalar, 6, 6>& dz_dx =
+              col == 0 ? res.dz_dx1 : res.dz_dx2;
+          const Eigen::Matrix<Scalar, 6, 6> j_ii = res.cov_inv_sqrt * dz_dx;
+          rhs.template head<6>() += dz_dx.transpose() * res.cov_inv_sqrt *
+              res.weight * r_pp_.template segment<BinaryResidual::kResSize>(
+                res.residual_id * BinaryResidual::kResSize);
+          const uint32_t num_rows = res.x1_id == res.x2_id ? 1 : 2;
+          for (uint32_t row = 0; row < num_rows; ++row) {
+            const int pos = binary_u_index_[id][col * 2 + row];
+            if (pos >= 0) {
+              const Eigen::Matrix<Scalar, 6, 6>& dz_dx_a =
+                  row == 0 ? res.dz_dx1 : res.dz_dx2;
+              u_values[pos].template topLeftCorner<6, 6>() +=
+                  dz_dx_a.transpose() * res.cov_inv_sqrt * res.weight * j_ii;
+            }
+          }
+        }
+
+        for (const int id : pose.unary_residuals) {
+          const UnaryResidual& res = unary_residuals_[id];
+          const Eigen::Matrix<Scalar, 6, 6> jt =
+              res.dz_dx.transpose() * res.cov_inv_sqrt;
+          rhs.template head<6>() += jt *
+              r_u_.template segment<UnaryResidual::kResSize>(
+                res.residual_id * UnaryResidual::kResSize);
+          u_values[unary_u_index_[id]].template topLeftCorner<6, 6>() +=
+              jt * res.cov_inv_sqrt * res.dz_dx;
+        }
+
+        for (const int id : pose.inertial_residuals) {
+          const ImuResidual& res = inertial_residuals_[id];
+          const uint32_t col = res.pose1_id == pose.id ? 0 : 1;
+          const Eigen::Matrix<Scalar, ImuResidual::kResSize, kPoseDim> dz_dx =
+              GetMaskedImuJacobian(res, pose);
+          const Eigen::Matrix<Scalar, ImuResidual::kResSize, kPoseDim> j_ii =
+              res.cov_inv_sqrt * dz_dx;
+          rhs += dz_dx.transpose() * res.cov_inv_sqrt *
+              r_i_.template segment<ImuResidual::kResSize>(
+                res.residual_id * ImuResidual::kResSize);
+          const uint32_t num_rows = res.pose1_id == res.pose2_id ? 1 : 2;
+          for (uint32_t row = 0; row < num_rows; ++row) {
+            const int pos = inertial_u_index_[id][col * 2 + row];
+            if (pos >= 0) {
+              const Pose& row_pose =
+                  poses_[row == 0 ? res.pose1_id : res.pose2_id];
+              u_values[pos] += GetMaskedImuJacobian(res, row_pose).transpose() *
+                  res.cov_inv_sqrt * j_ii;
+            }
+          }
+        }
+      }
+    });
+    PrintTimer(_assemble_u_);
+
+    // jt_pr_j_l_, one landmark column per task.
+    StartTimer(_assemble_w_);
+    if (is_w_used && !fused) {
+      Eigen::Matrix<Scalar, kPrPoseDim, kLmDim>* w_values =
+          jt_pr_j_l_.valuePtr();
+      tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_lm),
+                        [&](const tbb::blocked_range<uint32_t>& r) {
+        uint32_t ids[2];
+        for (uint32_t ii = r.begin(); ii != r.end(); ++ii) {
+          for (const int id : landmarks_[lm_ids[ii]].proj_residuals) {
+            const ProjectionResidual& res = proj_residuals_[id];
+            const uint32_t num_ids = GetProjectionResidualPoses(res, ids);
+            for (uint32_t kk = 0; kk < num_ids; ++kk) {
+              const int pos = proj_w_index_[id][kk];
+              if (pos >= 0) {
+                const Eigen::Matrix<Scalar, 2, 6>& dz_dx =
+                    kk == 0 ? res.dz_dx_meas : res.dz_dx_ref;
+                w_values[pos] += dz_dx.transpose() * res.weight * res.dz_dlm;
+              }
+            }
+          }
+        }
+      });
+    }
+    PrintTimer(_assemble_w_);
+
+    if (!kJkprUsed) {
+      return;
+    }
+
+    // The calibration terms. All projection residuals contribute to s_kk_ and
+    // rhs_k_, as in j_kpr_.
+    StartTimer(_assemble_k_);
+    for (const ProjectionResidual& res : proj_residuals_) {
+      const Eigen::Matrix<Scalar, ProjectionResidual::kResSize, kCalibDim>
+          dz_dk = GetCalibrationJacobian(res);
+      s_kk_ += dz_dk.transpose() * res.weight * dz_dk;
+      rhs_k_ += dz_dk.transpose() * sqrt(res.weight) *
+          r_pr_.template segment<ProjectionResidual::kResSize>(
+            res.residual_id * ProjectionResidual::kResSize);
+    }
+
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_poses),
+                      [&](const tbb::blocked_range<uint32_t>& r) {
+      for (uint32_t ii = r.begin(); ii != r.end(); ++ii) {
+        const Pose& pose = poses_[pose_ids[ii]];
+        for (const int id : pose.proj_residuals) {
+          const ProjectionResidual& res = proj_residuals_[id];
+          const Eigen::Matrix<Scalar, 2, 6>& dz_dx =
+              res.x_meas_id == pose.id ? res.dz_dx_meas : res.dz_dx_ref;
+          s_pk_.template block<kPrPoseDim, kCalibDim>(ii * kPoseDim, 0) +=
+              dz_dx.transpose() * res.weight * GetCalibrationJacobian(res);
+        }
+      }
+    });
+
+    // jt_l_j_kpr_ is a single column holding every landmark in order.
+    if (!lm_ids.empty() && !fused) {
+      tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_lm),
+                        [&](const tbb::blocked_range<uint32_t>& r) {
+        for (uint32_t ii = r.begin(); ii != r.end(); ++ii) {
+          Eigen::Matrix<Scalar, kLmDim, kCalibDim>& jt_l_j_k =
+              jt_l_j_kpr_.valuePtr()[ii];
+          jt_l_j_k.setZero();
+          for (const int id : landmarks_[lm_ids[ii]].proj_residuals) {
+            const ProjectionResidual& res = proj_residuals_[id];
+            jt_l_j_k += res.dz_dlm.transpose() * res.weight *
+                GetCalibrationJacobian(res);
+          }
+        }
+      });
+    }
+    PrintTimer(_assemble_k_);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  AccumulateLandmarkHessian(Landmark& lm)
+  {
+    // Forms the hessian block of an active landmark, its inverse in vi_ and
+    // its segment of rhs_l_. Only the landmark's own entries are written.
+    if (kLmDim == 1) {
+      // Inverse depth: the landmark hessian and its inverse are scalars,
+      // accumulated from dot products of the 2x1 jacobians.
+      Scalar jtj = 0, jtr = 0;
+      for (const int id : lm.proj_residuals) {
+        const ProjectionResidual& res = proj_residuals_[id];
+        const auto dz_dlm = res.dz_dlm.col(0);
+        jtj += dz_dlm.squaredNorm() * res.weight;
+        jtr += dz_dlm.dot(
+              r_pr_.template segment<ProjectionResidual::kResSize>(
+                res.residual_id*ProjectionResidual::kResSize)) *
+            sqrt(res.weight);
+      }
+      if (fabs(jtj) < 1e-6) {
+        jtj += 1e-6;
+      }
+      lm.jtj(0,0) = jtj;
+      rhs_l_[lm.opt_id] = jtr;
+      (*Eigen::SparseBlockFind(vi_, lm.opt_id, lm.opt_id))(0,0) = 1.0 / jtj;
+      return;
+    }
+
+    Eigen::Matrix<Scalar,kLmDim,1> jtr_l;
+    lm.jtj.setZero();
+    jtr_l.setZero();
+    for (const int id : lm.proj_residuals) {
+      const ProjectionResidual& res = proj_residuals_[id];
+      lm.jtj += (res.dz_dlm.transpose() * res.dz_dlm) * res.weight;
+      jtr_l += (res.dz_dlm.transpose() * sqrt(res.weight) *
+                r_pr_.template block<ProjectionResidual::kResSize,1>(
+                  res.residual_id*ProjectionResidual::kResSize, 0));
+    }
+    rhs_l_.template block<kLmDim,1>(lm.opt_id*kLmDim, 0) = jtr_l;
+    if (lm.jtj.norm() < 1e-6) {
+      lm.jtj.diagonal() += Eigen::Matrix<Scalar, kLmDim, 1>::Constant(1e-6);
+    }
+    *Eigen::SparseBlockFind(vi_, lm.opt_id, lm.opt_id) = lm.jtj.inverse();
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  LinearizeLandmarks(const std::vector<uint32_t>& lm_ids)
+  {
+    // Evaluates the projection jacobians one landmark track at a time and,
+    // while they are in cache, forms the parts of the reduced system owned
+    // by the landmark: its hessian block, inverse and rhs_l_ segment, its
+    // column of jt_pr_j_l_ and its block of jt_l_j_kpr_. The pose columns of
+    // u_ are accumulated afterwards from the stored pose jacobians, as the
+    // landmarks of a pose are spread over tasks. BuildProblem has already
+    // evaluated the residuals and the batched projection jacobians (and
+    // cached the t_sw of every pose) and the robust weights.
+    typedef ParallelProjectionResiduals<BundleAdjuster<Scalar, LmSize,
+        PoseSize, CalibSize, DoTvs>, Scalar> Linearizer;
+    const bool is_w_used = !lm_ids.empty() && num_active_poses_ > 0;
+    // One linearizer per thread, as with per pose camera parameters each
+    // re-parametrizes its own copies of the cameras.
+    tbb::enumerable_thread_specific<Linearizer> linearizers([&]() {
+      Linearizer linearizer(*this);
+      linearizer.use_projection_pairs = true;
+      linearizer.use_batched_projections = true;
+      return linearizer;
+    });
+    const bool is_thread_safe = linearizers.local().IsThreadSafe();
+
+    auto linearize = [&](const tbb::blocked_range<size_t>& r) {
+      Linearizer& linearizer = linearizers.local();
+      uint32_t ids[2];
+      for (size_t ii = r.begin(); ii != r.end(); ++ii) {
+        Landmark& lm = landmarks_[ii];
+        for (const int id : lm.proj_residuals) {
+          ProjectionResidual& res = proj_residuals_[id];
+          linearizer.Evaluate(res, false, true);
+          // Mask the pose jacobians as BuildProblem does with the explicit
+          // jacobians.
+          const uint32_t num_ids = GetProjectionResidualPoses(res, ids);
+          for (uint32_t kk = 0; kk < num_ids; ++kk) {
+            const Pose& pose = poses_[ids[kk]];
+            if (pose.is_active && pose.is_param_mask_used) {
+              Eigen::Matrix<Scalar, 2, 6>& dz_dx =
+                  kk == 0 ? res.dz_dx_meas : res.dz_dx_ref;
+              for (uint32_t jj = 0 ; jj < kPrPoseDim ; ++jj) {
+                if (!pose.param_mask[jj]) {
+                  dz_dx.col(jj).setZero();
+                }
+              }
+            }
+          }
+        }
+
+        if (!lm.is_active) {
+          continue;
+        }
+        AccumulateLandmarkHessian(lm);
+
+        if (is_w_used) {
+          Eigen::Matrix<Scalar, kPrPoseDim, kLmDim>* w_values =
+              jt_pr_j_l_.valuePtr();
+          for (const int id : lm.proj_residuals) {
+            const ProjectionResidual& res = proj_residuals_[id];
+            const uint32_t num_ids = GetProjectionResidualPoses(res, ids);
+            for (uint32_t kk = 0; kk < num_ids; ++kk) {
+              const int pos = proj_w_index_[id][kk];
+              if (pos >= 0) {
+                const Eigen::Matrix<Scalar, 2, 6>& dz_dx =
+                    kk == 0 ? res.dz_dx_meas : res.dz_dx_ref;
+                w_values[pos] += dz_dx.transpose() * res.weight * res.dz_dlm;
+              }
+            }
+          }
+        }
+
+        if (kJkprUsed) {
+          Eigen::Matrix<Scalar, kLmDim, kCalibDim>& jt_l_j_k =
+              jt_l_j_kpr_.valuePtr()[lm.opt_id];
+          jt_l_j_k.setZero();
+          for (const int id : lm.proj_residuals) {
+            const ProjectionResidual& res = proj_residuals_[id];
+            jt_l_j_k += res.dz_dlm.transpose() * res.weight *
+                GetCalibrationJacobian(res);
+          }
+        }
+      }
+    };
+
+    // Unless the cameras could be copied, the shared cameras are
+    // re-parametrized for every residual and the tracks are linearized
+    // serially.
+    const tbb::blocked_range<size_t> range(0, landmarks_.size());
+    if (!is_thread_safe) {
+      linearize(range);
+    } else {
+      tbb::parallel_for(range, linearize);
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  UpdateLandmarkCoupling()
+  {
+    // jt_l_j_pr_ and jt_pr_j_l_vi_ have the pattern of (the transpose of)
+    // jt_pr_j_l_, so they are only rebuilt when it changes. Otherwise only
+    // the values are copied, in parallel over the columns.
+    if (!schur_w_pattern_.Matches(jt_pr_j_l_)) {
+      decltype(jt_l_j_pr_)::forceTranspose(jt_pr_j_l_, jt_l_j_pr_);
+      jt_pr_j_l_vi_ = jt_pr_j_l_;
+      const int* outer = jt_l_j_pr_.outerIndexPtr();
+      const int* inner = jt_l_j_pr_.innerIndexPtr();
+      w_transpose_index_.resize(outer[jt_l_j_pr_.outerSize()]);
+      for (int jj = 0; jj < jt_l_j_pr_.outerSize(); ++jj) {
+        for (int pos = outer[jj]; pos < outer[jj + 1]; ++pos) {
+          w_transpose_index_[pos] = int(Eigen::SparseBlockFind(
+              jt_pr_j_l_, inner[pos], jj) - jt_pr_j_l_.valuePtr());
+        }
+      }
+      schur_w_pattern_.Assign(jt_pr_j_l_);
+      is_s_pp_index_valid_ = false;
+    }
+
+    const Eigen::Matrix<Scalar, kPrPoseDim, kLmDim>* w_values =
+        jt_pr_j_l_.valuePtr();
+    tbb::parallel_for(tbb::blocked_range<int>(0, jt_l_j_pr_.outerSize()),
+                      [&](const tbb::blocked_range<int>& r) {
+      const int* outer = jt_l_j_pr_.outerIndexPtr();
+      for (int jj = r.begin(); jj != r.end(); ++jj) {
+        for (int pos = outer[jj]; pos < outer[jj + 1]; ++pos) {
+          jt_l_j_pr_.valuePtr()[pos] =
+              w_values[w_transpose_index_[pos]].transpose();
+        }
+      }
+    });
+
+    // vi_ is block diagonal, with the block of landmark ii at position ii.
+    tbb::parallel_for(tbb::blocked_range<int>(0, jt_pr_j_l_.outerSize()),
+                      [&](const tbb::blocked_range<int>& r) {
+      const int* outer = jt_pr_j_l_.outerIndexPtr();
+      for (int ii = r.begin(); ii != r.end(); ++ii) {
+        if (kLmDim == 1) {
+          // Inverse depth: vi_ holds scalars, so this is only a scaling.
+          const Scalar vi = vi_.valuePtr()[ii](0, 0);
+          for (int pos = outer[ii]; pos < outer[ii + 1]; ++pos) {
+            jt_pr_j_l_vi_.valuePtr()[pos] = w_values[pos] * vi;
+          }
+          continue;
+        }
+        for (int pos = outer[ii]; pos < outer[ii + 1]; ++pos) {
+          jt_pr_j_l_vi_.valuePtr()[pos] = w_values[pos] * vi_.valuePtr()[ii];
+        }
+      }
+    });
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  EliminateLandmarks(const bool form_s_pp, VectorXt& rhs_p_sc)
+  {
+    // Forms s_pp_ = u_ - W V^-1 W^T and the pose part of rhs_p_sc. Column jj
+    // of s_pp_ gathers the landmarks observed by pose jj (column jj of
+    // jt_l_j_pr_), and each of these adds a block for every pose observing
+    // it (its column in jt_pr_j_l_vi_). Every column is computed by a single
+    // task, so the landmark contributions are merged without locking. The
+    // pattern of s_pp_ and the position of every product in it are only
+    // computed when the patterns of u_ or jt_pr_j_l_ change.
+    typedef Eigen::Matrix<Scalar, kPoseDim, kPoseDim> PoseBlock;
+    const uint32_t num_poses = num_active_poses_;
+    const bool triangular = options_.use_triangular_matrices;
+    const int* u_outer = u_.outerIndexPtr();
+    const int* u_inner = u_.innerIndexPtr();
+    const int* wt_outer = jt_l_j_pr_.outerIndexPtr();
+    const int* wt_inner = jt_l_j_pr_.innerIndexPtr();
+    const int* w_outer = jt_pr_j_l_vi_.outerIndexPtr();
+    const int* w_inner = jt_pr_j_l_vi_.innerIndexPtr();
+
+    if (form_s_pp) {
+      if (!is_s_pp_index_valid_ || !schur_u_pattern_.Matches(u_)) {
+        s_pp_pattern_.assign(num_poses, std::vector<int>());
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_poses),
+                          [&](const tbb::blocked_range<uint32_t>& r) {
+          for (uint32_t jj = r.begin(); jj != r.end(); ++jj) {
+            std::vector<int>& rows = s_pp_pattern_[jj];
+            rows.assign(u_inner + u_outer[jj], u_inner + u_outer[jj + 1]);
+            for (int wt_pos = wt_outer[jj]; wt_pos < wt_outer[jj + 1];
+                 ++wt_pos) {
+              const int lm_id = wt_inner[wt_pos];
+              for (int w_pos = w_outer[lm_id]; w_pos < w_outer[lm_id + 1] &&
+                   (!triangular || w_inner[w_pos] <= (int)jj); ++w_pos) {
+                rows.push_back(w_inner[w_pos]);
+              }
+            }
+            std::sort(rows.begin(), rows.end());
+            rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+          }
+        });
+        Eigen::SparseBlockSetPattern(s_pp_pattern_, num_poses, num_poses,
+                                     s_pp_);
+
+        // The positions are recorded in the order of the loop below.
+        s_pp_u_index_.resize(u_outer[num_poses]);
+        s_pp_index_.resize(num_poses);
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_poses),
+                          [&](const tbb::blocked_range<uint32_t>& r) {
+          for (uint32_t jj = r.begin(); jj != r.end(); ++jj) {
+            for (int u_pos = u_outer[jj]; u_pos < u_outer[jj + 1]; ++u_pos) {
+              s_pp_u_index_[u_pos] = int(Eigen::SparseBlockFind(
+                  s_pp_, jj, u_inner[u_pos]) - s_pp_.valuePtr());
+            }
+            std::vector<int>& index = s_pp_index_[jj];
+            index.clear();
+            for (int wt_pos = wt_outer[jj]; wt_pos < wt_outer[jj + 1];
+                 ++wt_pos) {
+              const int lm_id = wt_inner[wt_pos];
+              for (int w_pos = w_outer[lm_id]; w_pos < w_outer[lm_id + 1] &&
+                   (!triangular || w_inner[w_pos] <= (int)jj); ++w_pos) {
+                index.push_back(int(Eigen::SparseBlockFind(
+                    s_pp_, jj, w_inner[w_pos]) - s_pp_.valuePtr()));
+              }
+            }
+          }
+        });
+        schur_u_pattern_.Assign(u_);
+        is_s_pp_index_valid_ = true;
+      } else if (!is_s_pp_pattern_current_) {
+        Eigen::SparseBlockSetPattern(s_pp_pattern_, num_poses, num_poses,
+                                     s_pp_);
+      }
+      is_s_pp_pattern_current_ = true;
+    }
+
+    PoseBlock* s_values = s_pp_.valuePtr();
+    const PoseBlock* u_values = u_.valuePtr();
+    const Eigen::Matrix<Scalar, kLmDim, kPrPoseDim>* wt_values =
+        jt_l_j_pr_.valuePtr();
+    const Eigen::Matrix<Scalar, kPrPoseDim, kLmDim>* w_vi_values =
+        jt_pr_j_l_vi_.valuePtr();
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_poses),
+                      [&](const tbb::blocked_range<uint32_t>& r) {
+      for (uint32_t jj = r.begin(); jj != r.end(); ++jj) {
+        auto rhs = rhs_p_sc.template segment<kPoseDim>(jj * kPoseDim);
+        rhs = rhs_p_.template segment<kPoseDim>(jj * kPoseDim);
+        const int* s_pos = nullptr;
+        if (form_s_pp) {
+          // Clear the values of the previous iteration, then copy u_.
+          for (int pos = s_pp_.outerIndexPtr()[jj];
+               pos < s_pp_.outerIndexPtr()[jj + 1]; ++pos) {
+            s_values[pos].setZero();
+          }
+          for (int u_pos = u_outer[jj]; u_pos < u_outer[jj + 1]; ++u_pos) {
+            s_values[s_pp_u_index_[u_pos]] = u_values[u_pos];
+          }
+          s_pos = s_pp_index_[jj].data();
+        }
+
+        if (kLmDim == 1) {
+          // Inverse depth: every landmark adds the rank-1 updates
+          // (w_a vi) w_b^T, evaluated as scaled outer products of the pose
+          // columns without the generic block product.
+          for (int wt_pos = wt_outer[jj]; wt_pos < wt_outer[jj + 1];
+               ++wt_pos) {
+            const int lm_id = wt_inner[wt_pos];
+            rhs.template head<kPrPoseDim>() -=
+                w_vi_values[w_transpose_index_[wt_pos]].col(0) *
+                rhs_l_[lm_id];
+            if (!form_s_pp) {
+              continue;
+            }
+            const auto w_b = wt_values[wt_pos].row(0);
+            for (int w_pos = w_outer[lm_id]; w_pos < w_outer[lm_id + 1] &&
+                 (!triangular || w_inner[w_pos] <= (int)jj); ++w_pos) {
+              s_values[*s_pos++].template topLeftCorner<kPrPoseDim,
+                                                         kPrPoseDim>()
+                  .noalias() -= w_vi_values[w_pos].col(0) * w_b;
+            }
+          }
+          continue;
+        }
+
+        for (int wt_pos = wt_outer[jj]; wt_pos < wt_outer[jj + 1]; ++wt_pos) {
+          const int lm_id = wt_inner[wt_pos];
+          rhs.template head<kPrPoseDim>() -=
+              w_vi_values[w_transpose_index_[wt_pos]] *
+              rhs_l_.template segment<kLmDim>(lm_id * kLmDim);
+          if (!form_s_pp) {
+            continue;
+          }
+          for (int w_pos = w_outer[lm_id]; w_pos < w_outer[lm_id + 1] &&
+               (!triangular || w_inner[w_pos] <= (int)jj); ++w_pos) {
+            s_values[*s_pos++].template topLeftCorner<kPrPoseDim,
+                                                       kPrPoseDim>() -=
+                w_vi_values[w_pos] * wt_values[wt_pos];
+          }
+        }
+      }
+    });
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  EliminateLandmarksFromCalibration(VectorXt& rhs_p_sc)
+  {
+    // The calibration parameters border the block sparse pose system, so
+    // the landmarks are eliminated from the border without forming it as a
+    // sparse product: the rows of s_pk_ of pose jj gather the landmarks it
+    // observes (column jj of jt_l_j_pr_), and s_kk_ and the calibration rhs
+    // sum over all landmarks.
+    typedef Eigen::Matrix<Scalar, kLmDim, kCalibDim> LmCalibBlock;
+    const uint32_t num_poses = num_active_poses_;
+    const uint32_t num_lm = num_active_landmarks_;
+
+    // jt_l_j_kpr_ has a single column, which need not hold every landmark
+    // with the explicit jacobians.
+    std::vector<const LmCalibBlock*> jt_l_j_k(num_lm, nullptr);
+    for (typename decltype(jt_l_j_kpr_)::InnerIterator it(jt_l_j_kpr_, 0);
+         it; ++it) {
+      jt_l_j_k[it.index()] = &it.value();
+    }
+
+    if (num_poses > 0) {
+      const int* wt_outer = jt_l_j_pr_.outerIndexPtr();
+      const int* wt_inner = jt_l_j_pr_.innerIndexPtr();
+      const Eigen::Matrix<Scalar, kPrPoseDim, kLmDim>* w_vi_values =
+          jt_pr_j_l_vi_.valuePtr();
+      tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_poses),
+                        [&](const tbb::blocked_range<uint32_t>& r) {
+        for (uint32_t jj = r.begin(); jj != r.end(); ++jj) {
+          auto s_pk = s_pk_.template block<kPrPoseDim, kCalibDim>(
+                jj * kPoseDim, 0);
+          for (int wt_pos = wt_outer[jj]; wt_pos < wt_outer[jj + 1];
+               ++wt_pos) {
+            const LmCalibBlock* jt_l_j_kpr = jt_l_j_k[wt_inner[wt_pos]];
+            if (jt_l_j_kpr != nullptr) {
+              s_pk.noalias() -=
+                  w_vi_values[w_transpose_index_[wt_pos]] * *jt_l_j_kpr;
+            }
+          }
+        }
+      });
+    }
+
+    Eigen::Matrix<Scalar, kCalibDim, kCalibDim> s_kk;
+    Eigen::Matrix<Scalar, kCalibDim, 1> rhs_k;
+    s_kk.setZero();
+    rhs_k.setZero();
+    for (uint32_t ii = 0; ii < num_lm; ++ii) {
+      if (jt_l_j_k[ii] == nullptr) {
+        continue;
+      }
+      const Eigen::Matrix<Scalar, kCalibDim, kLmDim> jt_kpr_j_l_vi =
+          jt_l_j_k[ii]->transpose() * vi_.valuePtr()[ii];
+      s_kk.noalias() += jt_kpr_j_l_vi * *jt_l_j_k[ii];
+      rhs_k.noalias() += jt_kpr_j_l_vi *
+          rhs_l_.template segment<kLmDim>(ii * kLmDim);
+    }
+    s_kk_ -= s_kk;
+    rhs_p_sc.template tail<kCalibDim>() -= rhs_k;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  WriteReducedCameraMatrix(const VectorXt& rhs_p_sc, const uint32_t iteration)
+  {
+    const uint32_t num_pose_params = num_active_poses_ * kPoseDim;
+    std::cerr << "Writing reduced camera matrix for " << num_pose_params <<
+                 " pose parameters and " << kCalibDim << " calib "
+                 " parameters " << std::endl;
+
+    // The csv files keep their names (e.g. ./s.txt) and are overwritten by
+    // each iteration. The other formats are tagged, e.g. ./s_pp_3_0.mtx for
+    // the first iteration of the third Solve() call.
+    const std::string tag =
+        options_.reduced_camera_matrix_format == ExportCsv ? std::string() :
+        "_" + std::to_string(num_solves_) + "_" + std::to_string(iteration);
+    auto path = [&](const char* name, const char* extension) {
+      return options_.reduced_camera_matrix_directory + "/" + name + tag +
+          extension;
+    };
+
+    bool success = true;
+    if (options_.reduced_camera_matrix_format == ExportCsv) {
+      // The dense reduced camera matrix s_ is loaded in Solve().
+      success &= bool(std::ofstream(path("s", ".txt"), std::ios_base::trunc) <<
+                      s_.format(kLongCsvFmt));
+      success &= bool(std::ofstream(path("rhs", ".txt"), std::ios_base::trunc) <<
+                      rhs_p_sc.format(kLongCsvFmt));
+
+      MatrixXt dj_pr(j_pr_.rows() * ProjectionResidual::kResSize,
+                     j_pr_.cols() * kPrPoseDim);
+      Eigen::LoadDenseFromSparse(j_pr_, dj_pr);
+      success &= bool(std::ofstream(path("j_pr", ".txt"), std::ios_base::trunc) <<
+                      dj_pr.format(kLongCsvFmt));
+
+      success &= bool(std::ofstream(path("r_pr", ".txt"), std::ios_base::trunc) <<
+                      r_pr_.format(kLongCsvFmt));
+
+      MatrixXt dj_l(j_l_.rows() * ProjectionResidual::kResSize,
+                    j_l_.cols() * kLmDim);
+      Eigen::LoadDenseFromSparse(j_l_, dj_l);
+      success &= bool(std::ofstream(path("j_l", ".txt"), std::ios_base::trunc) <<
+                      dj_l.format(kLongCsvFmt));
+
+      MatrixXt dj_kpr(j_kpr_.rows() * ProjectionResidual::kResSize,
+                      j_kpr_.cols() * kCalibDim);
+      Eigen::LoadDenseFromSparse(j_kpr_, dj_kpr);
+      success &= bool(std::ofstream(path("j_kpr", ".txt"), std::ios_base::trunc) <<
+                      dj_kpr.format(kLongCsvFmt));
+
+      MatrixXt djt_kpr_dj_kpr = (dj_kpr.transpose() * dj_kpr).eval();
+      success &= bool(std::ofstream(path("jt_kpr_j_kpr", ".txt"),
+                                    std::ios_base::trunc) <<
+                      djt_kpr_dj_kpr.format(kLongCsvFmt));
+    } else if (options_.reduced_camera_matrix_format == ExportMatrixMarket) {
+      // Only the upper triangle of s_pp_ is formed with triangular matrices,
+      // which the symmetric Matrix Market format expects.
+      success &= Eigen::WriteMatrixMarket(path("s_pp", ".mtx"), s_pp_,
+                                          options_.use_triangular_matrices);
+      if (kCalibDim > 0) {
+        success &= Eigen::WriteDenseMatrixMarket(path("s_pk", ".mtx"), s_pk_);
+        success &= Eigen::WriteDenseMatrixMarket(path("s_kk", ".mtx"), s_kk_);
+      }
+      success &= Eigen::WriteDenseMatrixMarket(path("rhs", ".mtx"), rhs_p_sc);
+      success &= Eigen::WriteMatrixMarket(path("j_pr", ".mtx"), j_pr_);
+      success &= Eigen::WriteDenseMatrixMarket(path("r_pr", ".mtx"), r_pr_);
+      success &= Eigen::WriteMatrixMarket(path("j_l", ".mtx"), j_l_);
+      if (kCalibDim > 0) {
+        success &= Eigen::WriteMatrixMarket(path("j_kpr", ".mtx"), j_kpr_);
+      }
+    } else {
+      // Binary files hold the full block pattern of s_pp_; with triangular
+      // matrices only its upper triangle is meaningful.
+      success &= Eigen::WriteBinary(path("s_pp", ".bin"), s_pp_);
+      if (kCalibDim > 0) {
+        success &= Eigen::WriteDenseBinary(path("s_pk", ".bin"), s_pk_);
+        success &= Eigen::WriteDenseBinary(path("s_kk", ".bin"), s_kk_);
+      }
+      success &= Eigen::WriteDenseBinary(path("rhs", ".bin"), rhs_p_sc);
+      success &= Eigen::WriteBinary(path("j_pr", ".bin"), j_pr_);
+      success &= Eigen::WriteDenseBinary(path("r_pr", ".bin"), r_pr_);
+      success &= Eigen::WriteBinary(path("j_l", ".bin"), j_l_);
+      if (kCalibDim > 0) {
+        success &= Eigen::WriteBinary(path("j_kpr", ".bin"), j_kpr_);
+      }
+    }
+
+    if (!success) {
+      std::cerr << "Failed to write the reduced camera matrix into " <<
+                   options_.reduced_camera_matrix_directory << std::endl;
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
+  void BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
+  MultiplyJacobians(VectorXt& j_p_rhs_p, VectorXt& j_kp_rhs_k,
+                    VectorXt& j_pp_rhs_p, VectorXt& j_u_rhs_p,
+                    VectorXt& j_i_rhs_p, VectorXt& j_l_rhs_l)
+  {
+    // The products of the (weighted) jacobians with rhs_p_, rhs_k_ and
+    // rhs_l_ used by the steepest descent step, evaluated per residual as
+    // the jacobian matrices are not formed with direct assembly.
+    const uint32_t kProjRes = ProjectionResidual::kResSize;
+    if (num_active_poses_ > 0) {
+      tbb::parallel_for(tbb::blocked_range<size_t>(0, proj_residuals_.size()),
+                        [&](const tbb::blocked_range<size_t>& r) {
+        uint32_t ids[2];
+        for (size_t ii = r.begin(); ii != r.end(); ++ii) {
+          const ProjectionResidual& res = proj_residuals_[ii];
+          auto j_p = j_p_rhs_p.template segment<kProjRes>(
+                res.residual_id * kProjRes);
+          const uint32_t num_ids = GetProjectionResidualPoses(res, ids);
+          for (uint32_t kk = 0; kk < num_ids; ++kk) {
+            const Pose& pose = poses_[ids[kk]];
+            if (pose.is_active) {
+              const Eigen::Matrix<Scalar, 2, 6>& dz_dx =
+                  res.x_meas_id == pose.id ? res.dz_dx_meas : res.dz_dx_ref;
+              j_p += dz_dx * sqrt(res.weight) *
+                  rhs_p_.template segment<kPrPoseDim>(pose.opt_id * kPoseDim);
+            }
+          }
+          if (kJkprUsed) {
+            j_kp_rhs_k.template segment<kProjRes>(res.residual_id * kProjRes) =
+                GetCalibrationJacobian(res) * sqrt(res.weight) * rhs_k_;
+          }
+        }
+      });
+
+      for (const BinaryResidual& res : binary_residuals_) {
+        for (const uint32_t id : { res.x1_id, res.x2_id }) {
+          if (poses_[id].is_active) {
+            j_pp_rhs_p.template segment<BinaryResidual::kResSize>(
+                  res.residual_id * BinaryResidual::kResSize) +=
+                res.cov_inv_sqrt * (res.x1_id == id ? res.dz_dx1 : res.dz_dx2) *
+                rhs_p_.template segment<6>(poses_[id].opt_id * kPoseDim);
+          }
+          if (res.x1_id == res.x2_id) {
+            break;
+          }
+        }
+      }
+
+      for (const UnaryResidual& res : unary_residuals_) {
+        if (poses_[res.pose_id].is_active) {
+          j_u_rhs_p.template segment<UnaryResidual::kResSize>(
+                res.residual_id * UnaryResidual::kResSize) +=
+              res.cov_inv_sqrt * res.dz_dx * rhs_p_.template segment<6>(
+                poses_[res.pose_id].opt_id * kPoseDim);
+        }
+      }
+
+      for (const ImuResidual& res : inertial_residuals_) {
+        for (const uint32_t id : { res.pose1_id, res.pose2_id }) {
+          const Pose& pose = poses_[id];
+          if (pose.is_active) {
+            j_i_rhs_p.template segment<ImuResidual::kResSize>(
+                  res.residual_id * ImuResidual::kResSize) +=
+                res.cov_inv_sqrt * GetMaskedImuJacobian(res, pose) *
+                rhs_p_.template segment<kPoseDim>(pose.opt_id * kPoseDim);
+          }
+          if (res.pose1_id == res.pose2_id) {
+            break;
+          }
+        }
+      }
+    }
+
+    if (num_active_landmarks_ > 0) {
+      for (const Landmark& lm : landmarks_) {
+        if (!lm.is_active) {
+          continue;
+        }
+        for (const int id : lm.proj_residuals) {
+          const ProjectionResidual& res = proj_residuals_[id];
+          j_l_rhs_l.template segment<kProjRes>(res.residual_id * kProjRes) =
+              res.dz_dlm * sqrt(res.weight) *
+              rhs_l_.template segment<kLmDim>(lm.opt_id * kLmDim);
+        }
+      }
+    }
+  }
+
   template<typename Scalar,int LmSize, int PoseSize, int CalibSize, bool DoTvs>
   double BundleAdjuster<Scalar, LmSize, PoseSize, CalibSize, DoTvs>::
   LandmarkOutlierRatio(const uint32_t id) const
@@ -1828,5 +4251,7 @@ namespace ba {
   // specializations required for the applications
 #ifdef BUILD_APPS
   template class BundleAdjuster<double, 0,9,0>;
+  template class BundleAdjuster<double, 3,6,0>;
+  template class BundleAdjuster<double, 3,6,4>;
 #endif
 }